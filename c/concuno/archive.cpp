@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+
+#include "archive.h"
+
+using namespace std;
+
+
+namespace concuno {
+
+
+/**
+ * Archive file header, before everything else.
+ */
+const char cnBagArchiveMagic[] = "cnbags1";
+
+
+/**
+ * Counts for each part of the archive, after the magic.
+ */
+struct ArchiveHeader {
+  Count bagCount;
+  Count entityCount;
+  Count entitySize;
+  Count indexCount;
+  Count optionCount;
+  Count propertyCount;
+  Count typeNameSize;
+};
+
+
+/**
+ * A bag with ranges into the entity indices and the option ranges.
+ */
+struct ArchiveBag {
+  Count entityBegin;
+  Count entityCount;
+  Count label;
+  Count optionBegin;
+  Count optionCount;
+};
+
+
+/**
+ * An offset property, followed by its name and then its type name.
+ */
+struct ArchiveProperty {
+  Count count;
+  Count nameSize;
+  Count offset;
+  Count typeNameSize;
+};
+
+
+/**
+ * A range of entity indices for one participant option list.
+ */
+struct ArchiveRange {
+  Count begin;
+  Count count;
+};
+
+
+/**
+ * Returns the size padded to the 8 bytes used for archive alignment.
+ */
+Count cnBagArchivePadded(Count size);
+
+
+/**
+ * Returns a pointer to the next size bytes, advancing at past them and any
+ * padding, or null if that goes past the end.
+ */
+const void* cnBagArchiveRead(char** at, char* end, Count size);
+
+
+/**
+ * Pushes the index of the entity, assigning the next index if new.
+ */
+bool cnBagArchiveSave_index(
+  unordered_map<Entity, Index>* indexOf, List<Entity>* entities,
+  List<Count>* indices, Entity entity
+);
+
+
+/**
+ * Writes the data and then any padding.
+ */
+bool cnBagArchiveWrite(FILE* file, const void* data, Count size);
+
+
+BagArchive::BagArchive(): type(NULL) {}
+
+
+BagArchive::~BagArchive() {
+  // Entities first, since the file holds what they point to.
+  cnBagListDispose(&bags, NULL);
+}
+
+
+bool BagArchive::load(const char* name, Schema& schema) {
+  const ArchiveBag* archiveBags;
+  char* at;
+  char* end;
+  char* entities;
+  Count entityStride;
+  const ArchiveHeader* header;
+  const Count* indices;
+  const ArchiveRange* options;
+  const char* typeName;
+  bool created = false;
+
+  // Clear out the old, and map the new.
+  cnBagListDispose(&bags, NULL);
+  cnListClear(&bags);
+  type = NULL;
+  if (!file.map(name)) cnErrTo(FAIL, "Couldn't map %s.", name);
+  at = file.data;
+  end = file.data + file.size;
+
+  // Header and type name.
+  if (!(
+    cnBagArchiveRead(&at, end, sizeof(cnBagArchiveMagic)) &&
+    !memcmp(file.data, cnBagArchiveMagic, sizeof(cnBagArchiveMagic))
+  )) cnErrTo(FAIL, "Not a bag archive: %s", name);
+  if (!(header = reinterpret_cast<const ArchiveHeader*>(
+    cnBagArchiveRead(&at, end, sizeof(ArchiveHeader))
+  ))) cnErrTo(FAIL, "No header.");
+  if (
+    header->bagCount < 0 || header->entityCount < 0 ||
+    header->entitySize <= 0 || header->indexCount < 0 ||
+    header->optionCount < 0 || header->propertyCount < 0
+  ) cnErrTo(FAIL, "Bad header.");
+  if (!(typeName = reinterpret_cast<const char*>(
+    cnBagArchiveRead(&at, end, header->typeNameSize)
+  ))) cnErrTo(FAIL, "No type name.");
+
+  // Find the type, or build it from the offset properties.
+  for (size_t t = 0; t < schema.types->size(); t++) {
+    Type* existing = schema.types[t];
+    if (existing->name == string(typeName, header->typeNameSize)) {
+      if (existing->size != header->entitySize) {
+        cnErrTo(FAIL, "Type %s has the wrong size.", existing->name.c_str());
+      }
+      type = existing;
+      break;
+    }
+  }
+  if (!type) {
+    type = new Type(schema, string(typeName, header->typeNameSize).c_str(), 0);
+    pushOrDelete(*schema.types, type);
+    type->size = header->entitySize;
+    created = true;
+  }
+  for (Index p = 0; p < header->propertyCount; p++) {
+    const ArchiveProperty* property;
+    const char* propertyName;
+    const char* propertyTypeName;
+    Type* propertyType = NULL;
+    if (!(
+      (property = reinterpret_cast<const ArchiveProperty*>(
+        cnBagArchiveRead(&at, end, sizeof(ArchiveProperty))
+      )) &&
+      (propertyName = reinterpret_cast<const char*>(
+        cnBagArchiveRead(&at, end, property->nameSize)
+      )) &&
+      (propertyTypeName = reinterpret_cast<const char*>(
+        cnBagArchiveRead(&at, end, property->typeNameSize)
+      ))
+    )) cnErrTo(FAIL, "No property.");
+    // Existing types have their own properties.
+    if (created) {
+      string typeName(propertyTypeName, property->typeNameSize);
+      for (size_t t = 0; t < schema.types->size(); t++) {
+        if (schema.types[t]->name == typeName) propertyType = schema.types[t];
+      }
+      if (!propertyType) cnErrTo(FAIL, "No type %s.", typeName.c_str());
+      type->properties.push(new OffsetProperty(
+        type, propertyType,
+        string(propertyName, property->nameSize).c_str(),
+        property->offset, property->count
+      ));
+    }
+  }
+
+  // Entities, indices, and options.
+  entityStride = cnBagArchivePadded(header->entitySize);
+  if (!(
+    (entities = const_cast<char*>(reinterpret_cast<const char*>(
+      cnBagArchiveRead(&at, end, header->entityCount * entityStride)
+    ))) &&
+    (indices = reinterpret_cast<const Count*>(
+      cnBagArchiveRead(&at, end, header->indexCount * sizeof(Count))
+    )) &&
+    (options = reinterpret_cast<const ArchiveRange*>(
+      cnBagArchiveRead(&at, end, header->optionCount * sizeof(ArchiveRange))
+    )) &&
+    (archiveBags = reinterpret_cast<const ArchiveBag*>(
+      cnBagArchiveRead(&at, end, header->bagCount * sizeof(ArchiveBag))
+    ))
+  )) cnErrTo(FAIL, "Truncated archive.");
+  for (Index i = 0; i < header->indexCount; i++) {
+    if (indices[i] < 0 || indices[i] >= header->entityCount) {
+      cnErrTo(FAIL, "Bad entity index %ld.", indices[i]);
+    }
+  }
+
+  // Bags pointing into the entities.
+  for (Index b = 0; b < header->bagCount; b++) {
+    const ArchiveBag& archiveBag = archiveBags[b];
+    Bag* bag;
+    if (!(
+      archiveBag.entityBegin >= 0 && archiveBag.entityCount >= 0 &&
+      archiveBag.entityBegin + archiveBag.entityCount <= header->indexCount &&
+      archiveBag.optionBegin >= 0 && archiveBag.optionCount >= 0 &&
+      archiveBag.optionBegin + archiveBag.optionCount <= header->optionCount
+    )) cnErrTo(FAIL, "Bad bag %ld.", b);
+    if (!(bag = reinterpret_cast<Bag*>(cnListExpand(&bags)))) {
+      cnErrTo(FAIL, "No bag.");
+    }
+    new(bag) Bag;
+    bag->label = archiveBag.label;
+    for (Index e = 0; e < archiveBag.entityCount; e++) {
+      Entity entity =
+        entities + indices[archiveBag.entityBegin + e] * entityStride;
+      if (!cnListPush(bag->entities, &entity)) cnErrTo(FAIL, "No entity.");
+    }
+    for (Index o = 0; o < archiveBag.optionCount; o++) {
+      const ArchiveRange& range = options[archiveBag.optionBegin + o];
+      List<Entity>* list;
+      if (!(
+        range.begin >= 0 && range.count >= 0 &&
+        range.begin + range.count <= header->indexCount
+      )) cnErrTo(FAIL, "Bad options for bag %ld.", b);
+      if (!(list = reinterpret_cast<List<Entity>*>(
+        cnListExpand(&bag->participantOptions)
+      ))) cnErrTo(FAIL, "No options.");
+      new(list) List<Entity>;
+      for (Index e = 0; e < range.count; e++) {
+        Entity entity = entities + indices[range.begin + e] * entityStride;
+        if (!cnListPush(list, &entity)) cnErrTo(FAIL, "No option.");
+      }
+    }
+  }
+
+  // Winned.
+  return true;
+
+  FAIL:
+  cnBagListDispose(&bags, NULL);
+  cnListClear(&bags);
+  file.dispose();
+  if (created) {
+    // Don't leave a half-built type in the schema.
+    if (schema.types->back() == type) schema.types->pop_back();
+    delete type;
+  }
+  type = NULL;
+  return false;
+}
+
+
+Count cnBagArchivePadded(Count size) {
+  return (size + 7) & ~7;
+}
+
+
+const void* cnBagArchiveRead(char** at, char* end, Count size) {
+  char* data = *at;
+  Count padded = cnBagArchivePadded(size);
+  if (size < 0 || end - *at < padded) return NULL;
+  *at += padded;
+  return data;
+}
+
+
+bool cnBagArchiveSave(const char* name, List<Bag>* bags, Type* type) {
+  List<ArchiveBag> archiveBags;
+  List<Entity> entities;
+  FILE* file = NULL;
+  ArchiveHeader header;
+  List<Count> indices;
+  unordered_map<Entity, Index> indexOf;
+  List<ArchiveRange> options;
+  vector<OffsetProperty*> properties;
+  bool result = false;
+
+  // Index the entities, each only once even if shared among bags.
+  cnListEachBegin(bags, Bag, bag) {
+    ArchiveBag* archiveBag;
+    if (!(archiveBag = reinterpret_cast<ArchiveBag*>(
+      cnListExpand(&archiveBags)
+    ))) cnErrTo(DONE, "No archive bag.");
+    archiveBag->entityBegin = indices.count;
+    archiveBag->entityCount = bag->entities->count;
+    archiveBag->label = bag->label;
+    archiveBag->optionBegin = options.count;
+    archiveBag->optionCount = bag->participantOptions.count;
+    cnListEachBegin(bag->entities, Entity, entity) {
+      if (!cnBagArchiveSave_index(&indexOf, &entities, &indices, *entity)) {
+        cnErrTo(DONE, "No index.");
+      }
+    } cnEnd;
+    cnListEachBegin(&bag->participantOptions, List<Entity>, list) {
+      ArchiveRange range = {indices.count, list->count};
+      if (!cnListPush(&options, &range)) cnErrTo(DONE, "No options.");
+      cnListEachBegin(list, Entity, entity) {
+        if (!cnBagArchiveSave_index(&indexOf, &entities, &indices, *entity)) {
+          cnErrTo(DONE, "No index.");
+        }
+      } cnEnd;
+    } cnEnd;
+  } cnEnd;
+
+  // Only offset properties make sense without domain code.
+  for (size_t p = 0; p < type->properties->size(); p++) {
+    OffsetProperty* property =
+      dynamic_cast<OffsetProperty*>(type->properties[p]);
+    if (property) properties.push_back(property);
+  }
+
+  // Header and type.
+  header.bagCount = archiveBags.count;
+  header.entityCount = entities.count;
+  header.entitySize = type->size;
+  header.indexCount = indices.count;
+  header.optionCount = options.count;
+  header.propertyCount = properties.size();
+  header.typeNameSize = type->name.size();
+  if (!(file = fopen(name, "wb"))) cnErrTo(DONE, "Couldn't open %s.", name);
+  if (!(
+    cnBagArchiveWrite(file, cnBagArchiveMagic, sizeof(cnBagArchiveMagic)) &&
+    cnBagArchiveWrite(file, &header, sizeof(header)) &&
+    cnBagArchiveWrite(file, type->name.data(), header.typeNameSize)
+  )) cnErrTo(DONE, "Failed to write header.");
+  for (size_t p = 0; p < properties.size(); p++) {
+    OffsetProperty* property = properties[p];
+    ArchiveProperty archiveProperty = {
+      property->count, (Count)property->name.size(), property->offset,
+      (Count)property->type->name.size()
+    };
+    if (!(
+      cnBagArchiveWrite(file, &archiveProperty, sizeof(archiveProperty)) &&
+      cnBagArchiveWrite(
+        file, property->name.data(), archiveProperty.nameSize
+      ) &&
+      cnBagArchiveWrite(
+        file, property->type->name.data(), archiveProperty.typeNameSize
+      )
+    )) cnErrTo(DONE, "Failed to write property.");
+  }
+
+  // Entities, then ranges.
+  cnListEachBegin(&entities, Entity, entity) {
+    if (!cnBagArchiveWrite(file, *entity, type->size)) {
+      cnErrTo(DONE, "Failed to write entity.");
+    }
+  } cnEnd;
+  if (!(
+    cnBagArchiveWrite(file, indices.items, indices.count * sizeof(Count)) &&
+    cnBagArchiveWrite(
+      file, options.items, options.count * sizeof(ArchiveRange)
+    ) &&
+    cnBagArchiveWrite(
+      file, archiveBags.items, archiveBags.count * sizeof(ArchiveBag)
+    )
+  )) cnErrTo(DONE, "Failed to write bags.");
+  if (fclose(file)) {
+    file = NULL;
+    cnErrTo(DONE, "Failed to close %s.", name);
+  }
+  file = NULL;
+
+  // Winned.
+  result = true;
+
+  DONE:
+  if (file) fclose(file);
+  return result;
+}
+
+
+bool cnBagArchiveSave_index(
+  unordered_map<Entity, Index>* indexOf, List<Entity>* entities,
+  List<Count>* indices, Entity entity
+) {
+  pair<unordered_map<Entity, Index>::iterator, bool> found =
+    indexOf->insert(make_pair(entity, entities->count));
+  if (found.second && !cnListPush(entities, &entity)) return false;
+  return cnListPush(indices, &found.first->second);
+}
+
+
+bool cnBagArchiveWrite(FILE* file, const void* data, Count size) {
+  char zeros[8] = {0};
+  Count padding = cnBagArchivePadded(size) - size;
+  return
+    (!size || fwrite(data, 1, size, file) == (size_t)size) &&
+    (!padding || fwrite(zeros, 1, padding, file) == (size_t)padding);
+}
+
+
+}
@@ -0,0 +1,73 @@
+#ifndef concuno_archive_h
+#define concuno_archive_h
+
+
+#include "entity.h"
+#include "io.h"
+
+
+namespace concuno {
+
+
+/**
+ * Bags loaded from a bag archive, a binary form of the final bags of any
+ * domain, so bag selection can run once and serve many learning runs.
+ *
+ * Entity records all sit in one block mapped from the file, and bag entities
+ * and participant options point straight into it. Since records keep the
+ * layout of the original entities, OffsetProperty and domain properties work
+ * on them unchanged. The mapping is private, so writes to entities never reach
+ * the file.
+ */
+struct BagArchive {
+
+  BagArchive();
+
+  /**
+   * Disposes of the bags, then unmaps the entities.
+   */
+  ~BagArchive();
+
+  /**
+   * Maps the named archive and builds its bags, first disposing of any old.
+   *
+   * If the schema already has a type of the archived name, that type is used,
+   * and its size must match. Otherwise, a type is added to the schema with the
+   * archived offset properties, which needs no domain code.
+   *
+   * Returns false on failure.
+   */
+  bool load(const char* name, Schema& schema);
+
+  /**
+   * Bags with entities in the mapped file. Each bag owns its entity list.
+   */
+  List<Bag> bags;
+
+  FileMap file;
+
+  /**
+   * The type of all entities, in the schema given to load.
+   */
+  Type* type;
+
+};
+
+
+/**
+ * Writes the bags to a bag archive. All entities must be plain data of the
+ * given type, without pointers, and each is saved once as type->size bytes,
+ * no matter how many bags share it. Offset properties of the type are saved,
+ * too, for loading without the domain schema. Other properties are left out,
+ * so domains with field properties should first copy their entities into
+ * plain records, as rcss-test does.
+ *
+ * Returns false on failure.
+ */
+bool cnBagArchiveSave(const char* name, List<Bag>* bags, Type* type);
+
+
+}
+
+
+#endif
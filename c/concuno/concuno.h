@@ -1,12 +1,15 @@
 #ifndef concuno_concuno_h
 #define concuno_concuno_h
 
+#include "archive.h"
 #include "cluster.h"
 #include "core.h"
 #include "entity.h"
 #include "learn.h"
 #include "mat.h"
 #include "io.h"
+#include "profile.h"
+#include "search.h"
 #include "stats.h"
 #include "tree.h"
 
@@ -1,8 +1,14 @@
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <math.h>
+#include <mutex>
 #include <sstream>
+#include <stdarg.h>
 #include <string.h>
+#include <thread>
 #include "core.h"
 
 using namespace std;
@@ -19,202 +25,6 @@ Error::Error(const basic_ostream<char>& what):
 {}
 
 
-/**
- * Bubbles the item at the given index down the heap.
- */
-void cnHeapDown(HeapAny* heap, Index index);
-
-
-/**
- * Provides the kids of the given parent index, using -1 to mean no such kid.
- */
-void cnHeapKids(
-  HeapAny* heap, Index parentIndex,
-  Index* kid1Index, Index* kid2Index
-);
-
-
-/**
- * Provides the parent of the given kid index, providing -1 for no parent (in
- * the case of the root at index 0).
- */
-Index cnHeapParent(HeapAny heap, Index kidIndex);
-
-
-/**
- * Bubbles the item at the given index up the heap.
- */
-void cnHeapUp(HeapAny* heap, Index index);
-
-
-void cnHeapClear(HeapAny* heap) {
-  if (heap->destroyItem) {
-    cnListEachBegin(&heap->items, RefAny, item) {
-      heap->destroyItem(heap->info, *item);
-    } cnEnd;
-  }
-  cnListClear(&heap->items);
-}
-
-
-HeapAny* cnHeapCreate(bool (*less)(RefAny info, RefAny a, RefAny b)) {
-  HeapAny* heap = cnAlloc(HeapAny, 1);
-  if (!heap) cnErrTo(DONE, "No heap.");
-  heap->destroyInfo = NULL;
-  heap->destroyItem = NULL;
-  heap->info = NULL;
-  new(&heap->items) List<RefAny>;
-  heap->less = less;
-  DONE:
-  return heap;
-}
-
-
-void cnHeapDestroy(HeapAny* heap) {
-  // No op on null.
-  if (!heap) return;
-
-  // Items.
-  cnHeapClear(heap);
-  heap->items.~List<RefAny>();
-
-  // Info.
-  if (heap->destroyInfo) heap->destroyInfo(heap->info);
-
-  // Heap.
-  // TODO Null everything out for extra safety?
-  free(heap);
-}
-
-
-void cnHeapDown(HeapAny* heap, Index index) {
-  while (index >= 0) {
-    RefAny* item = ((RefAny*)heap->items.items) + index;
-    Index kidIndex;
-    RefAny* kidItem;
-    Index kid2Index;
-
-    // Find the kids, and see if they exist.
-    cnHeapKids(heap, index, &kidIndex, &kid2Index);
-    if (kidIndex >= 0) {
-      // Presume swapping with kid 1 for now.
-      kidItem = ((RefAny*) heap->items.items) + kidIndex;
-    } else {
-      // We're at the bottom.
-      break;
-    }
-    if (kid2Index >= 0) {
-      RefAny* kid2Item =
-        ((RefAny*)heap->items.items) + kid2Index;
-      // TODO Error checking on less? It hypothetically could fail ...
-      if (heap->less(heap, *kid2Item, *kidItem)) {
-        // Actually, kid 2 is smaller, so use it.
-        kidIndex = kid2Index;
-        kidItem = kid2Item;
-      }
-    }
-
-    // Check position.
-    // TODO Error checking on less? It hypothetically could fail ...
-    if (heap->less(heap, *kidItem, *item)) {
-      // Swap with the lesser kid.
-      RefAny tempItem;
-      tempItem = *item;
-      *item = *kidItem;
-      *kidItem = tempItem;
-      // And move down the tree.
-      index = kidIndex;
-    } else {
-      // We don't need to go any further.
-      break;
-    }
-  }
-}
-
-
-void cnHeapKids(
-  HeapAny* heap, Index parentIndex,
-  Index* kid1Index, Index* kid2Index
-) {
-  // TODO Use a "B-Heap" or Emde Boas layout or some such for more efficient
-  // TODO memory access.
-  // The following is repetitive, but simple enough.
-  if (kid1Index) {
-    *kid1Index = 2 * parentIndex + 1;
-    if (*kid1Index >= heap->items.count) *kid1Index = -1;
-  }
-  if (kid2Index) {
-    *kid2Index = 2 * parentIndex + 2;
-    if (*kid2Index >= heap->items.count) *kid2Index = -1;
-  }
-}
-
-
-Index cnHeapParent(HeapAny* heap, Index kidIndex) {
-  // TODO Use a "B-Heap" or Emde Boas layout or some such for more efficient
-  // TODO memory access.
-  return kidIndex ? (kidIndex - 1) / 2 : -1;
-}
-
-
-RefAny cnHeapPeek(HeapAny* heap) {
-  // Dereference to the stored pointer, if we have anything.
-  return heap->items.items ? *(RefAny*)heap->items.items : NULL;
-}
-
-
-RefAny cnHeapPull(HeapAny* heap) {
-  RefAny pulled = cnHeapPeek(heap);
-  if (heap->items.count) {
-    // TODO With a different memory layout, is the last item still always legit?
-    // Swap the bottom item to the top.
-    // We always store pointers here, so hack the array type.
-    // For the last item, this is inefficient, but that's not a common use case.
-    ((RefAny*)heap->items.items)[0] =
-      ((RefAny*)heap->items.items)[heap->items.count - 1];
-    ((RefAny*)heap->items.items)[heap->items.count - 1] = NULL;
-    // We always remove the last, so this is easy.
-    heap->items.count--;
-    cnHeapDown(heap, 0);
-  } else {
-    // TODO Error or okay to pull from an empty heap?
-  }
-  return pulled;
-}
-
-
-bool cnHeapPush(HeapAny* heap, RefAny item) {
-  bool result = false;
-  if (!cnListPush(&heap->items, &item)) cnErrTo(DONE, "No push.");
-  cnHeapUp(heap, heap->items.count - 1);
-  result = true;
-  DONE:
-  return result;
-}
-
-
-void cnHeapUp(HeapAny* heap, Index index) {
-  while (index) {
-    RefAny* item = ((RefAny*)heap->items.items) + index;
-    Index parentIndex = cnHeapParent(heap, index);
-    RefAny* parentItem =
-      ((RefAny*)heap->items.items) + parentIndex;
-    // TODO Error checking on less? It hypothetically could fail ...
-    if (heap->less(heap->info, *item, *parentItem)) {
-      // Swap parent and kid.
-      RefAny temp = *parentItem;
-      *parentItem = *item;
-      *item = temp;
-      // And keep moving up the tree.
-      index = parentIndex;
-    } else {
-      // All good now.
-      break;
-    }
-  }
-}
-
-
 bool cnIsNaN(Float x) {
   // TODO Technique from:
   // http://stackoverflow.com/questions/570669/...
@@ -319,7 +129,7 @@ void* cnListExpandMulti(ListAny* list, Count count) {
     newItems = realloc(list->items, wanted * list->itemSize);
     if (!newItems) {
       // No memory for this.
-      printf("Failed to expand list.");
+      logError("Failed to expand list.\n");
       return NULL;
     }
     // TODO Clear extra allocated memory?
@@ -340,7 +150,7 @@ void* cnListPush(ListAny* list, const void* item) {
 
 void* cnListPushAll(ListAny* list, const ListAny* from) {
   if (list->itemSize != from->itemSize) {
-    printf(
+    logError(
       "list itemSize %ld != from itemSize %ld\n",
       list->itemSize, from->itemSize
     );
@@ -362,7 +172,7 @@ void* cnListPushMulti(ListAny* list, const void* items, Count count) {
 void cnListRemove(ListAny* list, Index index) {
   char *begin = reinterpret_cast<char*>(list->get(index));
   if (!begin) {
-    printf("Bad index for remove: %ld\n", index);
+    logError("Bad index for remove: %ld\n", index);
     return;
   }
   list->count--;
@@ -375,33 +185,69 @@ void cnListRemove(ListAny* list, Index index) {
 }
 
 
-void cnListShuffle(ListAny* list) {
-  // I'd rather just do simple copies than fancy n-byte xors.
-  void* buffer = malloc(list->itemSize);
-  // Fisher-Yates shuffling from:
-  // http://en.wikipedia.org/wiki/Fisher%E2%80%93Yates_shuffle#
-  // The_modern_algorithm
-  Index i;
-  for (i = list->count - 1; i >= 1; i--) {
-    // Find where we're going.
-    void* a;
-    void* b;
-    Index j = rand() % (i + 1);
-    if (i == j) continue;
-    a = ((char*)list->items) + (i * list->itemSize);
-    b = ((char*)list->items) + (j * list->itemSize);
-    // Perform the swap.
-    memcpy(buffer, a, list->itemSize);
-    memcpy(a, b, list->itemSize);
-    memcpy(b, buffer, list->itemSize);
+Float cnNaN(void) {
+  return numeric_limits<Float>::quiet_NaN();
+}
+
+
+/**
+ * Shared state for the workers of one cnParallelEach call.
+ */
+struct cnParallelEach_Work {
+  Count count;
+  RefAny info;
+  std::atomic<Index> next;
+  std::atomic<bool> ok;
+  bool (*run)(RefAny info, Index index);
+};
+
+
+void cnParallelEach_worker(cnParallelEach_Work* work) {
+  while (work->ok) {
+    Index index = work->next++;
+    if (index >= work->count) break;
+    try {
+      if (!work->run(work->info, index)) work->ok = false;
+    } catch (const std::exception& error) {
+      // Exceptions can't cross threads, so report and fail here.
+      logError("Failed at %ld: %s\n", index, error.what());
+      work->ok = false;
+    }
   }
-  // All done.
-  free(buffer);
 }
 
 
-Float cnNaN(void) {
-  return numeric_limits<Float>::quiet_NaN();
+bool cnParallelEach(
+  Count count, Count workerCount,
+  bool (*run)(RefAny info, Index index), RefAny info
+) {
+  cnParallelEach_Work work;
+  vector<thread> threads;
+
+  work.count = count;
+  work.info = info;
+  work.next = 0;
+  work.ok = true;
+  work.run = run;
+  if (workerCount < 1) workerCount = cnWorkerCount();
+  if (workerCount > count) workerCount = count;
+
+  // The calling thread does its share, so start one fewer.
+  try {
+    for (Index w = 1; w < workerCount; w++) {
+      threads.push_back(thread(cnParallelEach_worker, &work));
+    }
+  } catch (const std::exception& error) {
+    // Just go with what we have. The work still gets done.
+    logError(
+      "Started only %ld workers: %s\n", (long)threads.size() + 1, error.what()
+    );
+  }
+  cnParallelEach_worker(&work);
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  return work.ok;
 }
 
 
@@ -469,6 +315,14 @@ bool cnStringPushStr(String* string, const char* str) {
 }
 
 
+Count cnWorkerCount(void) {
+  const char* text = getenv("CONCUNO_WORKERS");
+  Count count = text ? atol(text) : 0;
+  if (count < 1) count = thread::hardware_concurrency();
+  return count < 1 ? 1 : count;
+}
+
+
 ostream& Buf::operator<<(char $char) {
   return dynamic_cast<ostream&>(*this) << $char;
 }
@@ -489,18 +343,196 @@ ostream& Buf::operator<<(const std::string& str) {
 }
 
 
+/**
+ * Collects log text for a background thread to write, so logging threads never
+ * wait on stdout, and stdout gets flushed once per batch rather than per line.
+ */
+struct LogSink {
+
+  LogSink(): done(false), pendingCount(0), writtenCount(0) {
+    // Start the thread only once everything else is ready.
+    writer = thread(&LogSink::run, this);
+  }
+
+  ~LogSink() {
+    {
+      lock_guard<mutex> lock(guard);
+      done = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+
+  void flush() {
+    unique_lock<mutex> lock(guard);
+    Count target = pendingCount;
+    written.wait(lock, [&]() {return writtenCount >= target;});
+  }
+
+  void run() {
+    string batch;
+    unique_lock<mutex> lock(guard);
+    while (true) {
+      Count count;
+      wake.wait(lock, [&]() {return done || !pending.empty();});
+      // Write out what's left even when done.
+      if (pending.empty()) break;
+      batch.swap(pending);
+      count = pendingCount;
+      lock.unlock();
+      fwrite(batch.data(), 1, batch.size(), stdout);
+      fflush(stdout);
+      batch.clear();
+      lock.lock();
+      writtenCount = count;
+      written.notify_all();
+    }
+  }
+
+  void write(const char* text, size_t size) {
+    {
+      lock_guard<mutex> lock(guard);
+      pending.append(text, size);
+      pendingCount++;
+    }
+    wake.notify_one();
+  }
+
+  /**
+   * Writes straight to stdout after anything pending, holding the lock so no
+   * other log text can get in between.
+   */
+  void writeNow(const char* text, size_t size) {
+    unique_lock<mutex> lock(guard);
+    written.wait(lock, [&]() {return writtenCount >= pendingCount;});
+    fwrite(text, 1, size, stdout);
+    fflush(stdout);
+  }
+
+  bool done;
+
+  mutex guard;
+
+  /**
+   * Text not yet taken by the writer.
+   */
+  string pending;
+
+  /**
+   * Counts of writes so far, so flush knows when its writes are out.
+   */
+  Count pendingCount;
+
+  condition_variable wake;
+
+  condition_variable written;
+
+  Count writtenCount;
+
+  thread writer;
+
+};
+
+LogSink& logSink() {
+  static LogSink sink;
+  return sink;
+}
+
+
+/**
+ * Topic settings, from CONCUNO_LOG at first and logEnable after.
+ */
+struct LogTopics {
+
+  LogTopics(): all(true) {
+    const char* text = getenv("CONCUNO_LOG");
+    string entries = text ? text : "";
+    size_t begin = 0;
+    while (begin < entries.size()) {
+      size_t end = entries.find(',', begin);
+      string entry;
+      bool enabled = true;
+      if (end == string::npos) end = entries.size();
+      entry = entries.substr(begin, end - begin);
+      begin = end + 1;
+      if (!entry.empty() && entry[0] == '-') {
+        enabled = false;
+        entry.erase(0, 1);
+      }
+      if (!entry.empty()) enable(entry, enabled);
+    }
+  }
+
+  void enable(const string& topic, bool enabled) {
+    if (topic == "all") {
+      all = enabled;
+      topics.clear();
+    } else {
+      topics[topic] = enabled;
+    }
+  }
+
+  bool all;
+
+  mutex guard;
+
+  map<string, bool> topics;
+
+};
+
+LogTopics& logTopics() {
+  static LogTopics topics;
+  return topics;
+}
+
+
+/**
+ * Formats and writes as is to the sink, or straight out if now.
+ */
+void logPrint(const char* format, va_list args, bool now = false) {
+  char buffer[256];
+  va_list copy;
+  int size;
+  va_copy(copy, args);
+  size = vsnprintf(buffer, sizeof(buffer), format, copy);
+  va_end(copy);
+  if (size < 0) return;
+  if (size < (int)sizeof(buffer)) {
+    now ? logSink().writeNow(buffer, size) : logSink().write(buffer, size);
+  } else {
+    // Too big for the stack, so go again on the heap.
+    vector<char> text(size + 1);
+    vsnprintf(&text[0], text.size(), format, args);
+    now ?
+      logSink().writeNow(&text[0], size) : logSink().write(&text[0], size);
+  }
+}
+
+
+/**
+ * Writes the topic and message as a line, without checking the topic.
+ */
+void logWrite(const char* topic, const std::string& message) {
+  string line = topic;
+  line += ": ";
+  line += message;
+  line += '\n';
+  logSink().write(line.data(), line.size());
+}
+
+
 void log(const char* topic, const char* message) {
-  cout << topic << ": " << message << endl;
+  if (logging(topic)) logWrite(topic, message);
 }
 
 
 void log(const char* topic, const std::string& message) {
-  cout << topic << ": " << message << endl;
+  if (logging(topic)) logWrite(topic, message);
 }
 
 
 void log(const char* topic, const std::basic_ostream<char>& message) {
-  log(topic, str(message));
+  if (logging(topic)) logWrite(topic, str(message));
 }
 
 
@@ -519,31 +551,76 @@ void log(const std::basic_ostream<char>& message) {
 }
 
 
-Log::Log(const char* $topic): topic($topic) {}
+void logEnable(const char* topic, bool enabled) {
+  LogTopics& topics = logTopics();
+  lock_guard<mutex> lock(topics.guard);
+  topics.enable(topic, enabled);
+  // Bump only after the change, so any Log that sees the new generation also
+  // sees the new settings.
+  Log::generation++;
+}
+
+
+void logError(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  // Errors go out right away, in case of an abort or direct prints next.
+  logPrint(format, args, true);
+  va_end(args);
+}
+
 
+void logFlush() {
+  logSink().flush();
+}
 
-bool Log::on() {
-  return logging(topic);
+
+bool logging(const char* topic) {
+  LogTopics& topics = logTopics();
+  lock_guard<mutex> lock(topics.guard);
+  map<string, bool>::iterator found = topics.topics.find(topic);
+  return found == topics.topics.end() ? topics.all : found->second;
 }
 
 
+// Start past the zero state of each Log, so the first check refreshes.
+atomic<Count> Log::generation(1);
+
+
+Log::Log(const char* $topic): state(0), topic($topic) {}
+
+
 void Log::operator()(const char* message) {
-  log(topic, message);
+  if (on()) logWrite(topic, message);
 }
 
 
 void Log::operator()(const std::string& message) {
-  log(topic, message);
+  if (on()) logWrite(topic, message);
 }
 
 
 void Log::operator()(const std::basic_ostream<char>& message) {
-  log(topic, message);
+  if (on()) logWrite(topic, str(message));
 }
 
 
-bool logging(const char* topic) {
-  return true;
+void Log::print(const char* format, ...) {
+  va_list args;
+  if (!on()) return;
+  va_start(args, format);
+  logPrint(format, args);
+  va_end(args);
+}
+
+
+Count Log::refresh() {
+  // Read the generation first, so a change during the check only means
+  // checking again later.
+  Count generation = Log::generation.load();
+  Count state = 2 * generation + logging(topic);
+  this->state.store(state, memory_order_relaxed);
+  return state;
 }
 
 
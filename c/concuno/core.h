@@ -1,11 +1,14 @@
 #ifndef concuno_core_h
 #define concuno_core_h
 
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
 
 
@@ -232,13 +235,26 @@ struct GridAny {
 };
 
 
+/**
+ * Writes printf-style error text as is through the log, so it stays in order
+ * with other log output. Errors aren't filtered by topic. Unlike other log
+ * output, they're written and flushed before this returns.
+ */
+void logError(const char* format, ...)
+  #ifdef __GNUC__
+    __attribute__((format(printf, 1, 2)))
+  #endif
+;
+
+
 /**
  * Use when not caring about messages.
  *
  * TODO Use __FILE__ but wrapped to show just the last file name, not full path.
  */
 #define cnFailTo(label) { \
-  printf("Failed (in %s at line %d)\n", __FUNCTION__, __LINE__); \
+  ::concuno::logError( \
+    "Failed (in %s at line %d)\n", __FUNCTION__, __LINE__); \
   goto label; \
 }
 
@@ -247,61 +263,212 @@ struct GridAny {
  * Use to fail with a particular message.
  */
 #define cnErrTo(label, message, ...) { \
-  printf( \
+  ::concuno::logError( \
     message " (in %s at line %d)\n", ## __VA_ARGS__, __FUNCTION__, __LINE__); \
   goto label; \
 }
 
 
 /**
- * A binary heap usable as a priority queue.
+ * Logs the message only when the log's topic is on, so building it, as with
+ * Buf() << ..., costs nothing otherwise.
+ */
+#define cnLog(log, message) { if ((log).on()) (log)(message); }
+
+
+/**
+ * Like cnLog, but printf-style, and written as is.
+ */
+#define cnLogf(log, ...) { if ((log).on()) (log).print(__VA_ARGS__); }
+
+
+/**
+ * A 4-ary heap of items by value, usable as a priority queue. The comparator
+ * says whether a should come out before b, so the default makes a min heap.
+ * Four kids per node keeps the tree shallow with kids side by side in memory,
+ * and a comparator type rather than a function pointer lets calls inline.
  *
- * I'm experimenting with providing this only in pointer form, as I've more than
- * once needed to change from expanded to pointer form,
+ * Push gives a handle, which stays good until that item is pulled or removed,
+ * so that update can move items, such as for decrease-key, and remove can take
+ * them from anywhere. Handles then get reused.
+ *
+ * Errors on allocation come through as exceptions from std::vector.
  */
-struct HeapAny {
+template<typename Item, typename Compare = std::less<Item> >
+struct Heap {
+
+  typedef Index Handle;
+
+  Heap(const Compare& compare = Compare()): compare(compare) {}
+
+  void clear() {
+    items.clear();
+    handles.clear();
+    slots.clear();
+    freeHandles.clear();
+  }
+
+  Count count() const {
+    return items.size();
+  }
 
   /**
-   * Set this if you need extra information for comparing items.
+   * The current item for a handle.
    */
-  RefAny info;
+  const Item& get(Handle handle) const {
+    return items[slots[handle]];
+  }
 
   /**
-   * The items in the heap. Note that items are always pointers.
-   *
-   * TODO After complaining about expanded forms, I want to use an expanded list
-   * TODO here. I really like tying its life in here. Grr.
+   * Replaces all contents with the items from the list in linear time, rather
+   * than pushing each. Handles match list indices.
    */
-  List<RefAny> items;
+  void heapify(List<Item>& list) {
+    clear();
+    items.reserve(list.count);
+    for (Index i = 0; i < list.count; i++) {
+      slots.push_back(i);
+      handles.push_back(i);
+      items.push_back(list[i]);
+    }
+    if (items.size() < 2) return;
+    for (Index slot = (items.size() - 2) / 4; slot >= 0; slot--) down(slot);
+  }
 
   /**
-   * Set to non-null if you want automatic info destruction.
+   * The next item to come out. The heap must not be empty.
    */
-  bool (*destroyInfo)(RefAny info);
+  const Item& peek() const {
+    return items.front();
+  }
 
   /**
-   * Set to non-null if you want automatic item destruction.
-   *
-   * Called before destroyInfo.
+   * Removes and returns the next item. The heap must not be empty.
    */
-  void (*destroyItem)(RefAny info, RefAny item);
+  Item pull() {
+    return remove(handles.front());
+  }
+
+  Handle push(const Item& item) {
+    Handle handle;
+    if (freeHandles.empty()) {
+      handle = slots.size();
+      slots.push_back(-1);
+    } else {
+      handle = freeHandles.back();
+      freeHandles.pop_back();
+    }
+    items.push_back(item);
+    handles.push_back(handle);
+    slots[handle] = items.size() - 1;
+    up(items.size() - 1);
+    return handle;
+  }
 
   /**
-   * Says whether a is less than b.
+   * Removes and returns the item for the handle, wherever it is.
    */
-  bool (*less)(RefAny info, RefAny a, RefAny b);
+  Item remove(Handle handle) {
+    Index slot = slots[handle];
+    Item removed = items[slot];
+    // Move the last into the gap, and find its place.
+    if (slot < (Index)items.size() - 1) {
+      bool earlier = compare(items.back(), removed);
+      place(slot, items.back(), handles.back());
+      items.pop_back();
+      handles.pop_back();
+      if (earlier) {
+        up(slot);
+      } else {
+        down(slot);
+      }
+    } else {
+      items.pop_back();
+      handles.pop_back();
+    }
+    // Free the handle.
+    slots[handle] = -1;
+    freeHandles.push_back(handle);
+    return removed;
+  }
 
-};
+  /**
+   * Replaces the item for the handle, moving it up or down as needed.
+   */
+  void update(Handle handle, const Item& item) {
+    Index slot = slots[handle];
+    bool earlier = compare(item, items[slot]);
+    items[slot] = item;
+    if (earlier) {
+      up(slot);
+    } else {
+      down(slot);
+    }
+  }
 
+private:
 
-/**
- * Since all heaps here are of pointers, it might be good enough form just to
- * say cnHeap(cnIndex) to mean a heap of _pointers_ to indices, for example.
- * It's just convention, and saying cnHeap(cnRef(cnIndex)) or even just
- * cnHeap(cnIndex*) could be a bother.
- */
-template<typename Item>
-struct Heap: HeapAny {};
+  /**
+   * Moves the item at the slot down past any kids that come before it.
+   */
+  void down(Index slot) {
+    Count count = items.size();
+    Item item = items[slot];
+    Handle handle = handles[slot];
+    while (true) {
+      Index kid = 4 * slot + 1;
+      Index kidsEnd = kid + 4 < count ? kid + 4 : count;
+      Index first;
+      if (kid >= count) break;
+      first = kid;
+      for (kid++; kid < kidsEnd; kid++) {
+        if (compare(items[kid], items[first])) first = kid;
+      }
+      if (!compare(items[first], item)) break;
+      place(slot, items[first], handles[first]);
+      slot = first;
+    }
+    place(slot, item, handle);
+  }
+
+  void place(Index slot, const Item& item, Handle handle) {
+    items[slot] = item;
+    handles[slot] = handle;
+    slots[handle] = slot;
+  }
+
+  /**
+   * Moves the item at the slot up past any parents it comes before.
+   */
+  void up(Index slot) {
+    Item item = items[slot];
+    Handle handle = handles[slot];
+    while (slot) {
+      Index parent = (slot - 1) / 4;
+      if (!compare(item, items[parent])) break;
+      place(slot, items[parent], handles[parent]);
+      slot = parent;
+    }
+    place(slot, item, handle);
+  }
+
+  Compare compare;
+
+  /**
+   * The handle for each item.
+   */
+  std::vector<Handle> handles;
+
+  std::vector<Handle> freeHandles;
+
+  std::vector<Item> items;
+
+  /**
+   * The slot in items for each handle, or -1 for free handles.
+   */
+  std::vector<Index> slots;
+
+};
 
 
 /**
@@ -324,33 +491,6 @@ bool cnGridInit2d(GridAny* grid, Count nrows, Count ncols);
 bool cnGridInitNd(GridAny* grid, const List<Count>* dims);
 
 
-/**
- * Clears out the heap contents, destroying the items if destroyItem is set.
- */
-void cnHeapClear(HeapAny* heap);
-
-
-/**
- * All the contents will be cleared out and/or init'd. You still need to set at
- * least the less function for things work, though.
- *
- * TODO An option for initial contents for O(n) heapify?
- */
-HeapAny* cnHeapCreate(bool (*less)(RefAny info, RefAny a, RefAny b));
-
-
-void cnHeapDestroy(HeapAny* heap);
-
-
-RefAny cnHeapPeek(HeapAny* heap);
-
-
-RefAny cnHeapPull(HeapAny* heap);
-
-
-bool cnHeapPush(HeapAny* heap, RefAny item);
-
-
 /**
  * Returns whether x is NaN.
  */
@@ -459,19 +599,25 @@ void cnListRemove(ListAny* list, Index index);
 
 
 /**
- * Shuffles the list.
- *
- * TODO Pass in a rand stream.
- *
- * TODO Simple unit test of this would be nice.
+ * Quiet NaN (not a number).
  */
-void cnListShuffle(ListAny* list);
+Float cnNaN(void);
 
 
 /**
- * Quiet NaN (not a number).
+ * Calls run(info, index) for each index from 0 to count - 1, spread across up
+ * to workerCount threads. A workerCount of 0 means cnWorkerCount(). Each index
+ * is handled exactly once, but in no particular order, so run should write
+ * results only to slots owned by its index.
+ *
+ * The calling thread works, too, so fewer threads than requested still get the
+ * job done. Returns false if any call to run returned false or threw, after
+ * which remaining indices might be skipped.
  */
-Float cnNaN(void);
+bool cnParallelEach(
+  Count count, Count workerCount,
+  bool (*run)(RefAny info, Index index), RefAny info
+);
 
 
 /**
@@ -502,6 +648,42 @@ Float cnNaN(void);
 #define cnStackFree(memory)
 
 
+/**
+ * Sorts in place by the less comparison, which should be a function object or
+ * lambda so that it inlines. This is introsort: quicksort with median of three
+ * pivots, switching to heapsort when partitions go too deep and to insertion
+ * sort for short ranges.
+ *
+ * Not stable, so break ties in less where order matters.
+ */
+template<typename Item, typename Less>
+void cnSort(Item* begin, Item* end, Less less);
+
+
+/**
+ * Stable sort of count items by Float keys from key(item), which should be a
+ * cheap read. Uses LSD radix sort over the key bytes, skipping passes where all
+ * keys share a byte, and insertion sort for short lists. The scratch space
+ * must hold count items, and the sorted items end up back in items.
+ *
+ * Keys order as by <, except that -0 sorts before 0 and that NaNs sort to the
+ * ends by sign.
+ */
+template<typename Item, typename Key>
+void cnSortRadix(Item* items, Item* scratch, Count count, Key key);
+
+
+/**
+ * Maps the Float to unsigned bits that order the same way, for radix sorting.
+ */
+inline unsigned long long cnSortRadix_bits(Float x) {
+  unsigned long long bits;
+  memcpy(&bits, &x, sizeof(bits));
+  // Flip all bits for negatives, and just the sign for positives.
+  return bits & (1ull << 63) ? ~bits : bits | (1ull << 63);
+}
+
+
 /**
  * Provides a usable string, including for the case of no data in the items
  * buffer. In this case, provides a static empty string. Therefore if the count
@@ -526,6 +708,14 @@ bool cnStringPushChar(String* string, char c);
 bool cnStringPushStr(String* string, const char* str);
 
 
+/**
+ * The default number of worker threads, taken from the CONCUNO_WORKERS
+ * environment variable if set to a positive number, or else the hardware
+ * concurrency. Always at least 1.
+ */
+Count cnWorkerCount(void);
+
+
 /**
  * Convenience for inline string streams.
  */
@@ -623,16 +813,44 @@ void log(const std::basic_ostream<char>& message);
 
 
 /**
- * Whether the given topic is being logged.
+ * Turns a topic on or off, with "all" for every topic at once. This overrides
+ * CONCUNO_LOG.
+ */
+void logEnable(const char* topic, bool enabled = true);
+
+
+/**
+ * Waits until everything logged so far has been written out. Log output goes
+ * to stdout from a background thread, so call this before writing straight to
+ * stdout when order matters.
+ */
+void logFlush();
+
+
+/**
+ * Whether the given topic is being logged. All topics are on by default, but
+ * the CONCUNO_LOG environment variable can give a comma-separated list of
+ * topics to turn on, or off with a leading "-", where later entries win. For
+ * example, "-all,learn" logs only the learn topic.
  */
 bool logging(const char* topic);
 
 
+/**
+ * A topic to log to, which remembers whether its topic is on, so checks in hot
+ * loops are only a couple of loads. Best kept around, as in static instances.
+ */
 struct Log {
 
   Log(const char* topic);
 
-  bool on();
+  bool on() {
+    Count state = this->state.load(std::memory_order_relaxed);
+    if ((state >> 1) != generation.load(std::memory_order_relaxed)) {
+      state = refresh();
+    }
+    return state & 1;
+  }
 
   void operator()(const char* message);
 
@@ -640,8 +858,29 @@ struct Log {
 
   void operator()(const std::basic_ostream<char>& message);
 
+  /**
+   * Writes printf-style text as is, without the topic or an added newline.
+   */
+  void print(const char* format, ...)
+    #ifdef __GNUC__
+      __attribute__((format(printf, 2, 3)))
+    #endif
+  ;
+
+  /**
+   * Bumped whenever topics change, so each Log knows to check again.
+   */
+  static std::atomic<Count> generation;
+
 private:
 
+  Count refresh();
+
+  /**
+   * The generation checked, times 2, plus 1 if on.
+   */
+  std::atomic<Count> state;
+
   const char* topic;
 
 };
@@ -654,6 +893,169 @@ private:
 std::string str(const std::basic_ostream<char>& buffer);
 
 
+// Template implementations.
+
+
+template<typename Item, typename Less>
+void cnSort_siftDown(Item* items, Index parent, Count count, Less& less) {
+  Item item = items[parent];
+  while (true) {
+    Index kid = 2 * parent + 1;
+    if (kid >= count) break;
+    if (kid + 1 < count && less(items[kid], items[kid + 1])) kid++;
+    if (!less(item, items[kid])) break;
+    items[parent] = items[kid];
+    parent = kid;
+  }
+  items[parent] = item;
+}
+
+
+/**
+ * Heapsort for when introsort partitions go too deep.
+ */
+template<typename Item, typename Less>
+void cnSort_heap(Item* begin, Item* end, Less& less) {
+  Count count = end - begin;
+  // Heapify, then pull the max to the end repeatedly.
+  for (Index top = count / 2 - 1; top >= 0; top--) {
+    cnSort_siftDown(begin, top, count, less);
+  }
+  for (Count size = count - 1; size > 0; size--) {
+    Item max = begin[0];
+    begin[0] = begin[size];
+    begin[size] = max;
+    cnSort_siftDown(begin, 0, size, less);
+  }
+}
+
+
+/**
+ * Stable insertion sort for short ranges.
+ */
+template<typename Item, typename Less>
+void cnSort_insertion(Item* begin, Item* end, Less& less) {
+  for (Item* i = begin + 1; i < end; i++) {
+    Item item = *i;
+    Item* j = i;
+    for (; j > begin && less(item, j[-1]); j--) *j = j[-1];
+    *j = item;
+  }
+}
+
+
+template<typename Item, typename Less>
+void cnSort_intro(Item* begin, Item* end, Count depth, Less& less) {
+  while (end - begin > 16) {
+    if (!depth--) {
+      cnSort_heap(begin, end, less);
+      return;
+    }
+    // Order the first, middle, and last, and use the middle as the pivot.
+    Item* a = begin;
+    Item* b = begin + (end - begin) / 2;
+    Item* c = end - 1;
+    Item temp;
+    if (less(*b, *a)) {temp = *a; *a = *b; *b = temp;}
+    if (less(*c, *b)) {
+      temp = *b; *b = *c; *c = temp;
+      if (less(*b, *a)) {temp = *a; *a = *b; *b = temp;}
+    }
+    Item pivot = *b;
+    // Hoare partition, with the ends already known to be on the right sides.
+    Item* i = begin;
+    Item* j = end - 1;
+    while (true) {
+      do i++; while (less(*i, pivot));
+      do j--; while (less(pivot, *j));
+      if (i >= j) break;
+      temp = *i; *i = *j; *j = temp;
+    }
+    // Recurse on the smaller side, and loop on the larger.
+    if (j + 1 - begin < end - (j + 1)) {
+      cnSort_intro(begin, j + 1, depth, less);
+      begin = j + 1;
+    } else {
+      cnSort_intro(j + 1, end, depth, less);
+      end = j + 1;
+    }
+  }
+  cnSort_insertion(begin, end, less);
+}
+
+
+template<typename Item, typename Less>
+void cnSort(Item* begin, Item* end, Less less) {
+  // Depth limit of twice the log of the count.
+  Count depth = 0;
+  for (Count count = end - begin; count > 1; count >>= 1) depth += 2;
+  if (end - begin > 1) cnSort_intro(begin, end, depth, less);
+}
+
+
+template<typename Item, typename Key>
+struct cnSortRadix_Less {
+  Key key;
+  bool operator()(const Item& a, const Item& b) {
+    return key(a) < key(b);
+  }
+};
+
+
+template<typename Item, typename Key>
+void cnSortRadix(Item* items, Item* scratch, Count count, Key key) {
+  Count counts[8][256];
+  Item* from = items;
+  Item* to = scratch;
+
+  // Insertion sort is faster for few, and it's also stable.
+  if (count < 64) {
+    cnSortRadix_Less<Item, Key> less = {key};
+    if (count > 1) cnSort_insertion(items, items + count, less);
+    return;
+  }
+
+  // Count all the bytes in one go.
+  for (Index b = 0; b < 8; b++) {
+    for (Index i = 0; i < 256; i++) counts[b][i] = 0;
+  }
+  for (Index i = 0; i < count; i++) {
+    unsigned long long bits = cnSortRadix_bits(key(items[i]));
+    for (Index b = 0; b < 8; b++) counts[b][(bits >> (8 * b)) & 0xFF]++;
+  }
+
+  // Scatter for each byte, least significant first.
+  for (Index b = 0; b < 8; b++) {
+    Count* byteCounts = counts[b];
+    Count total = 0;
+    // All in one bucket means this byte changes nothing.
+    bool skip = false;
+    for (Index i = 0; i < 256; i++) {
+      Count byteCount = byteCounts[i];
+      if (byteCount == count) {
+        skip = true;
+        break;
+      }
+      byteCounts[i] = total;
+      total += byteCount;
+    }
+    if (skip) continue;
+    for (Index i = 0; i < count; i++) {
+      unsigned long long bits = cnSortRadix_bits(key(from[i]));
+      to[byteCounts[(bits >> (8 * b)) & 0xFF]++] = from[i];
+    }
+    Item* temp = from;
+    from = to;
+    to = temp;
+  }
+
+  // Get back to the original space, if needed.
+  if (from != items) {
+    for (Index i = 0; i < count; i++) items[i] = from[i];
+  }
+}
+
+
 }
 
 
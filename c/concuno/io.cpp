@@ -1,4 +1,11 @@
+#include <fcntl.h>
+#include <glob.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "io.h"
 
 
@@ -51,6 +58,258 @@ bool cnDelimitInt(char** string, char** token, Int* i, char delimiter) {
 }
 
 
+FileMap::FileMap(): data(NULL), size(0) {}
+
+
+FileMap::~FileMap() {
+  dispose();
+}
+
+
+void FileMap::dispose() {
+  if (data) munmap(data, size);
+  data = NULL;
+  size = 0;
+}
+
+
+char* FileMap::line(char** at, String* last) {
+  char* end = data + size;
+  char* line = *at;
+  char* newline;
+
+  if (line >= end) return NULL;
+  if ((newline = reinterpret_cast<char*>(memchr(line, '\n', end - line)))) {
+    *newline = '\0';
+    *at = newline + 1;
+    return line;
+  }
+
+  // No room past the mapped end, so copy out the final line to terminate.
+  cnListClear(last);
+  if (!(cnListPushMulti(last, line, end - line) && cnListPush(last, ""))) {
+    throw Error("Failed to copy last line.");
+  }
+  *at = end;
+  return cnStr(last);
+}
+
+
+bool FileMap::map(const char* name) {
+  int file;
+  struct stat info;
+  bool result = false;
+
+  // Clear out the old, and find the size of the new.
+  dispose();
+  if ((file = open(name, O_RDONLY)) < 0) return false;
+  if (fstat(file, &info)) goto DONE;
+
+  // Nothing to map for empty files, but that's still a success.
+  if (info.st_size) {
+    // Private and writable, so in-place tokenizing doesn't touch the file.
+    void* mapped = mmap(
+      NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0
+    );
+    if (mapped == MAP_FAILED) goto DONE;
+    data = reinterpret_cast<char*>(mapped);
+    size = info.st_size;
+  }
+
+  // Winned.
+  result = true;
+
+  DONE:
+  // The mapping stays valid after close.
+  close(file);
+  return result;
+}
+
+
+/**
+ * Snapshot file header, before the key.
+ */
+const char cnSnapshotMagic[] = "cnsnap1";
+
+
+/**
+ * Returns the size padded to the 8 bytes used for snapshot alignment.
+ */
+Count cnSnapshotPadded(Count size);
+
+
+/**
+ * Returns the path to the snapshot file, named by kind and key hash.
+ */
+std::string cnSnapshotPath(Snapshot* snapshot);
+
+
+Snapshot::Snapshot(const char* $kind): at(NULL), kind($kind) {
+  const char* directory = getenv("CONCUNO_CACHE");
+  enabled = directory && *directory;
+  if (enabled) {
+    this->directory = directory;
+    key = kind;
+    key += '\n';
+  }
+}
+
+
+void Snapshot::addSource(const char* name) {
+  char numbers[64];
+  char* path;
+  struct stat info;
+
+  if (!enabled) return;
+  // Full paths, so working directories don't matter.
+  if (!(path = realpath(name, NULL)) || stat(path, &info)) {
+    free(path);
+    enabled = false;
+    return;
+  }
+  key += path;
+  free(path);
+  sprintf(
+    numbers, "\n%ld\n%ld.%09ld\n", (long)info.st_size,
+    (long)info.st_mtim.tv_sec, (long)info.st_mtim.tv_nsec
+  );
+  key += numbers;
+}
+
+
+bool Snapshot::load() {
+  Count keySize;
+  if (!(enabled && file.map(cnSnapshotPath(this).c_str()))) return false;
+  at = file.data;
+  // Check the header and full key, in case of hash collisions.
+  if (!(
+    file.size >= (Count)sizeof(cnSnapshotMagic) + (Count)sizeof(Count) &&
+    !memcmp(at, cnSnapshotMagic, sizeof(cnSnapshotMagic))
+  )) goto FAIL;
+  at += sizeof(cnSnapshotMagic);
+  keySize = *reinterpret_cast<Count*>(at);
+  at += sizeof(Count);
+  if (!(
+    keySize == (Count)key.size() &&
+    file.data + file.size - at >= cnSnapshotPadded(keySize) &&
+    !memcmp(at, key.data(), keySize)
+  )) goto FAIL;
+  at += cnSnapshotPadded(keySize);
+  return true;
+
+  FAIL:
+  file.dispose();
+  at = NULL;
+  return false;
+}
+
+
+const void* Snapshot::read(Count size) {
+  char* data = at;
+  Count padded = cnSnapshotPadded(size);
+  if (!at || size < 0 || file.data + file.size - at < padded) return NULL;
+  at += padded;
+  return data;
+}
+
+
+bool Snapshot::save() {
+  Count keySize = key.size();
+  char zeros[8] = {0};
+  std::string path;
+  std::string temp;
+  int out = -1;
+  bool result = false;
+
+  if (!enabled) return false;
+  path = cnSnapshotPath(this);
+  // Write to a temp file, then rename, so readers never see partial data.
+  temp = path + ".XXXXXX";
+  if ((out = mkstemp(&temp[0])) < 0) goto DONE;
+  if (!(
+    ::write(out, cnSnapshotMagic, sizeof(cnSnapshotMagic)) ==
+      (ssize_t)sizeof(cnSnapshotMagic) &&
+    ::write(out, &keySize, sizeof(Count)) == (ssize_t)sizeof(Count) &&
+    ::write(out, key.data(), keySize) == (ssize_t)keySize &&
+    ::write(out, zeros, cnSnapshotPadded(keySize) - keySize) ==
+      (ssize_t)(cnSnapshotPadded(keySize) - keySize)
+  )) goto DONE;
+  for (char* data = cnStr(&written); data < cnStr(&written) + written.count;) {
+    ssize_t size = ::write(out, data, cnStr(&written) + written.count - data);
+    if (size < 0) goto DONE;
+    data += size;
+  }
+  if (close(out)) {
+    out = -1;
+    goto DONE;
+  }
+  out = -1;
+  if (rename(temp.c_str(), path.c_str())) goto DONE;
+
+  // Winned.
+  result = true;
+
+  DONE:
+  if (out >= 0) close(out);
+  if (!result && !temp.empty()) unlink(temp.c_str());
+  // No need to keep the data around.
+  written.dispose();
+  return result;
+}
+
+
+bool Snapshot::write(const void* data, Count size) {
+  char zeros[8] = {0};
+  if (size && !cnListPushMulti(&written, data, size)) return false;
+  size = cnSnapshotPadded(size) - size;
+  return !size || cnListPushMulti(&written, zeros, size);
+}
+
+
+Count cnSnapshotPadded(Count size) {
+  return (size + 7) & ~7;
+}
+
+
+std::string cnSnapshotPath(Snapshot* snapshot) {
+  // FNV-1a, which is plenty for file names.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  char name[32];
+  for (size_t c = 0; c < snapshot->key.size(); c++) {
+    hash = (hash ^ (unsigned char)snapshot->key[c]) * 0x100000001b3ull;
+  }
+  sprintf(name, "-%016llx.snapshot", (unsigned long long)hash);
+  return snapshot->directory + "/" + snapshot->kind + name;
+}
+
+
+bool cnGlob(const char* pattern, std::vector<std::string>* paths) {
+  glob_t found;
+  bool result = false;
+
+  switch (glob(pattern, GLOB_NOCHECK, NULL, &found)) {
+  case 0:
+    break;
+  case GLOB_NOMATCH:
+    // Only if the pattern was empty, since we asked for no check.
+    result = true;
+    goto DONE;
+  default:
+    cnErrTo(DONE, "Failed to expand: %s", pattern);
+  }
+  for (size_t p = 0; p < found.gl_pathc; p++) {
+    paths->push_back(found.gl_pathv[p]);
+  }
+
+  // Winned.
+  result = true;
+
+  DONE:
+  globfree(&found);
+  return result;
+}
+
+
 bool cnIndent(String* indent) {
   return cnStringPushStr(indent, "  ");
 }
@@ -73,6 +332,87 @@ char cnParseChar(char* begin, char** end) {
   return *begin;
 }
 
+
+/**
+ * Powers of ten that are exactly representable as doubles. Dividing an exact
+ * mantissa by one of these rounds correctly in one step.
+ */
+static const Float cnParseFloat_powers[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/**
+ * Mantissas up to this many digits fit exactly in a double's 53 bits.
+ */
+#define cnParseFloat_MaxDigits 15
+
+Float cnParseFloat(char* begin, char** end) {
+  char* c = cnNextChar(begin);
+  Count digits = 0;
+  Count fractionDigits = 0;
+  unsigned long mantissa = 0;
+  bool negative = false;
+  Float value;
+
+  // Sign.
+  if (*c == '-' || *c == '+') {
+    negative = *c == '-';
+    c++;
+  }
+
+  // Whole and fractional digits.
+  for (; '0' <= *c && *c <= '9'; c++, digits++) {
+    mantissa = 10 * mantissa + (*c - '0');
+  }
+  if (*c == '.') {
+    for (c++; '0' <= *c && *c <= '9'; c++, digits++, fractionDigits++) {
+      mantissa = 10 * mantissa + (*c - '0');
+    }
+  }
+
+  // Anything unusual gets the full treatment.
+  if (
+    !digits || digits > cnParseFloat_MaxDigits ||
+    *c == 'e' || *c == 'E' || *c == 'x' || *c == 'X'
+  ) {
+    return strtod(begin, end);
+  }
+
+  // Fast path. Both values are exact, so one division rounds correctly.
+  value = mantissa / cnParseFloat_powers[fractionDigits];
+  *end = c;
+  return negative ? -value : value;
+}
+
+
+Int cnParseInt(char* begin, char** end) {
+  char* c = cnNextChar(begin);
+  Count digits = 0;
+  bool negative = false;
+  Int value = 0;
+
+  // Sign.
+  if (*c == '-' || *c == '+') {
+    negative = *c == '-';
+    c++;
+  }
+
+  // Digits.
+  for (; '0' <= *c && *c <= '9'; c++, digits++) {
+    value = 10 * value + (*c - '0');
+  }
+
+  // Say where we got.
+  if (!digits) {
+    *end = begin;
+    return 0;
+  }
+  *end = c;
+  return negative ? -value : value;
+}
+
+
 char* cnParseStr(char* begin, char** end) {
   bool pastSpace = false;
   char* c;
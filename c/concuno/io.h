@@ -2,6 +2,7 @@
 #define concuno_io_h
 
 #include <ctype.h>
+#include <string>
 
 #include "core.h"
 
@@ -21,6 +22,131 @@ namespace concuno {
 void cnDedent(String* indent);
 
 
+/**
+ * A whole file mapped privately into memory. Writes to the data are visible
+ * only to this process and never reach the file, so parsers can chop lines and
+ * tokens in place, as with cnParseStr.
+ *
+ * Empty files map successfully with null data and zero size.
+ */
+struct FileMap {
+
+  FileMap();
+
+  ~FileMap();
+
+  /**
+   * Unmaps any mapped data. Safe to call repeatedly.
+   */
+  void dispose();
+
+  /**
+   * Chops out the line starting at *at in place, and advances *at past it.
+   * Start with *at at data, and returns null when *at reaches the end.
+   *
+   * A final line without a newline has no room for a null char, so it gets
+   * copied into last instead. Throws if that copy fails.
+   */
+  char* line(char** at, String* last);
+
+  /**
+   * Maps the named file, first disposing of any previous mapping. Returns
+   * false on failure to open, stat, or map.
+   */
+  bool map(const char* name);
+
+  char* data;
+
+  Count size;
+
+};
+
+
+/**
+ * A binary snapshot of data parsed from source files, so that later runs can
+ * map it instead of parsing again. Snapshots are opt-in, used only when the
+ * CONCUNO_CACHE environment variable names a directory to keep them in.
+ *
+ * Each snapshot is keyed by a kind, which should change along with the layout
+ * of what gets written, and by the path, size, and modification time of each
+ * source. Any change to the sources means a miss, and the data gets parsed and
+ * saved again.
+ *
+ * Written data is buffered until save, and each write is padded to 8 bytes, so
+ * reads of aligned structs can point straight into the mapped file.
+ */
+struct Snapshot {
+
+  /**
+   * Disabled if CONCUNO_CACHE isn't set.
+   */
+  Snapshot(const char* kind);
+
+  /**
+   * Adds the named file to the key. If it can't be found, the snapshot is
+   * disabled.
+   */
+  void addSource(const char* name);
+
+  /**
+   * Maps the snapshot if it exists and matches the key. Returns false if not,
+   * including when disabled.
+   */
+  bool load();
+
+  /**
+   * Returns a pointer to the next size bytes in the mapped snapshot, or null
+   * if past the end. Pointers are good only while the snapshot exists.
+   */
+  const void* read(Count size);
+
+  /**
+   * Writes out the buffered data under the key, replacing any old snapshot.
+   * Returns false if disabled or on failure.
+   */
+  bool save();
+
+  /**
+   * Buffers data to be saved. Returns false on allocation failure.
+   */
+  bool write(const void* data, Count size);
+
+  /**
+   * The current position in file.
+   */
+  char* at;
+
+  /**
+   * Where the snapshots are, if enabled.
+   */
+  std::string directory;
+
+  /**
+   * Whether caching is on and the sources were all found. Check this to skip
+   * the trouble of writing when nothing will be saved.
+   */
+  bool enabled;
+
+  /**
+   * The mapped snapshot, after a successful load.
+   */
+  FileMap file;
+
+  /**
+   * Identifies the source files and the kind of snapshot.
+   */
+  std::string key;
+
+  std::string kind;
+
+  /**
+   * Data written so far, waiting for save.
+   */
+  String written;
+
+};
+
+
 /**
  * Finds the first delimiter in the string, replaces it with a null char,
  * changes string to point past the placed null char, and returns the address of
@@ -46,6 +172,15 @@ char* cnDelimit(char** string, char delimiter);
 bool cnDelimitInt(char** string, char** token, Int* i, char delimiter);
 
 
+/**
+ * Appends to paths the file names matching the shell wildcard pattern, in
+ * sorted order. A pattern matching nothing is appended as is, so that later
+ * attempts to open it can report the problem by name. Returns false only on
+ * read errors or lack of memory.
+ */
+bool cnGlob(const char* pattern, std::vector<std::string>* paths);
+
+
 /**
  * Increase the indent by the canonical amount.
  *
@@ -72,6 +207,26 @@ char* cnNextChar(char* begin);
 char cnParseChar(char* begin, char** end);
 
 
+/**
+ * Parses a number after any leading whitespace, like strtod, and sets end past
+ * the number. Plain decimals with few enough digits are converted directly and
+ * with exact rounding. Anything else (exponents, hex, inf, long mantissas) goes
+ * through strtod.
+ *
+ * If no number is found, returns 0 and sets end to begin.
+ */
+Float cnParseFloat(char* begin, char** end);
+
+
+/**
+ * Parses a base 10 integer after any leading whitespace, like strtol, and sets
+ * end past the number. No overflow checking is done.
+ *
+ * If no number is found, returns 0 and sets end to begin.
+ */
+Int cnParseInt(char* begin, char** end);
+
+
 /**
  * Finds a non-whitespace string if it exists, overwriting the first trailing
  * whitespace (if any) with a null char. The end will point past that null
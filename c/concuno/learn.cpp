@@ -1,11 +1,15 @@
+#include <float.h>
 #include <limits.h>
 #include <math.h>
 #include <string.h>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include "learn.h"
 #include "mat.h"
+#include "profile.h"
+#include "search.h"
 #include "stats.h"
 
 
@@ -15,6 +19,16 @@ using namespace std;
 namespace concuno {
 
 
+/**
+ * Log topics for learning. Leaf and split output comes from inner loops, so
+ * those are the first to turn off for big runs.
+ */
+static Log learnLog("learn");
+static Log leafLog("leaf");
+static Log splitLog("split");
+static Log verifyLog("verify");
+
+
 /**
  * Tracks the distance to a bag from some point.
  */
@@ -30,15 +44,63 @@ struct BagDistance {
    */
   Float far;
 
+  /**
+   * An upper bound on the distances of all points besides the far one, or -1
+   * if there are none.
+   */
+  Float farOther;
+
+  /**
+   * The index among the bag's valid points of the one at the far distance, or
+   * -1 if there are none.
+   */
+  Index farIndex;
+
   /**
    * The nearest distance in this bag.
    */
   Float near;
 
   /**
-   * The actual point itself as stored in the point bag.
+   * A lower bound on the distances of all points besides the near one, or
+   * infinity if there are none.
+   */
+  Float nearOther;
+
+  /**
+   * The index among the bag's valid points of the one at the near distance, or
+   * -1 if there are none. See PointMatrix::validPoint for the point itself.
+   */
+  Index nearIndex;
+
+};
+
+
+/**
+ * A candidate tree during beam search, used as a cnSearchOption.
+ */
+struct BeamOption {
+
+  /**
+   * How many expansions this tree is beyond the initial tree.
+   */
+  Count depth;
+
+  /**
+   * For bootstrapping when stepping from this option, split from its parent's,
+   * so results don't depend on which thread takes which step.
+   */
+  Random random;
+
+  /**
+   * The log metric of the tree on the validation bags, where higher is better.
    */
-  Float* nearPoint;
+  Float score;
+
+  /**
+   * The candidate tree, owned by the option.
+   */
+  RootNode* tree;
 
 };
 
@@ -87,6 +149,11 @@ struct LearnerConfig {
 
   RootNode* previous;
 
+  /**
+   * The random stream for bootstrapping. Parallel work needs one apiece.
+   */
+  Random random;
+
   /**
    * Abusively referencing other list elsewhere.
    */
@@ -100,6 +167,67 @@ struct LearnerConfig {
 };
 
 
+/**
+ * We need to track near and far distances in a nice sorted list. This lets us
+ * do that.
+ */
+typedef enum {
+  cnChooseThreshold_Both, cnChooseThreshold_Far, cnChooseThreshold_Near
+} cnChooseThreshold_Edge;
+
+typedef struct {
+  BagDistance* distance;
+  cnChooseThreshold_Edge edge;
+  /**
+   * The distance at this edge, kept here as the sort key.
+   */
+  Float value;
+} cnChooseThreshold_Distance;
+
+
+/**
+ * Bag distances and sorted edges from the last center given to
+ * cnChooseThreshold, kept so nearby centers can update them rather than start
+ * over.
+ *
+ * When the center moves by some delta, no point distance changes by more than
+ * delta, by the triangle inequality. So bounds on the other points in each bag
+ * loosen by delta, and if the old near and far points still beat them, the bag
+ * needs just those two distances. Other bags get rescanned. If few needed
+ * that, edges are nearly in order and get repaired by insertion sort.
+ *
+ * Bounds are kept per bag rather than per point, since distances here usually
+ * have few dimensions and cost about as much as checking bounds would.
+ *
+ * This needs a true metric, so it applies only to MahalanobisDistanceFunction,
+ * which is Euclidean so far. Use each cache with only one list of point bags.
+ */
+struct ThresholdCache {
+
+  ThresholdCache();
+
+  ~ThresholdCache();
+
+  /**
+   * The center for the current distances, or empty if none yet.
+   */
+  List<Float> center;
+
+  /**
+   * One for each point bag.
+   */
+  List<BagDistance> distances;
+
+  /**
+   * Sorted edges, followed by space for as many again as sort scratch space.
+   */
+  cnChooseThreshold_Distance* edges;
+
+  Count edgeCount;
+
+};
+
+
 /**
  * Get the best point based on pseudo diverse density.
  *
@@ -145,6 +273,9 @@ bool cnBestPointByScore(
  * On the other hand, threshold is only a return value, if the given pointer is
  * not null.
  *
+ * The cache, if not null, carries distances across calls for the same point
+ * bags, so that nearby centers cost less.
+ *
  * TODO Provide a list of all contained positive points at end.
  *
  * TODO Actually, all I do here is find distances then pick a threshold.
@@ -153,14 +284,15 @@ bool cnChooseThreshold(
   bool yesLabel,
   Function* distanceFunction, List<PointBag>* pointBags,
   Float* score, Float* threshold,
-  List<Float>* nearPosPoints, List<Float>* nearNegPoints
+  List<Float>* nearPosPoints, List<Float>* nearNegPoints,
+  ThresholdCache* cache
 );
 
 
 /**
- * Choose a threshold on the following distances to maximize the "noisy-and
- * noisy-or" metric, assuming that this determination is the only thing that
- * matters (no leaves elsewhere).
+ * Choose a threshold on the following sorted distance edges to maximize the
+ * "noisy-and noisy-or" metric, assuming that this determination is the only
+ * thing that matters (no leaves elsewhere).
  *
  * If score is not null, assign the highest score to it. Also consider any
  * previously held values to be the highest previously. Therefore, if you
@@ -173,8 +305,8 @@ bool cnChooseThreshold(
  */
 Float cnChooseThresholdWithDistances(
   bool yesLabel,
-  BagDistance* distances, BagDistance* distancesEnd, Float* score,
-  List<Float>* nearPosPoints, List<Float>* nearNegPoints
+  cnChooseThreshold_Distance* dists, cnChooseThreshold_Distance* distsEnd,
+  Float* score, List<Float>* nearPosPoints, List<Float>* nearNegPoints
 );
 
 
@@ -192,11 +324,25 @@ bool cnExpansionRedundant(
 );
 
 
+/**
+ * Describes the expansion, such as for logs and trace spans.
+ */
+string cnExpansionString(Expansion* expansion);
+
+
 bool cnLearnSplitModel(
   Learner* learner, SplitNode* split, List<BindingBag>* bindingBags
 );
 
 
+/**
+ * Searches for the best tree with a beam of config->learner->beamWidth trees,
+ * starting from the given tree, which is left alone. Returns null if nothing
+ * improved on the initial tree.
+ */
+RootNode* cnLearnTreeByBeam(LearnerConfig* config, RootNode* initialTree);
+
+
 void cnLogPointBags(SplitNode* split, List<PointBag>* pointBags);
 
 
@@ -206,6 +352,14 @@ LeafNode* cnPickBestLeaf(RootNode* tree, List<Bag>* bags);
 void cnPrintExpansion(Expansion* expansion);
 
 
+/**
+ * Pushes all the expansions that could replace the given leaf.
+ */
+bool cnPushExpansionsAtLeaf(
+  LearnerConfig* config, LeafNode* leaf, List<Expansion>* expansions
+);
+
+
 bool cnPushExpansionsByIndices(
   List<Expansion>* expansions, Expansion* prototype, Count varDepth
 );
@@ -230,7 +384,8 @@ bool cnUpdateLeafProbabilitiesWithBindingBags(
 
 /**
  * Performs a statistical test to verify that the candidate tree is a
- * significant improvement over the previous score.
+ * significant improvement over the previous score. Large validation sets with
+ * clear results use a normal approximation, and others use a bootstrap.
  *
  * Returns true for non-error. The test result comes through the result param.
  */
@@ -246,13 +401,19 @@ LearnerConfig::~LearnerConfig() {
 }
 
 
+ThresholdCache::ThresholdCache(): edges(NULL), edgeCount(0) {}
+
+
+ThresholdCache::~ThresholdCache() {
+  free(edges);
+}
+
+
 void cnBuildInitialKernel(Topology::Type topology, List<PointBag>* pointBags) {
   Float* positivePoint;
   Float* positivePoints = NULL;
   Count positivePointCount;
-  Float* matrixEnd;
   Count valueCount = 0; // per point.
-  Float* point;
 
   if (topology != Topology::Euclidean) {
     throw Error(Buf() << "I handle only Euclidean right now, not " << topology);
@@ -268,20 +429,7 @@ void cnBuildInitialKernel(Topology::Type topology, List<PointBag>* pointBags) {
   cnListEachBegin(pointBags, PointBag, pointBag) {
     // Just use the positives for the initial kernel.
     if (!pointBag->bag->label) continue;
-    point = pointBag->pointMatrix.points;
-    matrixEnd = point + pointBag->pointMatrix.pointCount * valueCount;
-    for (; point < matrixEnd; point += valueCount) {
-      bool allGood = true;
-      Float* value = point;
-      Float* pointEnd = point + valueCount;
-      for (value = point; value < pointEnd; value++) {
-        if (cnIsNaN(*value)) {
-          allGood = false;
-          break;
-        }
-      }
-      positivePointCount += allGood;
-    }
+    positivePointCount += pointBag->pointMatrix.validCount;
   } cnEnd;
 
   if (!positivePointCount) {
@@ -297,23 +445,12 @@ void cnBuildInitialKernel(Topology::Type topology, List<PointBag>* pointBags) {
   cnListEachBegin(pointBags, PointBag, pointBag) {
     // Just use the positives for the initial kernel.
     if (!pointBag->bag->label) continue;
-    point = pointBag->pointMatrix.points;
-    matrixEnd = point + pointBag->pointMatrix.pointCount * valueCount;
-    for (; point < matrixEnd; point += valueCount) {
-      bool allGood = true;
-      Float *value = point, *positiveValue = positivePoint;
-      Float* pointEnd = point + valueCount;
-      for (value = point; value < pointEnd; value++, positiveValue++) {
-        if (cnIsNaN(*value)) {
-          allGood = false;
-          break;
-        }
-        *positiveValue = *value;
-      }
-      if (allGood) {
-        // Move to the next.
-        positivePoint += valueCount;
-      }
+    for (Index v = 0; v < pointBag->pointMatrix.validCount; v++) {
+      memcpy(
+        positivePoint, pointBag->pointMatrix.validPoint(v),
+        valueCount * sizeof(Float)
+      );
+      positivePoint += valueCount;
     }
   } cnEnd;
 
@@ -356,29 +493,19 @@ Float* cnBestPointByDiverseDensity(
   Buf line;
   line << "DD-ish: ";
   cnListEachBegin(pointBags, PointBag, pointBag) {
-    Float* point = pointBag->pointMatrix.points;
-    Float* matrixEnd = point + pointBag->pointMatrix.pointCount * valueCount;
     if (!pointBag->bag->label) continue;
     if (posBagCount++ >= maxPosBags) break;
     line << "B ";
-    for (; point < matrixEnd; point += valueCount) {
+    for (Index v = 0; v < pointBag->pointMatrix.validCount; v++) {
       Float sumNegMin = 0, sumPosMin = 0;
-      bool allGood = true;
+      Float* point = pointBag->pointMatrix.validPoint(v);
       Float* value;
       Float* pointEnd = point + valueCount;
-      for (value = point; value < pointEnd; value++) {
-        if (cnIsNaN(*value)) {
-          allGood = false;
-          break;
-        }
-      }
-      if (!allGood) continue;
       cnListEachBegin(pointBags, PointBag, pointBag2) {
+        // NaN points never get closer, so skip them entirely.
         Float minDistance = HUGE_VAL;
-        Float* point2 = pointBag2->pointMatrix.points;
-        Float* matrixEnd2 =
-          point2 + pointBag2->pointMatrix.pointCount * valueCount;
-        for (; point2 < matrixEnd2; point2 += valueCount) {
+        for (Index v2 = 0; v2 < pointBag2->pointMatrix.validCount; v2++) {
+          Float* point2 = pointBag2->pointMatrix.validPoint(v2);
           Float distance = 0;
           Float* value2;
           for (
@@ -428,10 +555,11 @@ bool cnBestPointByScore(
 ) {
   Float bestScore = -HUGE_VAL, score = bestScore;
   // TODO Allow looking at negatives???
-  Log log("scanByPointScore");
-  Log logEach("scanByPointScore/each");
+  static Log log("scanByPointScore");
+  static Log logEach("scanByPointScore/each");
   Count negBagsLeft = 0, posBagsLeft = 8;
   bool result = false;
+  TraceSpan span("cnBestPointByScore");
   Float threshold;
   Count valueCount = pointBags->count ?
     ((PointBag*)pointBags->items)->pointMatrix.valueCount : 0;
@@ -461,6 +589,8 @@ bool cnBestPointByScore(
 
   // Init point list.
   List<Float> posPointsIn(valueCount);
+  // Consecutive centers are usually near each other, so reuse distances.
+  ThresholdCache cache;
 
   // No best yet.
   *bestFunction = NULL;
@@ -468,9 +598,6 @@ bool cnBestPointByScore(
 
   log("Start");
   cnListEachBegin(pointBags, PointBag, pointBag) {
-    Float* point = pointBag->pointMatrix.points;
-    Float* matrixEnd = point + pointBag->pointMatrix.pointCount * valueCount;
-
     // See if we have already looked at enough bags.
     if (!(posBagsLeft || negBagsLeft)) break;
     if (pointBag->bag->label) {
@@ -482,22 +609,12 @@ bool cnBestPointByScore(
     }
 
     // Guess we're going to try this one out.
-    log(
+    cnLog(log,
       Buf() << "Looking in bag labeled " << (pointBag->bag->label ? '+' : '-')
       << " with " << pointBag->pointMatrix.pointCount << " points"
     );
-    fflush(stdout);
-    for (; point < matrixEnd; point += valueCount) {
-      bool allGood = true;
-      Float* value;
-      Float* pointEnd = point + valueCount;
-      for (value = point; value < pointEnd; value++) {
-        if (cnIsNaN(*value)) {
-          allGood = false;
-          break;
-        }
-      }
-      if (!allGood) continue;
+    for (Index v = 0; v < pointBag->pointMatrix.validCount; v++) {
+      Float* point = pointBag->pointMatrix.validPoint(v);
 
       // TODO Check all bests so far. We don't want too many. How to limit?
       // TODO Push everything onto the big heap? Probably not. Too much to
@@ -529,7 +646,8 @@ bool cnBestPointByScore(
       cnListClear(&posPointsIn);
       if (!cnChooseThreshold(
         pointBag->bag->label,
-        distanceFunction, pointBags, &score, &threshold, &posPointsIn, NULL
+        distanceFunction, pointBags, &score, &threshold, &posPointsIn, NULL,
+        &cache
       )) throw Error("Search failed.");
 
       if (logEach.on()) {
@@ -554,11 +672,13 @@ bool cnBestPointByScore(
         if (!cnChooseThreshold(
           pointBag->bag->label,
           distanceFunction, pointBags, &fittedScore, &threshold,
-          &posPointsIn, NULL
+          &posPointsIn, NULL, &cache
         )) cnErrTo(DONE, "Search failed.");
         if (fittedScore < score) {
           // TODO This happens frequently, even for better end results. Why?
-          log(Buf() << "Fit worse (" << fittedScore << " < " << score << ")!");
+          cnLog(log,
+            Buf() << "Fit worse (" << fittedScore << " < " << score << ")!"
+          );
         }
 
         if (log.on()) {
@@ -578,8 +698,7 @@ bool cnBestPointByScore(
       SKIP_POINT:
       // Progress tracker.
       if (log.on()) {
-        Count pointsSoFar =
-          1 + (point - (Float*)pointBag->pointMatrix.points) / valueCount;
+        Count pointsSoFar = 1 + pointBag->pointMatrix.validIndices[v];
         if (pointsSoFar % 100 == 0) {
           log(Buf() << "Points so far: " << pointsSoFar);
         }
@@ -595,127 +714,487 @@ bool cnBestPointByScore(
 }
 
 
+Float cnChooseThreshold_edgeDist(const cnChooseThreshold_Distance* dist) {
+  return dist->value;
+}
+
+struct cnChooseThreshold_Key {
+  Float operator()(const cnChooseThreshold_Distance& dist) {
+    return dist.value;
+  }
+};
+
+/**
+ * Orders by value, then by the order edges are first built, to match the
+ * stable radix sort.
+ */
+struct cnChooseThreshold_Less {
+  BagDistance* distances;
+  Index order(const cnChooseThreshold_Distance& dist) {
+    return
+      2 * (dist.distance - distances) + (dist.edge == cnChooseThreshold_Far);
+  }
+  bool operator()(
+    const cnChooseThreshold_Distance& a, const cnChooseThreshold_Distance& b
+  ) {
+    return a.value < b.value || (a.value == b.value && order(a) < order(b));
+  }
+};
+
+/**
+ * Builds the edges from scratch and sorts them.
+ */
+bool cnChooseThreshold_rebuildEdges(ThresholdCache* cache) {
+  Count bagCount = cache->distances.count;
+  cnChooseThreshold_Distance* dist;
+
+  // Allocate sort scratch space along with the dists.
+  free(cache->edges);
+  cache->edgeCount = 0;
+  cache->edges = cnAlloc(cnChooseThreshold_Distance, 4 * bagCount);
+  if (!cache->edges && bagCount) return false;
+
+  // Init the pointer array.
+  dist = cache->edges;
+  cnListEachBegin(&cache->distances, BagDistance, distance) {
+    if (distance->near < HUGE_VAL) {
+      // It's not an error case, so include it.
+      // Reference the distance, and move on.
+      dist->distance = distance;
+      // The distances themselves. For both, we can use either.
+      dist->value = distance->near;
+      if (distance->near == distance->far) {
+        dist->edge = cnChooseThreshold_Both;
+        // In these cases, we don't store both sides. Just a single "Both".
+        // Technically, we could, but complication just shifts. In this case,
+        // it would move to the compare function that would need to make sure
+        // to sort nears before fars.
+      } else {
+        // Put in the near side.
+        dist->edge = cnChooseThreshold_Near;
+        // And the far.
+        dist++;
+        dist->distance = distance;
+        dist->edge = cnChooseThreshold_Far;
+        dist->value = distance->far;
+      }
+      // Move on.
+      dist++;
+    }
+    // Otherwise, it's an error case. Leave out both near and far ends.
+    // TODO Is err probability relevant to the grand metric here? Here, it's
+    // TODO just about bags with only err so far. We've ignored the case where
+    // TODO only some bindings are err. They could impact, but just let those
+    // TODO be considered as foreign leaves at some point, not kids. A big
+    // TODO loop could prune those bags in later rounds if the err leaf picks
+    // TODO them up.
+  } cnEnd;
+  cache->edgeCount = dist - cache->edges;
+
+  // Sort it. Radix sort is stable, so ties keep their original order.
+  cnProfileCount(Profile::ThresholdSorts);
+  cnSortRadix(
+    cache->edges, cache->edges + 2 * bagCount, cache->edgeCount,
+    cnChooseThreshold_Key()
+  );
+  return true;
+}
+
+/**
+ * Updates edge values for new distances, and fixes their order by insertion
+ * sort, since they should be nearly sorted already. Gives up, returning false,
+ * if any bag moved between both and separate edges or if the order is too far
+ * off to be worth it.
+ */
+bool cnChooseThreshold_repairEdges(ThresholdCache* cache) {
+  cnChooseThreshold_Distance* edges = cache->edges;
+  cnChooseThreshold_Distance* edgesEnd = edges + cache->edgeCount;
+  cnChooseThreshold_Less less = {(BagDistance*)cache->distances.items};
+  // Beyond a few moves per edge, just start over.
+  Count movesLeft = 2 * cache->edgeCount;
+
+  // Update values first.
+  for (cnChooseThreshold_Distance* dist = edges; dist < edgesEnd; dist++) {
+    BagDistance* distance = dist->distance;
+    bool both = distance->near == distance->far;
+    if (both != (dist->edge == cnChooseThreshold_Both)) return false;
+    dist->value =
+      dist->edge == cnChooseThreshold_Far ? distance->far : distance->near;
+  }
+
+  // Now insertion sort.
+  for (cnChooseThreshold_Distance* i = edges + 1; i < edgesEnd; i++) {
+    cnChooseThreshold_Distance dist = *i;
+    cnChooseThreshold_Distance* j = i;
+    for (; j > edges && less(dist, j[-1]); j--) {
+      if (!movesLeft--) {
+        // Put it back down so nothing's lost, though order doesn't matter now.
+        *j = dist;
+        return false;
+      }
+      *j = j[-1];
+    }
+    *j = dist;
+  }
+  cnProfileCount(Profile::ThresholdRepairs);
+  return true;
+}
+
+/**
+ * Euclidean distance over single-precision values, matching
+ * cnMahalanobisDistance, which doesn't apply covariance yet.
+ */
+float cnChooseThreshold_singleDistance(
+  const float* center, const float* point, Count valueCount
+) {
+  float sum = 0;
+  for (Index i = 0; i < valueCount; i++) {
+    float diff = point[i] - center[i];
+    sum += diff * diff;
+  }
+  return sqrtf(sum);
+}
+
+/**
+ * Finds near and far distances for the bag, along with bounds on the others.
+ */
+void cnChooseThreshold_scanBag(
+  BagDistance* distance, Function* distanceFunction
+) {
+  PointMatrix* matrix = &distance->bag->pointMatrix;
+  // Min is really 0, but -1 lets us see unchanged values.
+  Float far = -1, farOther = -1;
+  Float near = HUGE_VAL, nearOther = HUGE_VAL;
+  Index farIndex = -1;
+  Index nearIndex = -1;
+
+  // Look at each point in the bag. Work in locals, since the distance
+  // function could alias anything. NaN points would fail every comparison
+  // anyway, so look only at the valid ones.
+  cnProfileCount(Profile::Distances, matrix->validCount);
+  for (Index v = 0; v < matrix->validCount; v++) {
+    // Find the distance and compare.
+    Float currentDistance;
+    distanceFunction->evaluate(matrix->validPoint(v), &currentDistance);
+    if (currentDistance > far) {
+      // New max found.
+      farOther = far;
+      far = currentDistance;
+      farIndex = v;
+    } else if (currentDistance > farOther) {
+      farOther = currentDistance;
+    }
+    if (currentDistance < near) {
+      // New min found.
+      nearOther = near;
+      near = currentDistance;
+      // Remember the near point for later, for when we want that.
+      nearIndex = v;
+    } else if (currentDistance < nearOther) {
+      nearOther = currentDistance;
+    }
+  }
+
+  // Flip any unset far also to infinity.
+  distance->far = far < 0 ? HUGE_VAL : far;
+  distance->farOther = farOther;
+  distance->farIndex = farIndex;
+  distance->near = near;
+  distance->nearOther = nearOther;
+  distance->nearIndex = nearIndex;
+}
+
+/**
+ * Like cnChooseThreshold_scanBag, but streams the single-precision points to
+ * find candidates, then settles the near and far with full distances. That
+ * gives the same near and far points and distances as the full scan, even
+ * for near ties, and the bounds stay valid, only a bit looser.
+ *
+ * The center scale is the largest absolute value in the center.
+ */
+void cnChooseThreshold_scanBagSingle(
+  BagDistance* distance, Function* distanceFunction,
+  const float* singleCenter, Float centerScale
+) {
+  PointMatrix* matrix = &distance->bag->pointMatrix;
+  Count valueCount = matrix->valueCount;
+  // Single distances are within this of full ones, generously, from rounding
+  // of the values and the arithmetic.
+  Float tolerance =
+    FLT_EPSILON * (valueCount + 2) * (1 + sqrt(Float(valueCount))) *
+    (matrix->singleScale + centerScale);
+  float far = -1, farOther = -1;
+  float near = HUGE_VALF, nearOther = HUGE_VALF;
+  Index farIndex = -1;
+  Index nearIndex = -1;
+  const float* point = matrix->singlePoints;
+
+  // Find the single precision extremes, along with the runners up. These count
+  // as distances, but the few full ones to settle them don't.
+  cnProfileCount(Profile::Distances, matrix->validCount);
+  for (Index v = 0; v < matrix->validCount; v++, point += valueCount) {
+    float currentDistance =
+      cnChooseThreshold_singleDistance(singleCenter, point, valueCount);
+    if (currentDistance > far) {
+      farOther = far;
+      far = currentDistance;
+      farIndex = v;
+    } else if (currentDistance > farOther) {
+      farOther = currentDistance;
+    }
+    if (currentDistance < near) {
+      nearOther = near;
+      near = currentDistance;
+      nearIndex = v;
+    } else if (currentDistance < nearOther) {
+      nearOther = currentDistance;
+    }
+  }
+
+  // No valid points means nothing more to do.
+  if (nearIndex < 0) {
+    distance->far = HUGE_VAL;
+    distance->farOther = -1;
+    distance->farIndex = -1;
+    distance->near = HUGE_VAL;
+    distance->nearOther = HUGE_VAL;
+    distance->nearIndex = -1;
+    return;
+  }
+
+  if (
+    nearOther - near > 2 * tolerance &&
+    (farOther < 0 || far - farOther > 2 * tolerance)
+  ) {
+    // Clear winners both ways, so we just need their full distances.
+    distanceFunction->evaluate(
+      matrix->validPoint(nearIndex), &distance->near
+    );
+    if (farIndex == nearIndex) {
+      distance->far = distance->near;
+    } else {
+      distanceFunction->evaluate(matrix->validPoint(farIndex), &distance->far);
+    }
+    distance->farOther = farOther < 0 ? -1 : farOther + tolerance;
+    distance->farIndex = farIndex;
+    distance->nearOther =
+      nearOther == HUGE_VALF ? HUGE_VAL : nearOther - tolerance;
+    distance->nearIndex = nearIndex;
+  } else {
+    // Near ties, so compare full distances for anything that could win. Rare
+    // enough that another pass beats tracking candidates.
+    Float farCut = far - 2 * tolerance;
+    Float nearCut = near + 2 * tolerance;
+    Float fullFar = -1, fullFarOther = -1;
+    Float fullNear = HUGE_VAL, fullNearOther = HUGE_VAL;
+    point = matrix->singlePoints;
+    farIndex = nearIndex = -1;
+    for (Index v = 0; v < matrix->validCount; v++, point += valueCount) {
+      float currentDistance =
+        cnChooseThreshold_singleDistance(singleCenter, point, valueCount);
+      Float fullDistance;
+      if (currentDistance < farCut && currentDistance > nearCut) {
+        // Neither, but they still bound the others.
+        fullFarOther = max(fullFarOther, currentDistance + tolerance);
+        fullNearOther = min(fullNearOther, currentDistance - tolerance);
+        continue;
+      }
+      distanceFunction->evaluate(matrix->validPoint(v), &fullDistance);
+      if (fullDistance > fullFar) {
+        fullFarOther = max(fullFarOther, fullFar);
+        fullFar = fullDistance;
+        farIndex = v;
+      } else {
+        fullFarOther = max(fullFarOther, fullDistance);
+      }
+      if (fullDistance < fullNear) {
+        fullNearOther = min(fullNearOther, fullNear);
+        fullNear = fullDistance;
+        nearIndex = v;
+      } else {
+        fullNearOther = min(fullNearOther, fullDistance);
+      }
+    }
+    distance->far = fullFar;
+    distance->farOther = fullFarOther;
+    distance->farIndex = farIndex;
+    distance->near = fullNear;
+    distance->nearOther = fullNearOther;
+    distance->nearIndex = nearIndex;
+  }
+}
+
+/**
+ * Updates the bag for a center moved by delta, rescanning unless bounds prove
+ * that the near and far points stay the same. The near must win strictly,
+ * since the first of equals is what we'd find by scanning.
+ *
+ * Returns whether the bag needed a full scan.
+ */
+bool cnChooseThreshold_updateBag(
+  BagDistance* distance, Function* distanceFunction,
+  const float* singleCenter, Float centerScale, Float delta
+) {
+  PointMatrix* matrix = &distance->bag->pointMatrix;
+
+  // No valid points means nothing changes.
+  if (distance->nearIndex < 0) return false;
+
+  // Loosen the bounds, with a bit extra in case of rounding error.
+  delta += 1e-12 * (delta + distance->far);
+  if (distance->farOther >= 0) distance->farOther += delta;
+  if (distance->nearOther < HUGE_VAL) distance->nearOther -= delta;
+
+  // The near and far themselves move by delta at most, too, so check those
+  // bounds before spending any time on distances.
+  if (!(
+    distance->near + delta < distance->nearOther &&
+    distance->far - delta >= distance->farOther
+  )) {
+    if (singleCenter) {
+      cnChooseThreshold_scanBagSingle(
+        distance, distanceFunction, singleCenter, centerScale
+      );
+    } else {
+      cnChooseThreshold_scanBag(distance, distanceFunction);
+    }
+    return true;
+  }
+
+  // The old near and far still win, so we just need their new distances.
+  cnProfileCount(
+    Profile::Distances, 1 + (distance->farIndex != distance->nearIndex)
+  );
+  distanceFunction->evaluate(
+    matrix->validPoint(distance->nearIndex), &distance->near
+  );
+  if (distance->farIndex == distance->nearIndex) {
+    distance->far = distance->near;
+  } else {
+    distanceFunction->evaluate(
+      matrix->validPoint(distance->farIndex), &distance->far
+    );
+  }
+  return false;
+}
+
 bool cnChooseThreshold(
   bool yesLabel,
   Function* distanceFunction, List<PointBag>* pointBags,
   Float* score, Float* threshold,
-  List<Float>* nearPosPoints, List<Float>* nearNegPoints
+  List<Float>* nearPosPoints, List<Float>* nearNegPoints,
+  ThresholdCache* cache
 ) {
   Count valueCount = pointBags->count ?
     ((PointBag*)pointBags->items)->pointMatrix.valueCount : 0;
-  BagDistance* distance;
-  BagDistance* distances = cnAlloc(BagDistance, pointBags->count);
-  BagDistance* distancesEnd = distances + pointBags->count;
+  ThresholdCache localCache;
+  MahalanobisDistanceFunction* metric =
+    dynamic_cast<MahalanobisDistanceFunction*>(distanceFunction);
+  Float* center = metric ? metric->gaussian->mean : NULL;
+  Float centerScale = 0;
+  Float delta;
+  bool repair = false;
+  float* singleCenter = NULL;
+  bool update;
   bool result = false;
   Float thresholdStorage;
-
-  if (!distances) cnErrTo(DONE, "No distances.");
+  ProfileTimer timer(Profile::ChooseThreshold);
 
   // For convenience, point threshold at least somewhere.
   if (!threshold) threshold = &thresholdStorage;
-  // Init distances to infinity.
-  distance = distances;
-  cnListEachBegin(pointBags, PointBag, pointBag) {
-    distance->bag = pointBag;
-    // Min is really 0, but -1 lets us see unchanged values.
-    distance->far = -1;
-    distance->near = HUGE_VAL;
-    distance->nearPoint = NULL;
-    distance++;
-  } cnEnd;
-  // TODO Do I really want a search start?
-  //  printf("Starting search at: ");
-  //  cnVectorPrint(stdout, valueCount, searchStart);
-  //  printf("\n");
-  // Narrow the distance to each bag.
-  for (distance = distances; distance < distancesEnd; distance++) {
-    PointBag* pointBag = distance->bag;
-    Float* point = pointBag->pointMatrix.points;
-    Float* pointsEnd = point + pointBag->pointMatrix.pointCount * valueCount;
-    if (!distance->near) continue; // Done with this one.
-    // Look at each point in the bag.
-    for (; point < pointsEnd; point += valueCount) {
-      // Find the distance and compare.
-      Float currentDistance;
-      distanceFunction->evaluate(point, &currentDistance);
-      if (currentDistance > distance->far) {
-        // New max found.
-        // If currentDistance were NaN, the above > should fail, so we don't
-        // expect to see any NaNs here.
-        distance->far = currentDistance;
-      }
-      if (currentDistance < distance->near) {
-        // New min found.
-        // If currentDistance were NaN, the above < should fail, so we don't
-        // expect to see any NaNs here.
-        distance->near = currentDistance;
-        // Remember the near point for later, for when we want that.
-        distance->nearPoint = point;
+  if (!cache) cache = &localCache;
+
+  // Scan in single precision if the points have it.
+  if (
+    center && valueCount &&
+    ((PointBag*)pointBags->items)->pointMatrix.singlePoints
+  ) {
+    singleCenter = cnStackAllocOf(float, valueCount);
+    for (Index i = 0; i < valueCount; i++) {
+      singleCenter[i] = static_cast<float>(center[i]);
+      centerScale = max(centerScale, fabs(center[i]));
+    }
+  }
+
+  // See if we can update from the last center.
+  update =
+    center && cache->center.count == valueCount &&
+    cache->distances.count == pointBags->count;
+  if (update) {
+    Count rescanCount = 0;
+    delta = cnEuclideanDistance(valueCount, &cache->center.first(), center);
+    cnListEachBegin(&cache->distances, BagDistance, distance) {
+      rescanCount += cnChooseThreshold_updateBag(
+        distance, distanceFunction, singleCenter, centerScale, delta
+      );
+    } cnEnd;
+    // Rescanned bags can move anywhere, so with too many, the old edge order
+    // isn't worth repairing.
+    repair = 4 * rescanCount < pointBags->count;
+  } else {
+    // Start over, including when there's no center to track.
+    BagDistance* distance;
+    cnListClear(&cache->center);
+    cnListClear(&cache->distances);
+    if (pointBags->count) {
+      if (!cnListExpandMulti(&cache->distances, pointBags->count)) {
+        cnErrTo(DONE, "No distances.");
       }
     }
+    distance = (BagDistance*)cache->distances.items;
+    cnListEachBegin(pointBags, PointBag, pointBag) {
+      distance->bag = pointBag;
+      if (singleCenter) {
+        cnChooseThreshold_scanBagSingle(
+          distance, distanceFunction, singleCenter, centerScale
+        );
+      } else {
+        cnChooseThreshold_scanBag(distance, distanceFunction);
+      }
+      distance++;
+    } cnEnd;
   }
 
-  // Flip any unset fars also to infinity.
-  for (distance = distances; distance < distancesEnd; distance++) {
-    if (distance->far < 0) {
-      distance->far = HUGE_VAL;
+  // Remember the center for next time.
+  if (center && !cache->center.count && valueCount) {
+    if (!cnListExpandMulti(&cache->center, valueCount)) {
+      cnErrTo(DONE, "No center.");
     }
   }
+  if (cache->center.count) {
+    memcpy(&cache->center.first(), center, valueCount * sizeof(Float));
+  }
+
+  // Sort the edges, repairing if we can.
+  if (!(repair && cnChooseThreshold_repairEdges(cache))) {
+    if (!cnChooseThreshold_rebuildEdges(cache)) cnErrTo(DONE, "No edges.");
+  }
 
   // Find the right threshold for these distances and bag labels.
   *threshold = cnChooseThresholdWithDistances(
-    yesLabel, distances, distancesEnd, score, nearPosPoints, nearNegPoints
+    yesLabel, cache->edges, cache->edges + cache->edgeCount, score,
+    nearPosPoints, nearNegPoints
   );
   result = true;
 
   DONE:
-  free(distances);
+  if (!result) {
+    // Make sure nothing partial gets reused.
+    cnListClear(&cache->center);
+    cnListClear(&cache->distances);
+  }
+  cnStackFree(singleCenter);
   return result;
 }
 
-
-/**
- * We need to track near and far distances in a nice sorted list. This lets us
- * do that.
- */
-typedef enum {
-  cnChooseThreshold_Both, cnChooseThreshold_Far, cnChooseThreshold_Near
-} cnChooseThreshold_Edge;
-
-typedef struct {
-  BagDistance* distance;
-  cnChooseThreshold_Edge edge;
-} cnChooseThreshold_Distance;
-
-Float cnChooseThreshold_edgeDist(const cnChooseThreshold_Distance* dist) {
-  // The distances themselves. For both, we can use either.
-  return dist->edge == cnChooseThreshold_Near ?
-    dist->distance->near : dist->distance->far;
-}
-
-int cnChooseThreshold_compare(const void* a, const void* b) {
-  Float distA = cnChooseThreshold_edgeDist(
-    reinterpret_cast<const cnChooseThreshold_Distance*>(a)
-  );
-  Float distB = cnChooseThreshold_edgeDist(
-    reinterpret_cast<const cnChooseThreshold_Distance*>(b)
-  );
-  return distA > distB ? 1 : distA == distB ? 0 : -1;
-}
-
 Float cnChooseThresholdWithDistances(
   bool yesLabel,
-  BagDistance* distances, BagDistance* distancesEnd, Float* score,
-  List<Float>* nearPosPoints, List<Float>* nearNegPoints
+  cnChooseThreshold_Distance* dists, cnChooseThreshold_Distance* distsEnd,
+  Float* score, List<Float>* nearPosPoints, List<Float>* nearNegPoints
 ) {
   //  FILE* file = fopen("cnChooseThreshold.log", "w");
-  // TODO Just allow sorting the original data instead of malloc here?
-  Count bagCount = distancesEnd - distances;
-  BagDistance* distance;
-  cnChooseThreshold_Distance* dists =
-    cnAlloc(cnChooseThreshold_Distance, 2 * bagCount);
   cnChooseThreshold_Distance* dist;
-  cnChooseThreshold_Distance* distsEnd = dists + 2 * bagCount;
+  Count bagCount = 0; // Count of bags without errors.
   Count negBothCount = 0; // Negatives on both sides of the threshold.
   Count negNoCount = 0; // Negatives fully outside.
   Count negTotalCount = 0; // Total count of negatives.
@@ -737,52 +1216,13 @@ Float cnChooseThresholdWithDistances(
   bestScore = -HUGE_VAL;//score ? *score : -HUGE_VAL;
   //if (score) *score = bestScore;
 
-  if (!dists) {
-    // No good.
-    printf("Failed to allocate dists.\n");
-    return cnNaN();
-  }
-
-  // Init the pointer array.
-  dist = dists;
-  for (distance = distances; distance < distancesEnd; distance++) {
-    if (distance->near < HUGE_VAL) {
-      // It's not an error case, so include it.
-      if (distance->bag->bag->label) {
-        // Count the positives.
-        posTotalCount++;
-      }
-      // Reference the distance, and move on.
-      dist->distance = distance;
-      if (distance->near == distance->far) {
-        dist->edge = cnChooseThreshold_Both;
-        // In these cases, we don't store both sides. Just a single "Both".
-        // Technically, we could, but complication just shifts. In this case,
-        // it would move to the compare function that would need to make sure
-        // to sort nears before fars.
-        distsEnd--;
-      } else {
-        // Put in the near side.
-        dist->edge = cnChooseThreshold_Near;
-        // And the far.
-        dist++;
-        dist->distance = distance;
-        dist->edge = cnChooseThreshold_Far;
-      }
-      // Move on.
-      dist++;
-    } else {
-      // Error case. Leave out both near and far ends.
-      // We might have allocated more space than needed for dists, but it's not
-      // likely a huge gap, unless we have lots of dummy bindings.
-      // TODO Is err probability relevant to the grand metric here? Here, it's
-      // TODO just about bags with only err so far. We've ignored the case where
-      // TODO only some bindings are err. They could impact, but just let those
-      // TODO be considered as foreign leaves at some point, not kids. A big
-      // TODO loop could prune those bags in later rounds if the err leaf picks
-      // TODO them up.
-      distsEnd -= 2;
-      bagCount--;
+  // Count the bags, each of which has one near or both edge.
+  for (dist = dists; dist < distsEnd; dist++) {
+    if (dist->edge == cnChooseThreshold_Far) continue;
+    bagCount++;
+    if (dist->distance->bag->bag->label) {
+      // Count the positives.
+      posTotalCount++;
     }
   }
   // Update the count now to the ones we care about.
@@ -792,12 +1232,6 @@ Float cnChooseThresholdWithDistances(
   negNoCount = negTotalCount;
   //printf("Totals: %ld %ld (%d %ld)\n", posTotalCount, negTotalCount, distsEnd - dists, bagCount);
 
-  // Sort it.
-  qsort(
-    dists, distsEnd - dists,
-    sizeof(cnChooseThreshold_Distance), cnChooseThreshold_compare
-  );
-
   // Now go through the list, calculating effective probabilities and the
   // decision metric to find the optimal threshold.
   for (dist = dists; dist < distsEnd; dist++) {
@@ -899,7 +1333,7 @@ Float cnChooseThresholdWithDistances(
     }
   }
   if (false && !cnIsNaN(bestYesProb)) {
-    printf(
+    cnLogf(splitLog,
       "Best thresh: %.9lg (%.2lg of %ld, %.2lg of %ld: %.4lg)\n",
       threshold, bestYesProb, bestYesCount, bestNoProb, bestNoCount,
       bestScore
@@ -926,14 +1360,18 @@ Float cnChooseThresholdWithDistances(
           // Condensing these to an independent matrix. Costly? Probably not
           // just for those in the threshold? Or in ugly cases, could it get
           // bad?
-          cnListPush(nearPoints, dist->distance->nearPoint);
+          cnListPush(
+            nearPoints,
+            dist->distance->bag->pointMatrix.validPoint(
+              dist->distance->nearIndex
+            )
+          );
         }
       }
     }
   }
 
-  // Free the pointer array, provide the score if wanted, and return the thresh.
-  free(dists);
+  // Provide the score if wanted, and return the thresh.
   if (score) *score = bestScore;
   //  fclose(file);
   return threshold;
@@ -946,8 +1384,11 @@ RootNode* cnExpandedTree(LearnerConfig* config, Expansion* expansion) {
   LeafNode* leaf;
   SplitNode* split;
   RootNode* root = NULL;
+  TraceSpan span("cnExpandedTree");
+  ProfileTimer timer(Profile::Expand);
   Count varsAdded;
-  printf("Expanding on "); cnPrintExpansion(expansion);
+  cnPrintExpansion(expansion);
+  cnProfileCount(Profile::ExpansionsTried);
 
   // Init for safety.
   List<LeafBindingBagGroup> leafBindingBagGroups;
@@ -1059,13 +1500,40 @@ bool cnExpansionRedundant(
 }
 
 
+string cnExpansionString(Expansion* expansion) {
+  Index i;
+  stringstream buf;
+  buf << expansion->function->name << "(";
+  for (i = 0; i < expansion->function->inCount; i++) {
+    if (i > 0) {
+      buf << ", ";
+    }
+    buf << expansion->varIndices[i];
+  }
+  buf <<
+    ") at node " << expansion->leaf->node.id <<
+    " with " << expansion->newVarCount << " new vars";
+  return buf.str();
+}
+
+
 Learner::Learner(Random $random):
   bags(0), entityFunctions(0), initialTree(0),
   random($random), randomOwned(false)
 {
+  const char* beam = getenv("CONCUNO_BEAM");
+  const char* rounds = getenv("CONCUNO_PROFILE_ROUNDS");
+  const char* seed = getenv("CONCUNO_SEED");
+  const char* single = getenv("CONCUNO_SINGLE");
+  beamWidth = beam && atol(beam) > 1 ? atol(beam) : 1;
+  profileName = getenv("CONCUNO_PROFILE");
+  profileRounds = rounds && atol(rounds) > 0;
+  singlePrecision = single && atol(single) > 0;
+  traceName = getenv("CONCUNO_TRACE");
+
   // Prepare a random, if requested (via NULL).
   if (!random) {
-    if (!(random = cnRandomCreate())) {
+    if (!(random = cnRandomCreate(seed ? strtoul(seed, NULL, 10) : 0))) {
       throw Error("No default random.");
     }
     randomOwned = true;
@@ -1090,68 +1558,252 @@ bool cnLearnSplitModel(
   Float threshold = 0.0;
   bool result = false;
   List<PointBag> pointBags;
+  PointPool pool;
+
+  // Get point bags.
+  if (!cnSplitNodePointBags(split, bindingBags, &pointBags, &pool)) {
+    goto DONE;
+  }
+  //cnLogPointBags(split, &pointBags);
+  if (learner->singlePrecision) {
+    cnListEachBegin(&pointBags, PointBag, pointBag) {
+      if (!cnPointMatrixMakeSingle(&pointBag->pointMatrix)) {
+        cnErrTo(DONE, "No single points.");
+      }
+    } cnEnd;
+  }
+
+  // Prepare a Gaussian for fitting to the data and a Mahalanobis distance
+  // function based on that.
+  //
+  // TODO Abstract this more for support of other topologies and constraints.
+  // TODO The discrete categories case will be especially different! No center!
+  gaussian = cnAlloc(Gaussian, 1);
+  if (!gaussian) {
+    goto DONE;
+  }
+  if (!cnGaussianInit(gaussian, outCount, NULL)) {
+    free(gaussian);
+    goto DONE;
+  }
+  try {
+    distanceFunction = new MahalanobisDistanceFunction(gaussian);
+  } catch (const exception& e) {
+    // The Gaussian can't be automatically cleaned if its container is defunct.
+    cnGaussianDispose(gaussian);
+    free(gaussian);
+    throw;
+  }
+
+  // We got points and a distance function. Try to learn something.
+  // cnBuildInitialKernel(split->function->outTopology, &pointBags);
+  // searchStart =
+  //   cnBestPointByDiverseDensity(split->function->outTopology, &pointBags);
+  if (!cnBestPointByScore(
+    distanceFunction, gaussian, &pointBags, &bestFunction, &threshold
+  )) cnErrTo(DONE, "Best point failure.");
+  if (bestFunction) {
+    // Replace the initial with the best found.
+    delete distanceFunction;
+    distanceFunction = bestFunction;
+  } else {
+    // Nothing was any good. Any mean and threshold is arbitrary, so just let
+    // them be 0. Mean was already defaulted to zero.
+    threshold = 0.0;
+  }
+
+  // We have an answer. Record it.
+  try {
+    split->predicate =
+      new DistanceThresholdPredicate(distanceFunction, threshold);
+  } catch (const exception& e) {
+    delete distanceFunction;
+    throw;
+  }
+  // Good to go. Skip to the "do always" cleanup.
+  result = true;
+
+  DONE:
+  cnListEachBegin(&pointBags, PointBag, pointBag) {
+    cnPointBagDispose(pointBag);
+  } cnEnd;
+  cnStackFree(center);
+  return result;
+}
+
+
+/**
+ * Takes over the tree, with a new random split from the given one by key.
+ */
+BeamOption* cnLearnTreeByBeam_option(
+  LearnerConfig* config, RootNode* tree, Count depth,
+  Random random, unsigned long key
+) {
+  BeamOption* option = cnAlloc(BeamOption, 1);
+  if (!option) return NULL;
+  if (!(option->random = cnRandomSplit(random, key))) {
+    free(option);
+    return NULL;
+  }
+  option->depth = depth;
+  option->score = cnTreeLogMetric(tree, &config->validationBags);
+  option->tree = tree;
+  return option;
+}
+
+bool cnLearnTreeByBeam_better(
+  cnSearcher* searcher, cnSearchOption a, cnSearchOption b
+) {
+  return
+    reinterpret_cast<BeamOption*>(a)->score >
+    reinterpret_cast<BeamOption*>(b)->score;
+}
+
+void cnLearnTreeByBeam_destroyOption(
+  cnSearcher* searcher, cnSearchOption option
+) {
+  BeamOption* beamOption = reinterpret_cast<BeamOption*>(option);
+  if (!beamOption) return;
+  // The best option's tree might already have gone to the caller.
+  if (beamOption->tree) cnNodeDrop(&beamOption->tree->node);
+  cnRandomDestroy(beamOption->random);
+  free(beamOption);
+}
+
+bool cnLearnTreeByBeam_step(
+  cnSearcher* searcher, cnSearchOption option, List<cnSearchOption>* nexts
+) {
+  BeamOption* beamOption = reinterpret_cast<BeamOption*>(option);
+  LearnerConfig config;
+  List<Expansion> expansions;
+  List<LeafBindingBagGroup> groups;
+  bool result = false;
+  LearnerConfig* shared = reinterpret_cast<LearnerConfig*>(searcher->info);
+  TraceSpan span("beam step");
+  if (span.on()) {
+    stringstream detail;
+    detail << "depth " << beamOption->depth;
+    span.detail(detail.str());
+  }
+
+  // Compare against this option's tree, with its own random, since other
+  // steps can run at the same time.
+  config.learner = shared->learner;
+  config.previous = beamOption->tree;
+  config.trainingBags.items = shared->trainingBags.items;
+  config.trainingBags.count = shared->trainingBags.count;
+  config.validationBags.items = shared->validationBags.items;
+  config.validationBags.count = shared->validationBags.count;
+  config.random = beamOption->random;
+
+  // Gather expansions across all leaves that any training bags reach, since
+  // there's nothing to learn a split from elsewhere.
+  cnTreePropagateBags(beamOption->tree, &config.trainingBags, &groups);
+  cnListEachBegin(&groups, LeafBindingBagGroup, group) {
+    if (!group->bindingBags.count) continue;
+    if (!cnPushExpansionsAtLeaf(&config, group->leaf, &expansions)) {
+      cnErrTo(DONE, "No expansions.");
+    }
+  } cnEnd;
+  cnLogf(learnLog,
+    "Need to try %ld expansions at depth %ld.\n\n",
+    expansions.count, beamOption->depth
+  );
+
+  // Keep each expanded tree that significantly improves on this one, and let
+  // the searcher sort out which of them make the beam.
+  cnListEachBegin(&expansions, Expansion, expansion) {
+    BeamOption* next;
+    Float pValue;
+    RootNode* expanded;
+    // Tag expanding and verifying alike.
+    TraceSpan span("expansion");
+    if (span.on()) span.detail(cnExpansionString(expansion));
+
+    if (!(expanded = cnExpandedTree(&config, expansion))) {
+      cnErrTo(DONE, "Expanding failed.");
+    }
+    if (!cnVerifyImprovement(&config, expanded, &pValue)) {
+      cnNodeDrop(&expanded->node);
+      cnErrTo(DONE, "Failed propagate or p-value.");
+    }
+    cnLogf(learnLog, "Expanded tree has p-value: %lg\n", pValue);
+    // TODO Multiple comparisons problem here, too!
+    if (pValue >= 0.1) {
+      cnProfileCount(Profile::ExpansionsPruned);
+      cnNodeDrop(&expanded->node);
+      continue;
+    }
+    if (!(next = cnLearnTreeByBeam_option(
+      &config, expanded, beamOption->depth + 1, beamOption->random,
+      expansion - (Expansion*)expansions.items
+    ))) {
+      cnNodeDrop(&expanded->node);
+      cnErrTo(DONE, "No option.");
+    }
+    if (!cnListPush(nexts, &next)) {
+      cnLearnTreeByBeam_destroyOption(searcher, next);
+      cnErrTo(DONE, "No push.");
+    }
+  } cnEnd;
+  result = true;
 
-  // Get point bags.
-  if (!cnSplitNodePointBags(split, bindingBags, &pointBags)) {
-    goto DONE;
-  }
-  //cnLogPointBags(split, &pointBags);
+  DONE:
+  cnListEachBegin(&expansions, Expansion, expansion) {
+    free(expansion->varIndices);
+  } cnEnd;
+  cnLeafBindingBagGroupListDispose(&groups);
+  return result;
+}
 
-  // Prepare a Gaussian for fitting to the data and a Mahalanobis distance
-  // function based on that.
-  //
-  // TODO Abstract this more for support of other topologies and constraints.
-  // TODO The discrete categories case will be especially different! No center!
-  gaussian = cnAlloc(Gaussian, 1);
-  if (!gaussian) {
-    goto DONE;
+RootNode* cnLearnTreeByBeam(LearnerConfig* config, RootNode* initialTree) {
+  BeamOption* best;
+  BeamOption* initial = NULL;
+  RootNode* initialCopy;
+  RootNode* result = NULL;
+  cnSearcher* searcher = cnSearcherCreate();
+  TraceSpan span("beam search");
+
+  if (!searcher) cnErrTo(DONE, "No searcher.");
+  searcher->better = cnLearnTreeByBeam_better;
+  searcher->capacity = config->learner->beamWidth;
+  searcher->destroyOption = cnLearnTreeByBeam_destroyOption;
+  searcher->info = config;
+  searcher->step = cnLearnTreeByBeam_step;
+  searcher->workerCount = config->learner->beamWidth;
+
+  // The searcher owns its trees, so start from a copy.
+  if (!(initialCopy = (RootNode*)cnTreeCopy(&initialTree->node))) {
+    cnErrTo(DONE, "No initial copy.");
   }
-  if (!cnGaussianInit(gaussian, outCount, NULL)) {
-    free(gaussian);
-    goto DONE;
+  if (!(initial = cnLearnTreeByBeam_option(
+    config, initialCopy, 0, config->random, 0
+  ))) {
+    cnNodeDrop(&initialCopy->node);
+    cnErrTo(DONE, "No initial option.");
   }
-  try {
-    distanceFunction = new MahalanobisDistanceFunction(gaussian);
-  } catch (const exception& e) {
-    // The Gaussian can't be automatically cleaned if its container is defunct.
-    cnGaussianDispose(gaussian);
-    free(gaussian);
-    throw;
+  if (!cnListPush(&searcher->initialOptions, &initial)) {
+    cnLearnTreeByBeam_destroyOption(searcher, initial);
+    cnErrTo(DONE, "No initial push.");
   }
 
-  // We got points and a distance function. Try to learn something.
-  // cnBuildInitialKernel(split->function->outTopology, &pointBags);
-  // searchStart =
-  //   cnBestPointByDiverseDensity(split->function->outTopology, &pointBags);
-  if (!cnBestPointByScore(
-    distanceFunction, gaussian, &pointBags, &bestFunction, &threshold
-  )) cnErrTo(DONE, "Best point failure.");
-  if (bestFunction) {
-    // Replace the initial with the best found.
-    delete distanceFunction;
-    distanceFunction = bestFunction;
-  } else {
-    // Nothing was any good. Any mean and threshold is arbitrary, so just let
-    // them be 0. Mean was already defaulted to zero.
-    threshold = 0.0;
+  // Search, and take the best tree unless it's the one we started with. Like
+  // greedy search, keep the best so far even if some later step failed.
+  cnLogf(learnLog, "Beam search with width %ld.\n", searcher->capacity);
+  if (!cnSearch(searcher)) {
+    cnLogf(learnLog, "Search failed. Using the best so far.\n");
   }
-
-  // We have an answer. Record it.
-  try {
-    split->predicate =
-      new DistanceThresholdPredicate(distanceFunction, threshold);
-  } catch (const exception& e) {
-    delete distanceFunction;
-    throw;
+  best = reinterpret_cast<BeamOption*>(searcher->bestOption);
+  if (best && best->depth) {
+    cnLogf(learnLog,
+      "Best tree at depth %ld with metric %lg.\n", best->depth, best->score
+    );
+    result = best->tree;
+    best->tree = NULL;
   }
-  // Good to go. Skip to the "do always" cleanup.
-  result = true;
 
   DONE:
-  cnListEachBegin(&pointBags, PointBag, pointBag) {
-    cnPointBagDispose(pointBag);
-  } cnEnd;
-  cnStackFree(center);
+  cnSearcherDestroy(searcher);
   return result;
 }
 
@@ -1164,6 +1816,11 @@ RootNode* Learner::learnTree() {
 
   // Start preparing the learning configuration.
   config.learner = this;
+  config.random = random;
+
+  // Each greedy round gets its own breakdown. Beam search is just one.
+  if (profileName) cnProfileStart();
+  if (traceName) cnTraceStart();
 
   // Create a stub tree, if needed.
   initialTree = this->initialTree;
@@ -1194,13 +1851,20 @@ RootNode* Learner::learnTree() {
     cnErrTo(DONE, "Failed to update leaf probabilities.");
   }
 
+  // Beam search has its own loop.
+  if (beamWidth > 1) {
+    result = cnLearnTreeByBeam(&config, initialTree);
+    goto DONE;
+  }
+
   config.previous = initialTree;
   while (true) {
     RootNode* expanded;
+    TraceSpan span("learnTree round");
     // Print training score to observe conveniently the training progress.
     // TODO Could retain counts from the previous propagation to save the repeat
     // TODO here.
-    printf(
+    cnLogf(learnLog,
       "Initial metric: %lg\n",
       cnTreeLogMetric(config.previous, &config.trainingBags)
     );
@@ -1223,20 +1887,35 @@ RootNode* Learner::learnTree() {
       break;
     }
 
-    printf(
+    cnLogf(learnLog,
       "**********************************************************************\n"
       "**********************************************************************\n"
       "\n"
     );
-    printf("Taking on another round!\n");
+    cnLogf(learnLog, "Taking on another round!\n");
     config.previous = result;
+    if (profileName) {
+      cnProfileRound();
+      if (profileRounds) cnProfileWrite(profileName);
+    }
   }
   // TODO If no most recent tree, return null or a clone as indicated in my
   // TODO other comments?
-  printf("All done!!\n");
+  cnLogf(learnLog, "All done!!\n");
 
   DONE:
   if (!this->initialTree) cnNodeDrop(&initialTree->node);
+  if (profileName) {
+    cnProfileRound();
+    cnProfileWrite(profileName);
+    cnProfileStop();
+  }
+  if (traceName) {
+    cnTraceWrite(traceName);
+    cnTraceStop();
+  }
+  // Callers might write straight to stdout next.
+  logFlush();
   // Don't actually dispose of training and validation lists, since they are
   // bogus anyway.
   return result;
@@ -1274,6 +1953,7 @@ LeafNode* cnPickBestLeaf(RootNode* tree, List<Bag>* bags) {
   List<List<Index> > maxGroups;
   LeafBindingBagGroup* noGroup;
   LeafNode** realLeaves = NULL;
+  TraceSpan span("cnPickBestLeaf");
 
   // Get all bindings, leaves.
   // TODO We don't actually care about the bindings themselves, but we had to
@@ -1356,23 +2036,23 @@ LeafNode* cnPickBestLeaf(RootNode* tree, List<Bag>* bags) {
         cnListRemove(&group->bindingBags, b);
       }
     }
-    printf("Max positives kept: %ld\n", group->bindingBags.count);
-    printf("Others moved out: %ld\n", noGroup->bindingBags.count);
+    cnLogf(splitLog, "Max positives kept: %ld\n", group->bindingBags.count);
+    cnLogf(splitLog, "Others moved out: %ld\n", noGroup->bindingBags.count);
 
     // Update leaf probabilities, and find the score.
     if (
       !cnUpdateLeafProbabilitiesWithBindingBags(groups, &counts)
     ) cnErrTo(DONE, "No fake leaf probs.");
     score = cnCountsLogMetric(&counts);
-    printf(
-      "Score at %ld: %lg", static_cast<Index>(group - &groups.first()), score
-    );
     if (score > bestScore) {
       bestGroup = group;
       bestScore = score;
-      printf(" (best yet)");
     }
-    printf("\n");
+    cnLogf(splitLog,
+      "Score at %ld: %lg%s\n",
+      static_cast<Index>(group - &groups.first()), score,
+      bestGroup == group ? " (best yet)" : ""
+    );
 
     // Then put them all back. Space is guaranteed again.
     bindingBag = reinterpret_cast<BindingBag*>(noGroup->bindingBags.items);
@@ -1407,18 +2087,89 @@ LeafNode* cnPickBestLeaf(RootNode* tree, List<Bag>* bags) {
 
 
 void cnPrintExpansion(Expansion* expansion) {
-  Index i;
-  printf("%s(", expansion->function->name.c_str());
-  for (i = 0; i < expansion->function->inCount; i++) {
-    if (i > 0) {
-      printf(", ");
+  if (!learnLog.on()) return;
+  // Build the whole line first, so other threads can't split it.
+  learnLog.print(
+    "Expanding on %s.\n", cnExpansionString(expansion).c_str()
+  );
+}
+
+
+bool cnPushExpansionsAtLeaf(
+  LearnerConfig* config, LeafNode* leaf, List<Expansion>* expansions
+) {
+  vector<EntityFunction*>& entityFunctions = *config->learner->entityFunctions;
+  Count maxArity = 0;
+  Count minArity = LONG_MAX;
+  Count minNewVarCount;
+  Count newVarCount;
+  Count varDepth = cnNodeVarDepth(&leaf->node);
+
+  // Find the min and max arity.
+  for (size_t f = 0; f < entityFunctions.size(); f++) {
+    EntityFunction& function = *entityFunctions[f];
+    if (function.inCount < minArity) {
+      minArity = function.inCount;
+    }
+    if (function.inCount > maxArity) {
+      maxArity = function.inCount;
     }
-    printf("%ld", expansion->varIndices[i]);
   }
-  printf(
-    ") at node %ld with %ld new vars.\n",
-    expansion->leaf->node.id, expansion->newVarCount
-  );
+  if (minArity > maxArity) {
+    // Should cover cases with no functions, at least.
+    // TODO Just assert at least one function to start with?
+    minArity = maxArity;
+  }
+  // We need at least enough new variables to cover the min arity.
+  minNewVarCount = minArity - varDepth;
+  if (minNewVarCount < 0) {
+    // Already have more than we need.
+    minNewVarCount = 0;
+  }
+
+  // Start added vars from low to high. Allow up to as many new vars as we have
+  // arity for functions.
+  varDepth += minNewVarCount;
+  for (
+    newVarCount = minNewVarCount;
+    newVarCount <= maxArity;
+    newVarCount++, varDepth++
+  ) {
+    Expansion expansion;
+
+    for (size_t f = 0; f < entityFunctions.size(); f++) {
+      EntityFunction& function = *entityFunctions[f];
+      if (function.inCount > varDepth) {
+        //printf(
+        //  "Need %ld more vars for %s.\n",
+        //  function->inCount - varDepth, cnStr(&function->name)
+        //);
+        continue;
+      }
+      if (function.inCount < newVarCount) {
+        // We've already added more vars than we need for this one.
+        //printf(
+        //  "Added %ld too many vars for %s.\n",
+        //  newVarCount - function->inCount, cnStr(&function->name)
+        //);
+        continue;
+      }
+      // Init a prototype expansion, then push index permutations.
+      expansion.function = &function;
+      expansion.leaf = leaf;
+      expansion.newVarCount = newVarCount;
+      expansion.varIndices = NULL;
+      if (!cnPushExpansionsByIndices(expansions, &expansion, varDepth)) {
+        return false;
+      }
+    }
+
+    // TODO Error check expansions with just two leaves? Or always an error
+    // TODO branch on var nodes? Is it better or worse to ask extra questions
+    // TODO along the way?
+  }
+
+  return true;
 }
 
 
@@ -1499,86 +2250,23 @@ bool cnPushExpansionsByIndices(
 RootNode* cnTryExpansionsAtLeaf(LearnerConfig* config, LeafNode* leaf) {
   Float bestPValue = 1;
   RootNode* bestTree = NULL;
-  vector<EntityFunction*>& entityFunctions = *config->learner->entityFunctions;
   // Make a list of expansions. They can then be sorted, etc.
   List<Expansion> expansions;
-  Count maxArity = 0;
-  Count minArity = LONG_MAX;
-  Count minNewVarCount;
-  Count newVarCount;
-  Count varDepth = cnNodeVarDepth(&leaf->node);
-
-  // Find the min and max arity.
-  for (size_t f = 0; f < entityFunctions.size(); f++) {
-    EntityFunction& function = *entityFunctions[f];
-    if (function.inCount < minArity) {
-      minArity = function.inCount;
-    }
-    if (function.inCount > maxArity) {
-      maxArity = function.inCount;
-    }
-  }
-  if (minArity > maxArity) {
-    // Should cover cases with no functions, at least.
-    // TODO Just assert at least one function to start with?
-    minArity = maxArity;
-  }
-  // We need at least enough new variables to cover the min arity.
-  minNewVarCount = minArity - varDepth;
-  if (minNewVarCount < 0) {
-    // Already have more than we need.
-    minNewVarCount = 0;
-  }
-
-  // Start added vars from low to high. Allow up to as many new vars as we have
-  // arity for functions.
-  varDepth += minNewVarCount;
-  for (
-    newVarCount = minNewVarCount;
-    newVarCount <= maxArity;
-    newVarCount++, varDepth++
-  ) {
-    Expansion expansion;
-
-    for (size_t f = 0; f < entityFunctions.size(); f++) {
-      EntityFunction& function = *entityFunctions[f];
-      if (function.inCount > varDepth) {
-        //printf(
-        //  "Need %ld more vars for %s.\n",
-        //  function->inCount - varDepth, cnStr(&function->name)
-        //);
-        continue;
-      }
-      if (function.inCount < newVarCount) {
-        // We've already added more vars than we need for this one.
-        //printf(
-        //  "Added %ld too many vars for %s.\n",
-        //  newVarCount - function->inCount, cnStr(&function->name)
-        //);
-        continue;
-      }
-      // Init a prototype expansion, then push index permutations.
-      expansion.function = &function;
-      expansion.leaf = leaf;
-      expansion.newVarCount = newVarCount;
-      expansion.varIndices = NULL;
-      if (!cnPushExpansionsByIndices(&expansions, &expansion, varDepth)) {
-        printf("Failed to push expansions.\n");
-        goto DONE;
-      }
-    }
 
-    // TODO Error check expansions with just two leaves? Or always an error
-    // TODO branch on var nodes? Is it better or worse to ask extra questions
-    // TODO along the way?
+  if (!cnPushExpansionsAtLeaf(config, leaf, &expansions)) {
+    logError("Failed to push expansions.\n");
+    goto DONE;
   }
 
   // TODO Sort by arity? Or assume priority given by order? Some kind of
   // TODO heuristic?
-  printf("Need to try %ld expansions.\n\n", expansions.count);
+  cnLogf(learnLog, "Need to try %ld expansions.\n\n", expansions.count);
   cnListEachBegin(&expansions, Expansion, expansion) {
     Float pValue;
     RootNode* expanded;
+    // Tag expanding and verifying alike.
+    TraceSpan span("expansion");
+    if (span.on()) span.detail(cnExpansionString(expansion));
 
     // Learn a tree.
     // TODO Disinguish bad errors from no good expansion?
@@ -1594,12 +2282,13 @@ RootNode* cnTryExpansionsAtLeaf(LearnerConfig* config, LeafNode* leaf) {
       cnNodeDrop(&expanded->node);
       cnErrTo(FAIL, "Failed propagate or p-value.");
     }
-    printf("Expanded tree has p-value: %lg\n", pValue);
+    cnLogf(learnLog, "Expanded tree has p-value: %lg\n", pValue);
+    if (pValue >= 0.1) cnProfileCount(Profile::ExpansionsPruned);
     if (pValue < bestPValue) {
       // New best!
-      printf(">>>-------->\n");
-      printf(">>>--------> Best tree of this group!\n");
-      printf(">>>-------->\n");
+      cnLogf(learnLog,
+        ">>>-------->\n>>>--------> Best tree of this group!\n>>>-------->\n"
+      );
       // Out with the old, and in with the new.
       cnNodeDrop(&bestTree->node);
       bestPValue = pValue;
@@ -1612,7 +2301,7 @@ RootNode* cnTryExpansionsAtLeaf(LearnerConfig* config, LeafNode* leaf) {
     }
 
     // Blank line in this loop keeps expansions separated and easier to read.
-    printf("\n");
+    cnLogf(learnLog, "\n");
   } cnEnd;
 
   // Significance test.
@@ -1742,7 +2431,7 @@ bool cnUpdateLeafProbabilitiesWithBindingBags(
         maxTotal = total;
       }
     } cnEnd;
-    printf(
+    cnLogf(leafLog,
       "Leaf %ld with prob: %lf of %.2lf (really %lf of %ld)\n",
       maxGroupIndex + 1, maxProb, maxGroup->leaf->strength,
       maxTotal ? maxPosCount / (Float)maxTotal : 0.5, maxTotal
@@ -1775,48 +2464,119 @@ bool cnUpdateLeafProbabilitiesWithBindingBags(
 
 
 typedef struct cnVerifyImprovement_Stats {
+  /**
+   * All bootstrap leaf count distributions, one row per repetition.
+   */
   Count* bootCounts;
   List<LeafCount> leafCounts;
+  /**
+   * Exact moments of the score under the multinomial.
+   */
+  Float mean;
   Multinomial multinomial;
+  /**
+   * Neg then pos for each leaf, as arrival probabilities for validation bags.
+   */
+  Float* probs;
+  Float variance;
 } cnVerifyImprovement_Stats;
 
+bool cnVerifyImprovement_Boot(
+  cnVerifyImprovement_Stats* stats, List<Bag>* bags, Random random,
+  Count bootCount
+) {
+  Count classCount = 2 * stats->leafCounts.count;
+  Count bootCountsSize = bootCount * classCount;
+
+  // Create the multinomial distribution.
+  if (!(
+    stats->multinomial =
+      cnMultinomialCreate(random, bags->count, classCount, stats->probs)
+  )) cnErrTo(FAIL, "No multinomial.");
+
+  // Generate all the leaf count distributions at once.
+  if (!(stats->bootCounts = cnAlloc(Count, bootCountsSize))) {
+    cnErrTo(FAIL, "No boot counts.");
+  }
+  cnMultinomialSampleMany(stats->multinomial, bootCount, stats->bootCounts);
+  cnProfileCount(Profile::BootDraws, bootCount);
+  return true;
+
+  FAIL:
+  return false;
+}
+
 Float cnVerifyImprovement_BootScore(
-  cnVerifyImprovement_Stats* stats, Count count
+  cnVerifyImprovement_Stats* stats, Index boot
 ) {
-  // Generate the leaf count distribution.
-  cnMultinomialSample(stats->multinomial, stats->bootCounts);
+  Count* bootCounts = stats->bootCounts + boot * 2 * stats->leafCounts.count;
 
   // Overwrite the original leaf counts.
   cnListEachBegin(&stats->leafCounts, LeafCount, count) {
     Index i = count - (LeafCount*)stats->leafCounts.items;
     // Neg first, then pos.
-    count->negCount = stats->bootCounts[2 * i];
-    count->posCount = stats->bootCounts[2 * i + 1];
+    count->negCount = bootCounts[2 * i];
+    count->posCount = bootCounts[2 * i + 1];
   } cnEnd;
 
   // And get the metric from there.
   return cnCountsLogMetric(&stats->leafCounts);
 }
 
+/**
+ * Below this many validation bags, the normal approximation isn't trusted.
+ */
+const Count cnVerifyImprovement_NormalMinBags = 100;
+
+/**
+ * Sets the p-value from the normal approximation to the score difference,
+ * returning false if the bootstrap should decide instead.
+ */
+bool cnVerifyImprovement_NormalPValue(
+  cnVerifyImprovement_Stats* candidate, cnVerifyImprovement_Stats* previous,
+  Count bagCount, Float* pValue
+) {
+  // Scores are independent, so variances add.
+  Float mean = candidate->mean - previous->mean;
+  Float deviation = sqrt(candidate->variance + previous->variance);
+
+  if (bagCount < cnVerifyImprovement_NormalMinBags) return false;
+  // Zero probs at reached leaves give infinite or undefined moments.
+  if (!(isfinite(mean) && isfinite(deviation))) return false;
+  if (!deviation) {
+    // Both scores are fixed, so the answer is certain.
+    *pValue = mean > 0 ? 0 : 1;
+    return true;
+  }
+
+  // The p-value is the chance the candidate fails to win.
+  *pValue = cnNormalCdf(-mean / deviation);
+
+  // The approximation is good but not exact, so let the bootstrap decide
+  // close calls around the 0.1 threshold used for expansion.
+  return !(*pValue > 0.05 && *pValue < 0.2);
+}
+
 void cnVerifyImprovement_StatsInit(cnVerifyImprovement_Stats* stats) {
   stats->bootCounts = NULL;
   stats->multinomial = NULL;
+  stats->probs = NULL;
 }
 
 void cnVerifyImprovement_StatsDispose(cnVerifyImprovement_Stats* stats) {
   free(stats->bootCounts);
   cnMultinomialDestroy(stats->multinomial);
+  free(stats->probs);
   // Clean out.
   cnVerifyImprovement_StatsInit(stats);
 }
 
 bool cnVerifyImprovement_StatsPrepare(
-  cnVerifyImprovement_Stats* stats, RootNode* tree, List<Bag>* bags,
-  Random random
+  cnVerifyImprovement_Stats* stats, RootNode* tree, List<Bag>* bags
 ) {
   Count classCount;
   Index i;
-  Float* probs = NULL;
+  Float* weights = NULL;
   bool result = false;
 
   // Gather up the original counts for each leaf.
@@ -1826,35 +2586,37 @@ bool cnVerifyImprovement_StatsPrepare(
 
   // Prepare place for stats.
   classCount = 2 * stats->leafCounts.count;
-  probs = cnStackAllocOf(Float, classCount);
-  stats->bootCounts = cnAlloc(Count, classCount);
-  if (!(probs && stats->bootCounts)) {
+  stats->probs = cnAlloc(Float, classCount);
+  weights = cnStackAllocOf(Float, classCount);
+  if (!(stats->probs && weights)) {
     cnErrTo(DONE, "No stats allocated.");
   }
 
-  // Calculate probabilities.
+  // Calculate probabilities, and the score weights for each class, matching
+  // cnCountsLogMetric.
   for (i = 0; i < stats->leafCounts.count; i++) {
     LeafCount& count = stats->leafCounts[i];
+    Float probability = count.leaf->probability;
     // Neg first, then pos.
     // TODO Apply the same beta prior as for updating probabilities? Otherwise,
     // TODO we might have inappropriate zeros (or even ones) in validation.
     // TODO Well, I guess it would be a Dirichlet prior, but it should be
     // TODO equivalent to the beta prior at the single leaf level.
-    probs[2 * i] = count.negCount / (Float)bags->count;
-    probs[2 * i + 1] = count.posCount / (Float)bags->count;
+    stats->probs[2 * i] = count.negCount / (Float)bags->count;
+    stats->probs[2 * i + 1] = count.posCount / (Float)bags->count;
+    weights[2 * i] = ::log(1 - probability);
+    weights[2 * i + 1] = ::log(probability);
   }
-
-  // Create the multinomial distribution.
-  if (!(
-    stats->multinomial =
-      cnMultinomialCreate(random, bags->count, classCount, probs)
-  )) cnErrTo(DONE, "No multinomial.")
+  cnMultinomialWeightedMoments(
+    bags->count, classCount, stats->probs, weights,
+    &stats->mean, &stats->variance
+  );
 
   // Winned.
   result = true;
 
   DONE:
-  cnStackFree(probs);
+  cnStackFree(weights);
   return result;
 }
 
@@ -1884,36 +2646,53 @@ bool cnVerifyImprovement(
 
   // TODO Gradually increase the boot repetition until we see convergence?
   Count bootRepeatCount = 10000;
+  ProfileTimer timer(Profile::Verify);
   Count candidateWinCounts = 0;
   cnVerifyImprovement_Stats candidateStats;
   Index i;
   bool okay = false;
   cnVerifyImprovement_Stats previousStats;
+  TraceSpan span("cnVerifyImprovement");
 
   // Inits.
   cnVerifyImprovement_StatsInit(&candidateStats);
   cnVerifyImprovement_StatsInit(&previousStats);
 
   // Prepare stats for candidate and previous.
-  printf("Candidate:\n");
+  cnLogf(verifyLog, "Candidate:\n");
   if (!cnVerifyImprovement_StatsPrepare(
-    &candidateStats, candidate, &config->validationBags, config->learner->random
+    &candidateStats, candidate, &config->validationBags
   )) cnErrTo(DONE, "No stats.");
-  printf("Previous:\n");
+  cnLogf(verifyLog, "Previous:\n");
   if (!cnVerifyImprovement_StatsPrepare(
-    &previousStats, config->previous, &config->validationBags,
-    config->learner->random
+    &previousStats, config->previous, &config->validationBags
   )) cnErrTo(DONE, "No stats.");
 
+  // The score is linear in the leaf counts, so its mean and variance under
+  // each multinomial are exact, and only the normal shape of their difference
+  // is approximate. That's good for large validation sets away from the
+  // threshold.
+  if (cnVerifyImprovement_NormalPValue(
+    &candidateStats, &previousStats, config->validationBags.count, pValue
+  )) {
+    cnProfileCount(Profile::NormalPValues);
+    okay = true;
+    goto DONE;
+  }
+
   // Run the bootstrap.
+  if (!(
+    cnVerifyImprovement_Boot(
+      &candidateStats, &config->validationBags, config->random, bootRepeatCount
+    ) &&
+    cnVerifyImprovement_Boot(
+      &previousStats, &config->validationBags, config->random, bootRepeatCount
+    )
+  )) cnErrTo(DONE, "No bootstrap.");
   for (i = 0; i < bootRepeatCount; i++) {
     // Bootstrap each.
-    Float candidateScore = cnVerifyImprovement_BootScore(
-      &candidateStats, config->validationBags.count
-    );
-    Float previousScore = cnVerifyImprovement_BootScore(
-      &previousStats, config->validationBags.count
-    );
+    Float candidateScore = cnVerifyImprovement_BootScore(&candidateStats, i);
+    Float previousScore = cnVerifyImprovement_BootScore(&previousStats, i);
     candidateWinCounts += candidateScore > previousScore;
   }
   *pValue = 1 - (candidateWinCounts / (Float)bootRepeatCount);
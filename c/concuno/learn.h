@@ -39,12 +39,49 @@ struct Learner {
    * TODO What's the easiest way to know if it learned something? Check the
    * TODO number leaves or information in the nodes?
    *
-   * TODO Fill a list of trees for beam search purposes?
+   * See beamWidth for beam search rather than greedy.
    */
   RootNode* learnTree();
 
   // TODO Learning options go here.
 
+  /**
+   * How many candidate trees to keep at once for beam search, where each round
+   * expands all of them in parallel, across all their leaves. Defaults to 1,
+   * meaning plain greedy expansion at the single best leaf, unless the
+   * CONCUNO_BEAM environment variable is set to a larger number.
+   */
+  Count beamWidth;
+
+  /**
+   * Where to write a JSON report of phase timers and hot-path counters at the
+   * end of learnTree, or null for no profiling. Defaults to the CONCUNO_PROFILE
+   * environment variable. See profile.h.
+   */
+  const char* profileName;
+
+  /**
+   * Whether to rewrite the profile report after each round of greedy learning,
+   * too, for watching long runs. Beam search counts as a single round. Defaults
+   * to false unless CONCUNO_PROFILE_ROUNDS is set to a positive number.
+   */
+  bool profileRounds;
+
+  /**
+   * Whether to keep single-precision copies of points for scanning distances,
+   * which halves memory traffic. Near ties get settled in full precision, so
+   * splits come out the same. Defaults to false unless the CONCUNO_SINGLE
+   * environment variable is set to a positive number.
+   */
+  bool singlePrecision;
+
+  /**
+   * Where to write Chrome trace-event JSON of spans from learnTree, for viewing
+   * in Perfetto, or null for no tracing. Defaults to the CONCUNO_TRACE
+   * environment variable. See profile.h.
+   */
+  const char* traceName;
+
   /**
    * The training data to be used for learning. It could be subdivided into
    * separate training and validation data, if needed, but that's managed
@@ -80,7 +117,9 @@ struct Learner {
   RootNode* initialTree;
 
   /**
-   * For maintaining random state.
+   * For maintaining random state. If created automatically, it's seeded from
+   * the CONCUNO_SEED environment variable, or else 0. Parallel work splits its
+   * own streams from this one.
    */
   Random random;
 
@@ -235,9 +235,35 @@ double rk_noncentral_f(rk_state *state, double dfnum, double dfden, double nonc)
     return t / (rk_chisquare(state, dfden) * dfnum);
 }
 
+static void rk_binomial_btpe_setup(rk_state *state, long n, double p)
+{
+    double r,q,fm,p1,xm,xl,xr,c,laml,lamr,p2,a;
+    long m;
+
+    state->nsave = n;
+    state->psave = p;
+    state->has_binomial = 1;
+    state->r = r = min(p, 1.0-p);
+    state->q = q = 1.0 - r;
+    state->fm = fm = n*r+r;
+    state->m = m = (long)floor(fm);
+    state->p1 = p1 = floor(2.195*sqrt(n*r*q)-4.6*q) + 0.5;
+    state->xm = xm = m + 0.5;
+    state->xl = xl = xm - p1;
+    state->xr = xr = xm + p1;
+    state->c = c = 0.134 + 20.5/(15.3 + m);
+    a = (fm - xl)/(fm-xl*r);
+    state->laml = laml = a*(1.0 + a/2.0);
+    a = (xr - fm)/(xr*q);
+    state->lamr = lamr = a*(1.0 + a/2.0);
+    state->p2 = p2 = p1*(1.0 + 2.0*c);
+    state->p3 = p2 + c/laml;
+    state->p4 = state->p3 + c/lamr;
+}
+
 long rk_binomial_btpe(rk_state *state, long n, double p)
 {
-    double r,q,fm,p1,xm,xl,xr,c,laml,lamr,p2,p3,p4;
+    double r,q,p1,xm,xl,xr,c,laml,lamr,p2,p3,p4;
     double a,u,v,s,F,rho,t,A,nrq,x1,x2,f1,f2,z,z2,w,w2,x;
     long m,y,k,i;
 
@@ -245,44 +271,21 @@ long rk_binomial_btpe(rk_state *state, long n, double p)
          (state->nsave != n) ||
          (state->psave != p))
     {
-        /* initialize */
-        state->nsave = n;
-        state->psave = p;
-        state->has_binomial = 1;
-        state->r = r = min(p, 1.0-p);
-        state->q = q = 1.0 - r;
-        state->fm = fm = n*r+r;
-        state->m = m = (long)floor(state->fm);
-        state->p1 = p1 = floor(2.195*sqrt(n*r*q)-4.6*q) + 0.5;
-        state->xm = xm = m + 0.5;
-        state->xl = xl = xm - p1;
-        state->xr = xr = xm + p1;
-        state->c = c = 0.134 + 20.5/(15.3 + m);
-        a = (fm - xl)/(fm-xl*r);
-        state->laml = laml = a*(1.0 + a/2.0);
-        a = (xr - fm)/(xr*q);
-        state->lamr = lamr = a*(1.0 + a/2.0);
-        state->p2 = p2 = p1*(1.0 + 2.0*c);
-        state->p3 = p3 = p2 + c/laml;
-        state->p4 = p4 = p3 + c/lamr;
-    }
-    else
-    {
-        r = state->r;
-        q = state->q;
-        fm = state->fm;
-        m = state->m;
-        p1 = state->p1;
-        xm = state->xm;
-        xl = state->xl;
-        xr = state->xr;
-        c = state->c;
-        laml = state->laml;
-        lamr = state->lamr;
-        p2 = state->p2;
-        p3 = state->p3;
-        p4 = state->p4;
-    }
+        rk_binomial_btpe_setup(state, n, p);
+    }
+    r = state->r;
+    q = state->q;
+    m = state->m;
+    p1 = state->p1;
+    xm = state->xm;
+    xl = state->xl;
+    xr = state->xr;
+    c = state->c;
+    laml = state->laml;
+    lamr = state->lamr;
+    p2 = state->p2;
+    p3 = state->p3;
+    p4 = state->p4;
 
   /* sigh ... */
   Step10:
@@ -375,29 +378,33 @@ long rk_binomial_btpe(rk_state *state, long n, double p)
     return y;
 }
 
+static void rk_binomial_inversion_setup(rk_state *state, long n, double p)
+{
+    double q, np;
+
+    state->nsave = n;
+    state->psave = p;
+    state->has_binomial = 1;
+    state->q = q = 1.0 - p;
+    state->r = exp(n * log(q));
+    state->c = np = n*p;
+    state->m = min(n, np + 10.0*sqrt(np*q + 1));
+}
+
 long rk_binomial_inversion(rk_state *state, long n, double p)
 {
-    double q, qn, np, px, U;
+    double q, qn, px, U;
     long X, bound;
 
     if (!(state->has_binomial) || 
          (state->nsave != n) ||
          (state->psave != p))
     {
-        state->nsave = n;
-        state->psave = p;
-        state->has_binomial = 1;
-        state->q = q = 1.0 - p;
-        state->r = qn = exp(n * log(q));
-        state->c = np = n*p;
-        state->m = bound = min(n, np + 10.0*sqrt(np*q + 1));
-    } else
-    {
-        q = state->q;
-        qn = state->r;
-        np = state->c;
-        bound = state->m;
+        rk_binomial_inversion_setup(state, n, p);
     }
+    q = state->q;
+    qn = state->r;
+    bound = state->m;
     X = 0;
     px = qn;
     U = rk_double(state);
@@ -448,6 +455,22 @@ long rk_binomial(rk_state *state, long n, double p)
 
 }
 
+void rk_binomial_setup(rk_state *state, long n, double p)
+{
+    if (p > 0.5)
+    {
+        p = 1.0-p;
+    }
+    if (p*n <= 30.0)
+    {
+        rk_binomial_inversion_setup(state, n, p);
+    }
+    else
+    {
+        rk_binomial_btpe_setup(state, n, p);
+    }
+}
+
 long rk_negative_binomial(rk_state *state, double n, double p)
 {
     double Y;
@@ -95,6 +95,11 @@ extern double rk_noncentral_f(rk_state *state, double dfnum, double dfden, doubl
  * is used. */
 extern long rk_binomial(rk_state *state, long n, double p);
 
+/* Computes into the state the binomial setup that rk_binomial would for n and
+ * p, without drawing. The state keeps only one such setup, so callers that
+ * alternate among several can save and restore these fields themselves. */
+extern void rk_binomial_setup(rk_state *state, long n, double p);
+
 /* Binomial distribution using BTPE. */
 extern long rk_binomial_btpe(rk_state *state, long n, double p);
 
@@ -0,0 +1,508 @@
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <set>
+#include <string.h>
+#include <vector>
+#include "profile.h"
+
+using namespace std;
+using namespace std::chrono;
+
+
+namespace concuno {
+
+
+/**
+ * In the same order as Profile::Counter.
+ */
+const char* cnProfileCounterNames[] = {
+  "bootDraws",
+  "distances",
+  "expansionsPruned",
+  "expansionsTried",
+  "normalPValues",
+  "pointBags",
+  "points",
+  "propagatedBags",
+  "thresholdRepairs",
+  "thresholdSorts",
+};
+
+
+/**
+ * In the same order as Profile::Phase.
+ */
+const char* cnProfilePhaseNames[] = {
+  "chooseThreshold",
+  "expand",
+  "pointBagsBuild",
+  "propagate",
+  "verify",
+};
+
+
+struct ProfileBreakdown {
+
+  Count counts[Profile::CounterCount];
+
+  Count nanos[Profile::PhaseCount];
+
+  Count wallNanos;
+
+};
+
+
+/**
+ * Totals merged from threads so far, and the rounds closed.
+ */
+struct ProfileState {
+
+  ProfileState() {
+    memset(&total, 0, sizeof(total));
+    memset(&roundStart, 0, sizeof(roundStart));
+  }
+
+  mutex guard;
+
+  vector<ProfileBreakdown> rounds;
+
+  steady_clock::time_point begin;
+
+  steady_clock::time_point roundBegin;
+
+  /**
+   * The total as of the start of the current round.
+   */
+  ProfileBreakdown roundStart;
+
+  ProfileBreakdown total;
+
+};
+
+ProfileState& cnProfileState() {
+  static ProfileState state;
+  return state;
+}
+
+
+atomic<bool> Profile::on(false);
+
+
+Profile::Local::Local() {
+  memset(counts, 0, sizeof(counts));
+  memset(nanos, 0, sizeof(nanos));
+}
+
+
+void cnProfileMerge(Profile::Local* local) {
+  ProfileState& state = cnProfileState();
+  lock_guard<mutex> lock(state.guard);
+  for (Index c = 0; c < Profile::CounterCount; c++) {
+    state.total.counts[c] += local->counts[c];
+    local->counts[c] = 0;
+  }
+  for (Index p = 0; p < Profile::PhaseCount; p++) {
+    state.total.nanos[p] += local->nanos[p];
+    local->nanos[p] = 0;
+  }
+}
+
+Profile::Local::~Local() {
+  cnProfileMerge(this);
+}
+
+
+void cnProfileRound() {
+  ProfileState& state = cnProfileState();
+  steady_clock::time_point now = steady_clock::now();
+  ProfileBreakdown round;
+  cnProfileMerge(&Profile::local());
+  lock_guard<mutex> lock(state.guard);
+  for (Index c = 0; c < Profile::CounterCount; c++) {
+    round.counts[c] = state.total.counts[c] - state.roundStart.counts[c];
+  }
+  for (Index p = 0; p < Profile::PhaseCount; p++) {
+    round.nanos[p] = state.total.nanos[p] - state.roundStart.nanos[p];
+  }
+  round.wallNanos = duration_cast<nanoseconds>(now - state.roundBegin).count();
+  state.rounds.push_back(round);
+  state.roundStart = state.total;
+  state.roundBegin = now;
+}
+
+
+void cnProfileStart() {
+  ProfileState& state = cnProfileState();
+  cnProfileMerge(&Profile::local());
+  {
+    lock_guard<mutex> lock(state.guard);
+    memset(&state.total, 0, sizeof(state.total));
+    memset(&state.roundStart, 0, sizeof(state.roundStart));
+    state.rounds.clear();
+    state.begin = state.roundBegin = steady_clock::now();
+  }
+  Profile::on = true;
+}
+
+
+void cnProfileStop() {
+  Profile::on = false;
+}
+
+
+void cnProfileWrite_breakdown(
+  ostream& out, const ProfileBreakdown& breakdown, const char* indent
+) {
+  out << "{" << endl;
+  out << indent << "  \"wallSeconds\": " << breakdown.wallNanos * 1e-9;
+  out << "," << endl << indent << "  \"counts\": {";
+  for (Index c = 0; c < Profile::CounterCount; c++) {
+    out << (c ? ", " : "");
+    out << "\"" << cnProfileCounterNames[c] << "\": " << breakdown.counts[c];
+  }
+  out << "}," << endl << indent << "  \"seconds\": {";
+  for (Index p = 0; p < Profile::PhaseCount; p++) {
+    out << (p ? ", " : "");
+    out << "\"" << cnProfilePhaseNames[p] << "\": ";
+    out << breakdown.nanos[p] * 1e-9;
+  }
+  out << "}" << endl << indent << "}";
+}
+
+bool cnProfileWrite(const char* name) {
+  ProfileState& state = cnProfileState();
+  ofstream file(name);
+  ProfileBreakdown total;
+
+  if (!file) cnErrTo(FAIL, "Couldn't open %s.", name);
+  cnProfileMerge(&Profile::local());
+  {
+    lock_guard<mutex> lock(state.guard);
+    total = state.total;
+    total.wallNanos =
+      duration_cast<nanoseconds>(steady_clock::now() - state.begin).count();
+
+    // Rounds first, then the total for everything so far.
+    file << "{" << endl << "  \"rounds\": [";
+    for (size_t r = 0; r < state.rounds.size(); r++) {
+      file << (r ? ", " : "");
+      cnProfileWrite_breakdown(file, state.rounds[r], "  ");
+    }
+    file << "]," << endl << "  \"total\": ";
+    cnProfileWrite_breakdown(file, total, "  ");
+    file << endl << "}" << endl;
+  }
+  if (!file) cnErrTo(FAIL, "Couldn't write %s.", name);
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+/**
+ * Each thread keeps this many of its latest spans.
+ */
+const Count cnTraceCapacity = 1 << 16;
+
+
+struct TraceEvent {
+
+  const char* name;
+
+  string detail;
+
+  Count begin;
+
+  Count duration;
+
+};
+
+
+/**
+ * Spans from one thread, either still running or retired.
+ */
+struct TraceEvents {
+
+  /**
+   * Negative until the first span, since most threads never trace.
+   */
+  Index tid;
+
+  vector<TraceEvent> events;
+
+};
+
+
+struct TraceRing: TraceEvents {
+
+  TraceRing();
+
+  /**
+   * Hands the spans over, if any, and frees the thread id.
+   */
+  ~TraceRing();
+
+  void push(const TraceEvent& event);
+
+  /**
+   * Copies the events out oldest first.
+   */
+  void take(TraceEvents* out);
+
+  /**
+   * The trace this belongs to, so rings left from an old one get cleared.
+   */
+  Count generation;
+
+  /**
+   * How many events were ever pushed, to find the oldest in the ring.
+   */
+  Count pushed;
+
+};
+
+
+struct TraceState {
+
+  TraceState(): generation(0), nextTid(0) {}
+
+  steady_clock::time_point begin;
+
+  set<Index> freeTids;
+
+  /**
+   * Atomic so rings can check for a new trace without taking the lock.
+   */
+  atomic<Count> generation;
+
+  mutex guard;
+
+  Index nextTid;
+
+  vector<TraceEvents> retired;
+
+};
+
+TraceState& cnTraceState() {
+  static TraceState state;
+  return state;
+}
+
+TraceRing& cnTraceRing() {
+  thread_local TraceRing ring;
+  return ring;
+}
+
+/**
+ * The innermost span on this thread.
+ */
+thread_local TraceSpan* cnTraceCurrent = NULL;
+
+
+atomic<bool> Trace::on(false);
+
+
+/**
+ * Takes the lowest free id, so ids get reused as workers come and go. Call
+ * with the lock held.
+ */
+Index cnTraceTid(TraceState& state) {
+  Index tid;
+  if (state.freeTids.empty()) return state.nextTid++;
+  tid = *state.freeTids.begin();
+  state.freeTids.erase(state.freeTids.begin());
+  return tid;
+}
+
+Count cnTraceNow() {
+  return duration_cast<nanoseconds>(
+    steady_clock::now() - cnTraceState().begin
+  ).count();
+}
+
+
+TraceRing::TraceRing(): generation(-1), pushed(0) {
+  tid = -1;
+}
+
+TraceRing::~TraceRing() {
+  TraceState& state = cnTraceState();
+  lock_guard<mutex> lock(state.guard);
+  if (tid < 0 || generation != state.generation) return;
+  state.retired.push_back(TraceEvents());
+  take(&state.retired.back());
+  state.freeTids.insert(tid);
+}
+
+void TraceRing::push(const TraceEvent& event) {
+  TraceState& state = cnTraceState();
+  if (tid < 0 || generation != state.generation.load()) {
+    // First span for this trace.
+    lock_guard<mutex> lock(state.guard);
+    events.clear();
+    generation = state.generation;
+    pushed = 0;
+    tid = cnTraceTid(state);
+  }
+  if (pushed < cnTraceCapacity) {
+    events.push_back(event);
+  } else {
+    events[pushed % cnTraceCapacity] = event;
+  }
+  pushed++;
+}
+
+void TraceRing::take(TraceEvents* out) {
+  Count count = events.size();
+  Index oldest = pushed > count ? pushed % count : 0;
+  out->tid = tid;
+  out->events.clear();
+  for (Index e = 0; e < count; e++) {
+    out->events.push_back(events[(oldest + e) % count]);
+  }
+}
+
+
+TraceSpan::TraceSpan(const char* $name):
+  active(Trace::on.load(memory_order_acquire)), begin(0), name($name),
+  outer(NULL)
+{
+  if (active) {
+    outer = cnTraceCurrent;
+    cnTraceCurrent = this;
+    begin = cnTraceNow();
+  }
+}
+
+
+TraceSpan::~TraceSpan() {
+  TraceSpan* span = this;
+  TraceEvent event;
+  if (!active) return;
+  event.name = name;
+  event.begin = begin;
+  event.duration = cnTraceNow() - begin;
+  // Take the detail from the nearest span that has one.
+  while (span && span->description.empty()) span = span->outer;
+  if (span) event.detail = span->description;
+  cnTraceCurrent = outer;
+  cnTraceRing().push(event);
+}
+
+
+void TraceSpan::detail(const std::string& $detail) {
+  description = $detail;
+}
+
+
+void cnTraceStart() {
+  TraceState& state = cnTraceState();
+  TraceRing& ring = cnTraceRing();
+  {
+    lock_guard<mutex> lock(state.guard);
+    state.generation++;
+    state.freeTids.clear();
+    state.nextTid = 0;
+    state.retired.clear();
+    state.begin = steady_clock::now();
+    // Claim the first row for this thread.
+    ring.events.clear();
+    ring.generation = state.generation;
+    ring.pushed = 0;
+    ring.tid = cnTraceTid(state);
+  }
+  Trace::on = true;
+}
+
+
+void cnTraceStop() {
+  Trace::on = false;
+}
+
+
+/**
+ * Writes the text as a JSON string, quotes and all.
+ */
+void cnTraceWrite_string(ostream& out, const string& text) {
+  out << '"';
+  for (size_t c = 0; c < text.size(); c++) {
+    char ch = text[c];
+    if (ch == '"' || ch == '\\') {
+      out << '\\' << ch;
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      // Control chars shouldn't show up, so just keep them harmless.
+      out << ' ';
+    } else {
+      out << ch;
+    }
+  }
+  out << '"';
+}
+
+bool cnTraceWrite(const char* name) {
+  TraceState& state = cnTraceState();
+  TraceRing& ring = cnTraceRing();
+  ofstream file(name);
+  bool first = true;
+  vector<TraceEvents> threads;
+  set<Index> tids;
+
+  if (!file) cnErrTo(FAIL, "Couldn't open %s.", name);
+  {
+    lock_guard<mutex> lock(state.guard);
+    threads = state.retired;
+    if (ring.tid >= 0 && ring.generation == state.generation) {
+      threads.push_back(TraceEvents());
+      ring.take(&threads.back());
+    }
+  }
+
+  // Complete events, with times in microseconds, down to nanoseconds.
+  file << fixed << setprecision(3);
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+  for (size_t t = 0; t < threads.size(); t++) {
+    TraceEvents& thread = threads[t];
+    tids.insert(thread.tid);
+    for (size_t e = 0; e < thread.events.size(); e++) {
+      TraceEvent& event = thread.events[e];
+      file << (first ? "" : ",\n");
+      first = false;
+      file << "{\"name\": ";
+      cnTraceWrite_string(file, event.name);
+      file << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << thread.tid;
+      file << ", \"ts\": " << event.begin * 1e-3;
+      file << ", \"dur\": " << event.duration * 1e-3;
+      if (!event.detail.empty()) {
+        file << ", \"args\": {\"detail\": ";
+        cnTraceWrite_string(file, event.detail);
+        file << "}";
+      }
+      file << "}";
+    }
+  }
+
+  // Name the rows.
+  for (set<Index>::iterator tid = tids.begin(); tid != tids.end(); tid++) {
+    file << (first ? "" : ",\n");
+    first = false;
+    file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1";
+    file << ", \"tid\": " << *tid << ", \"args\": {\"name\": \"";
+    if (*tid) {
+      file << "worker " << *tid;
+    } else {
+      file << "learner";
+    }
+    file << "\"}}";
+  }
+  file << endl << "]}" << endl;
+  if (!file) cnErrTo(FAIL, "Couldn't write %s.", name);
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+}
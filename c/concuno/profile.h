@@ -0,0 +1,233 @@
+#ifndef concuno_profile_h
+#define concuno_profile_h
+
+
+#include <atomic>
+#include <chrono>
+#include "core.h"
+
+
+namespace concuno {
+
+
+/**
+ * Built-in counters for hot paths and timers for the main phases of learning,
+ * to see where a run spends its time without an external profiler. It's all
+ * compiled in but off unless started, when each count or timer costs just a
+ * check of the on flag.
+ *
+ * Tallies go to thread-local storage, so workers don't contend, and get merged
+ * into the totals when threads end or rounds close.
+ */
+struct Profile {
+
+  /**
+   * Keep the names in profile.cpp in the same order.
+   */
+  enum Counter {
+    BootDraws,
+    Distances,
+    ExpansionsPruned,
+    ExpansionsTried,
+    NormalPValues,
+    PointBags,
+    Points,
+    PropagatedBags,
+    ThresholdRepairs,
+    ThresholdSorts,
+    CounterCount,
+  };
+
+  /**
+   * Phases nest, so times include any phases inside them. Times from worker
+   * threads add up, so phases can total more than wall time.
+   *
+   * Keep the names in profile.cpp in the same order.
+   */
+  enum Phase {
+    ChooseThreshold,
+    Expand,
+    PointBagsBuild,
+    Propagate,
+    Verify,
+    PhaseCount,
+  };
+
+  /**
+   * Tallies for one thread.
+   */
+  struct Local {
+
+    Local();
+
+    /**
+     * Merges anything left into the totals.
+     */
+    ~Local();
+
+    Count counts[CounterCount];
+
+    Count nanos[PhaseCount];
+
+  };
+
+  static Local& local() {
+    thread_local Local local;
+    return local;
+  }
+
+  static std::atomic<bool> on;
+
+};
+
+
+/**
+ * Adds to the counter, if profiling.
+ */
+inline void cnProfileCount(Profile::Counter counter, Count amount = 1) {
+  if (Profile::on.load(std::memory_order_relaxed)) {
+    Profile::local().counts[counter] += amount;
+  }
+}
+
+
+/**
+ * Times the rest of the enclosing scope as the given phase, if profiling.
+ * Declare it before any goto that could skip it.
+ */
+struct ProfileTimer {
+
+  ProfileTimer(Profile::Phase $phase):
+    on(Profile::on.load(std::memory_order_relaxed)), phase($phase)
+  {
+    if (on) begin = std::chrono::steady_clock::now();
+  }
+
+  ~ProfileTimer() {
+    if (on) {
+      Profile::local().nanos[phase] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - begin
+        ).count();
+    }
+  }
+
+private:
+
+  std::chrono::steady_clock::time_point begin;
+
+  bool on;
+
+  Profile::Phase phase;
+
+};
+
+
+/**
+ * Closes the current round, keeping its own breakdown for the report. Call
+ * only from the thread that started profiling while no workers are running,
+ * since it can see only its own tallies and those of threads that ended.
+ */
+void cnProfileRound();
+
+
+/**
+ * Clears any previous tallies and rounds, and turns profiling on.
+ */
+void cnProfileStart();
+
+
+/**
+ * Turns profiling off. Tallies stay for reporting.
+ */
+void cnProfileStop();
+
+
+/**
+ * Writes the JSON report of rounds closed so far and their total, along with
+ * wall times, to the given file. Returns false on failure.
+ */
+bool cnProfileWrite(const char* name);
+
+
+/**
+ * Opt-in tracing of spans to Chrome trace-event JSON, for viewing in Perfetto
+ * or chrome://tracing, to see stragglers and idle workers over time.
+ *
+ * Each thread records into its own ring buffer, keeping only its latest spans,
+ * and hands them over when it ends. Thread ids get reused as threads come and
+ * go, so each row in the view is more or less a worker slot.
+ */
+struct Trace {
+
+  static std::atomic<bool> on;
+
+};
+
+
+/**
+ * Records the rest of the enclosing scope as a span, if tracing. The name
+ * should outlive the trace, as string literals do. Spans without their own
+ * detail get that of the nearest enclosing span on the same thread.
+ *
+ * Declare it before any goto that could skip it.
+ */
+struct TraceSpan {
+
+  TraceSpan(const char* name);
+
+  ~TraceSpan();
+
+  /**
+   * Sets the detail for this span and those inside it. Check on first, to
+   * avoid building the text for nothing.
+   */
+  void detail(const std::string& detail);
+
+  bool on() {
+    return active;
+  }
+
+private:
+
+  bool active;
+
+  Count begin;
+
+  std::string description;
+
+  const char* name;
+
+  /**
+   * The enclosing span on this thread, if any.
+   */
+  TraceSpan* outer;
+
+};
+
+
+/**
+ * Clears any previous trace and turns tracing on. The calling thread shows
+ * first in the trace.
+ */
+void cnTraceStart();
+
+
+/**
+ * Turns tracing off. Spans stay for writing.
+ */
+void cnTraceStop();
+
+
+/**
+ * Writes the Chrome trace-event JSON to the given file. Call from the thread
+ * that started tracing while no workers are running, since it can see only
+ * its own spans and those of threads that ended. Returns false on failure.
+ */
+bool cnTraceWrite(const char* name);
+
+
+}
+
+
+#endif
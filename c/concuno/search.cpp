@@ -1,85 +1,314 @@
+#include <new>
+#include <vector>
+
 #include "search.h"
 
 
 namespace concuno {
 
 
+struct cnSearcherSelf;
+
+
+/**
+ * Orders frontier entries by the searcher's better function, either best or
+ * worst first.
+ */
+struct cnSearchFrontier_Compare {
+
+  cnSearchFrontier_Compare(cnSearcherSelf* $self, bool $worstFirst):
+    self($self), worstFirst($worstFirst) {}
+
+  bool operator()(Index a, Index b) const;
+
+  cnSearcherSelf* self;
+
+  bool worstFirst;
+
+};
+
+
+typedef Heap<Index, cnSearchFrontier_Compare> cnSearchFrontier_Heap;
+
+
+/**
+ * An option waiting in the frontier, with its handles in both heaps.
+ */
+struct cnSearchFrontier_Entry {
+
+  cnSearchFrontier_Heap::Handle best;
+
+  cnSearchOption option;
+
+  cnSearchFrontier_Heap::Handle worst;
+
+};
+
+
 struct cnSearcherSelf: cnSearcher {
 
-  Heap<cnSearchOption>* options;
+  cnSearcherSelf():
+    bests(cnSearchFrontier_Compare(this, false)),
+    worsts(cnSearchFrontier_Compare(this, true)) {}
+
+  /**
+   * The options waiting to be stepped, as indices into entries. Each is in
+   * both heaps, so the best come off one for stepping and the worst off the
+   * other when over capacity. A min-max heap would need only one, but it
+   * would be a second heap implementation to maintain beside Heap.
+   */
+  cnSearchFrontier_Heap bests;
+
+  std::vector<cnSearchFrontier_Entry> entries;
+
+  /**
+   * Entries not in use, for reuse.
+   */
+  std::vector<Index> freeEntries;
+
+  cnSearchFrontier_Heap worsts;
 
 };
 
 
+bool cnSearchFrontier_Compare::operator()(Index a, Index b) const {
+  cnSearchOption optionA = self->entries[a].option;
+  cnSearchOption optionB = self->entries[b].option;
+  return worstFirst ?
+    self->better(self, optionB, optionA) : self->better(self, optionA, optionB);
+}
+
+
+/**
+ * Removes the entry from both heaps, and returns its option.
+ */
+cnSearchOption cnSearchFrontier_remove(cnSearcherSelf* self, Index entry) {
+  cnSearchFrontier_Entry& removed = self->entries[entry];
+  self->bests.remove(removed.best);
+  self->worsts.remove(removed.worst);
+  self->freeEntries.push_back(entry);
+  return removed.option;
+}
+
+/**
+ * Removes and returns the best option, which must exist.
+ */
+cnSearchOption cnSearchFrontier_pull(cnSearcherSelf* self) {
+  return cnSearchFrontier_remove(self, self->bests.peek());
+}
+
+/**
+ * Says whether the option is still worth keeping around, given our bound.
+ */
+bool cnSearchFrontier_hopeful(cnSearcherSelf* self, cnSearchOption option) {
+  return
+    !self->hopeful || !self->bestOption || self->hopeful(self, option);
+}
+
+/**
+ * Takes over the option, pushing it on the frontier, or destroying it if
+ * hopeless or worse than all others when at capacity. Returns false only if
+ * the push failed, in which case the caller still owns the option.
+ */
+bool cnSearchFrontier_push(cnSearcherSelf* self, cnSearchOption option) {
+  cnSearchOption dropped = NULL;
+  bool result = true;
+
+  if (!cnSearchFrontier_hopeful(self, option)) {
+    dropped = option;
+  } else if (self->capacity && self->bests.count() >= self->capacity) {
+    // Make room by dropping the worst, unless that's the new option itself.
+    Index worst = self->worsts.peek();
+    if (self->better(self, option, self->entries[worst].option)) {
+      dropped = cnSearchFrontier_remove(self, worst);
+    } else {
+      dropped = option;
+    }
+  }
+  if (dropped != option) {
+    Index entry = -1;
+    try {
+      // Fill in the entry before pushing, since the heaps compare options.
+      if (self->freeEntries.empty()) {
+        self->entries.push_back(cnSearchFrontier_Entry());
+        entry = self->entries.size() - 1;
+      } else {
+        entry = self->freeEntries.back();
+        self->freeEntries.pop_back();
+      }
+      self->entries[entry].option = option;
+      self->entries[entry].best = -1;
+      self->entries[entry].best = self->bests.push(entry);
+      self->entries[entry].worst = self->worsts.push(entry);
+    } catch (const std::bad_alloc&) {
+      // Take back what got in, so the caller still owns the option.
+      if (entry >= 0) {
+        if (self->entries[entry].best >= 0) {
+          self->bests.remove(self->entries[entry].best);
+        }
+        self->freeEntries.push_back(entry);
+      }
+      result = false;
+    }
+  }
+
+  // Destroy any dropped, which is never the option on failure.
+  if (dropped && self->destroyOption) self->destroyOption(self, dropped);
+  return result;
+}
+
+
+/**
+ * Destroys and clears out any options remaining in the frontier.
+ */
+void cnSearchFrontier_clear(cnSearcherSelf* self) {
+  while (self->bests.count()) {
+    cnSearchOption option = cnSearchFrontier_pull(self);
+    if (self->destroyOption) self->destroyOption(self, option);
+  }
+  self->entries.clear();
+  self->freeEntries.clear();
+}
+
+
+/**
+ * The options pulled together for stepping, along with the next options from
+ * each, for use with cnParallelEach.
+ */
+struct cnSearch_Batch {
+
+  cnSearcher* searcher;
+
+  List<cnSearchOption> contenders;
+
+  /**
+   * One list for each possible contender, so steps never share.
+   */
+  List<cnSearchOption>* nexts;
+
+};
+
+bool cnSearch_finished(cnSearcher* searcher) {
+  return searcher->finished && searcher->finished(searcher);
+}
+
+bool cnSearch_step(RefAny info, Index index) {
+  cnSearch_Batch* batch = reinterpret_cast<cnSearch_Batch*>(info);
+  return batch->searcher->step(
+    batch->searcher, batch->contenders[index], batch->nexts + index
+  );
+}
+
 bool cnSearch(cnSearcher* searcher) {
-  List<cnSearchOption> nexts;
+  cnSearch_Batch batch;
+  Count batchSize = searcher->workerCount;
   bool result = false;
   cnSearcherSelf* self = (cnSearcherSelf*)searcher;
 
-  // Push initial options on the heap.
+  // Prepare the batch.
+  if (batchSize < 1) batchSize = cnWorkerCount();
+  batch.searcher = searcher;
+  batch.nexts = new List<cnSearchOption>[batchSize];
+
+  // Push initial options on the frontier, which takes them over.
   cnListEachBegin(&searcher->initialOptions, cnSearchOption, option) {
-    if (!cnHeapPush(self->options, *option)) cnErrTo(DONE, "No push.");
+    if (!cnSearchFrontier_push(self, *option)) cnErrTo(DONE, "No push.");
+    *option = NULL;
   } cnEnd;
+  cnListClear(&searcher->initialOptions);
 
   // Keep looping while we have any options, and they don't say we're done.
-  // TODO A second worst-first heap for pruning options too bad? If so, would
-  // TODO need the ability to locate and prune them from the best-first heap,
-  // TODO too.
-  while (self->options->items.count && !searcher->finished(searcher)) {
-    // TODO Multithread out N at a time.
-
-    // Find our next search point.
-    cnSearchOption contender = cnHeapPull(self->options);
-
-    // See if the contender is our new best.
-    if (
-      !searcher->bestOption ||
-      searcher->better(searcher, contender, searcher->bestOption)
-    ) {
-      // The old best has been bested.
-      if (searcher->destroyOption) {
-        searcher->destroyOption(searcher, searcher->bestOption);
+  while (self->bests.count() && !cnSearch_finished(searcher)) {
+    bool failed = false;
+    bool pushFailed = false;
+    cnSearchOption previousBest = searcher->bestOption;
+
+    // Pull our next search points, checking each for a new best. Wait to
+    // destroy any bested until their steps are done.
+    cnListClear(&batch.contenders);
+    do {
+      cnSearchOption contender = cnSearchFrontier_pull(self);
+      // The best might have improved since this was pushed.
+      if (!cnSearchFrontier_hopeful(self, contender)) {
+        if (searcher->destroyOption) {
+          searcher->destroyOption(searcher, contender);
+        }
+        continue;
+      }
+      if (!cnListPush(&batch.contenders, &contender)) {
+        // Those already pulled get cleaned up with the batch below.
+        if (searcher->destroyOption) {
+          searcher->destroyOption(searcher, contender);
+        }
+        pushFailed = true;
+        break;
       }
-      searcher->bestOption = contender;
+      if (
+        !searcher->bestOption ||
+        searcher->better(searcher, contender, searcher->bestOption)
+      ) searcher->bestOption = contender;
+    } while (
+      batch.contenders.count < batchSize && self->bests.count() &&
+      !cnSearch_finished(searcher)
+    );
+    if (!(batch.contenders.count || pushFailed)) continue;
+
+    // Search from the contenders, in parallel if more than one, unless we
+    // couldn't gather them all.
+    if (!pushFailed) {
+      failed = batch.contenders.count > 1 ?
+        !cnParallelEach(
+          batch.contenders.count, batch.contenders.count, cnSearch_step, &batch
+        ) :
+        !cnSearch_step(&batch, 0);
     }
 
-    // Search from the contender either way.
-    bool failed = !searcher->step(searcher, contender, &nexts);
-    // If the contender wasn't our best, destroy it now. It has served its
-    // purpose in search.
+    // Destroy the old best if bested, and any contenders that weren't best.
+    // They have served their purpose in search.
     // TODO Actually, I'll need to hand all past some threshold to some second
     // TODO tier of comparison, I think. Ponder this.
-    if (contender != searcher->bestOption && searcher->destroyOption) {
-      searcher->destroyOption(searcher, contender);
+    if (searcher->destroyOption) {
+      if (searcher->bestOption != previousBest) {
+        searcher->destroyOption(searcher, previousBest);
+      }
+      cnListEachBegin(&batch.contenders, cnSearchOption, contender) {
+        if (*contender != searcher->bestOption) {
+          searcher->destroyOption(searcher, *contender);
+        }
+      } cnEnd;
     }
     // Defer failure check until after we've destroyed any failed contender.
+    if (pushFailed) cnErrTo(DONE, "No contender.");
     if (failed) cnErrTo(DONE, "No step.");
 
-    // Push the next options.
-    cnListEachBegin(&nexts, cnSearchOption, option) {
-      if (!cnHeapPush(self->options, *option)) cnErrTo(DONE, "No push.");
-    } cnEnd;
+    // Push the next options, in pull order so thread timing doesn't matter.
+    for (Index c = 0; c < batch.contenders.count; c++) {
+      List<cnSearchOption>* nexts = batch.nexts + c;
+      cnListEachBegin(nexts, cnSearchOption, option) {
+        if (!cnSearchFrontier_push(self, *option)) cnErrTo(DONE, "No push.");
+        // Null it out, so we don't double destroy on failure.
+        *option = NULL;
+      } cnEnd;
+      cnListClear(nexts);
+    }
   }
   result = true;
 
   DONE:
-  cnHeapClear(self->options);
+  // Destroy any next options we didn't get to, including from failed steps.
+  for (Index c = 0; c < batchSize; c++) {
+    if (searcher->destroyOption) {
+      cnListEachBegin(batch.nexts + c, cnSearchOption, option) {
+        if (*option) searcher->destroyOption(searcher, *option);
+      } cnEnd;
+    }
+  }
+  cnSearchFrontier_clear(self);
+  delete[] batch.nexts;
   return result;
 }
 
 
-void cnSearcherCreate_destroyItem(void* info, void* item) {
-  // Call destroy if we have one.
-  cnSearcher* searcher = reinterpret_cast<cnSearcher*>(info);
-  if (searcher->destroyOption) searcher->destroyOption(searcher, item);
-}
-
-bool cnSearcherCreate_less(void* info, void* a, void* b) {
-  cnSearcher* searcher = reinterpret_cast<cnSearcher*>(info);
-  // If it's better, it should bubble to the top. So better means less.
-  return searcher->better(searcher, a, b);
-}
-
 cnSearcher* cnSearcherCreate(void) {
   cnSearcherSelf* searcher = new cnSearcherSelf;
   if (!searcher) cnErrTo(DONE, "No searcher.");
@@ -87,24 +316,14 @@ cnSearcher* cnSearcherCreate(void) {
   // Safety first.
   searcher->bestOption = NULL;
   searcher->better = NULL;
+  searcher->capacity = 0;
   searcher->destroyInfo = NULL;
   searcher->destroyOption = NULL;
   searcher->finished = NULL;
+  searcher->hopeful = NULL;
   searcher->info = NULL;
   searcher->step = NULL;
-
-  // Now possible failures.
-  if (!(searcher->options =
-    reinterpret_cast<Heap<cnSearchOption>*>(cnHeapCreate(cnSearcherCreate_less))
-  )) {
-    cnErrTo(FAIL, "No options heap.");
-  }
-  searcher->options->info = searcher;
-  searcher->options->destroyItem = cnSearcherCreate_destroyItem;
-
-  FAIL:
-  cnSearcherDestroy(searcher);
-  searcher = NULL;
+  searcher->workerCount = 1;
 
   DONE:
   return searcher;
@@ -115,9 +334,8 @@ void cnSearcherDestroy(cnSearcher* searcher) {
   cnSearcherSelf* self = (cnSearcherSelf*)searcher;
   if (!searcher) return;
 
-  // Options heap.
-  cnHeapDestroy(self->options);
-  self->options = NULL;
+  // Options frontier.
+  cnSearchFrontier_clear(self);
 
   // Best and initial options.
   // TODO Or is this a bad idea?
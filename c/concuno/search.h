@@ -1,5 +1,5 @@
-#ifndef concuno_learn_h
-#define concuno_learn_h
+#ifndef concuno_search_h
+#define concuno_search_h
 
 
 #include "core.h"
@@ -49,6 +49,17 @@ struct cnSearcher {
    */
   bool (*better)(cnSearcher* searcher, cnSearchOption a, cnSearchOption b);
 
+  /**
+   * The most options to keep waiting in the frontier. When full, the worst
+   * get destroyed to make room for better. Defaults to 0 for no limit.
+   *
+   * The frontier keeps every option in two handle heaps, one best first and
+   * one worst first, rather than in a single min-max heap. That reuses the
+   * tested Heap from core.h at the cost of updating both heaps on each push
+   * and pull, which is small next to stepping any real option.
+   */
+  Count capacity;
+
   /**
    * Set to non-null for automatic destruction of info.
    *
@@ -70,6 +81,13 @@ struct cnSearcher {
    */
   bool (*finished)(cnSearcher* searcher);
 
+  /**
+   * Optional admissible bound, saying whether the option or anything stepped
+   * from it could ever be better than the current bestOption. Options for
+   * which this returns false get destroyed without ever being stepped.
+   */
+  bool (*hopeful)(cnSearcher* searcher, cnSearchOption option);
+
   /**
    * Custom info for your own needs.
    */
@@ -77,6 +95,7 @@ struct cnSearcher {
 
   /**
    * The initial options from which to begin the search. At least one is needed.
+   * The search takes these over, leaving the list empty.
    */
   List<cnSearchOption> initialOptions;
 
@@ -90,6 +109,15 @@ struct cnSearcher {
     cnSearcher* searcher, cnSearchOption option, List<cnSearchOption>* nexts
   );
 
+  /**
+   * How many of the best options to pull at once, stepping each on its own
+   * thread. Defaults to 1, for plain serial search. Use 0 for cnWorkerCount().
+   *
+   * Results depend on this count but not on thread timing, since bests get
+   * chosen and next options get pushed in the order options were pulled.
+   */
+  Count workerCount;
+
 };
 
 
@@ -1,6 +1,7 @@
 //#include <cblas.h>
 //#include <clapack.h>
 #include <math.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "io.h"
@@ -9,12 +10,36 @@
 #include "numpy-mtrand/randomkit.h"
 #include "stats.h"
 
+// The vendored header has no C++ guard of its own.
+cnCBegin
+#include "numpy-mtrand/initarray.h"
+cnCEnd
+
 using namespace std;
 
 
 namespace concuno {
 
 
+/**
+ * The binomial setup that rk_state keeps for only one (n, p) at a time, saved
+ * here so it can be restored instead of recomputed.
+ */
+typedef struct cnBinomialSetup {
+
+  long n;
+
+  double p;
+
+  double r, q, fm;
+
+  long m;
+
+  double p1, xm, xl, xr, c, laml, lamr, p2, p3, p4;
+
+} cnBinomialSetup;
+
+
 typedef struct cnBinomialInfo {
 
   Count count;
@@ -23,6 +48,8 @@ typedef struct cnBinomialInfo {
 
   Random random;
 
+  cnBinomialSetup setup;
+
 } cnBinomialInfo;
 
 
@@ -60,9 +87,93 @@ typedef struct cnMultinomialInfo {
 
   Random random;
 
+  /**
+   * Binomial setups for each class but the last and for each count of samples
+   * left from 0 through sampleCount, since that count varies by draw. Filled
+   * in at creation, so sampling leaves the multinomial unchanged. Null when
+   * too large, in which case only rk_state remembers anything.
+   */
+  cnBinomialSetup* setups;
+
 } cnMultinomialInfo;
 
 
+/**
+ * The state behind a Random.
+ */
+struct cnRandomInfo {
+
+  rk_state state;
+
+  /**
+   * Determines this stream, mixed from the seed and any split keys along the
+   * way, so splits don't depend on the current state.
+   */
+  uint64_t key;
+
+};
+
+
+rk_state* cnRandomState(Random random) {
+  return &reinterpret_cast<cnRandomInfo*>(random)->state;
+}
+
+
+/**
+ * Computes the setup for count and prob, using the binomial fields of the
+ * given state as scratch space. No random numbers are drawn.
+ */
+void cnBinomialSetupInit(
+  cnBinomialSetup* setup, rk_state* state, Count count, Float prob
+) {
+  rk_binomial_setup(state, count, prob);
+  setup->n = state->nsave;
+  setup->p = state->psave;
+  setup->r = state->r;
+  setup->q = state->q;
+  setup->fm = state->fm;
+  setup->m = state->m;
+  setup->p1 = state->p1;
+  setup->xm = state->xm;
+  setup->xl = state->xl;
+  setup->xr = state->xr;
+  setup->c = state->c;
+  setup->laml = state->laml;
+  setup->lamr = state->lamr;
+  setup->p2 = state->p2;
+  setup->p3 = state->p3;
+  setup->p4 = state->p4;
+}
+
+
+/**
+ * Restores the setup into the state before sampling, so rk_binomial skips its
+ * own. The result matches plain rk_binomial draw for draw.
+ */
+Count cnBinomialSetupSample(
+  const cnBinomialSetup* setup, rk_state* state, Count count, Float prob
+) {
+  state->has_binomial = 1;
+  state->nsave = setup->n;
+  state->psave = setup->p;
+  state->r = setup->r;
+  state->q = setup->q;
+  state->fm = setup->fm;
+  state->m = setup->m;
+  state->p1 = setup->p1;
+  state->xm = setup->xm;
+  state->xl = setup->xl;
+  state->xr = setup->xr;
+  state->c = setup->c;
+  state->laml = setup->laml;
+  state->lamr = setup->lamr;
+  state->p2 = setup->p2;
+  state->p3 = setup->p3;
+  state->p4 = setup->p4;
+  return rk_binomial(state, count, prob);
+}
+
+
 Binomial cnBinomialCreate(Random random, Count count, Float prob) {
   cnBinomialInfo* binomial;
 
@@ -75,6 +186,7 @@ Binomial cnBinomialCreate(Random random, Count count, Float prob) {
   binomial->count = count;
   binomial->prob = prob;
   binomial->random = random;
+  cnBinomialSetupInit(&binomial->setup, cnRandomState(random), count, prob);
 
   DONE:
   return (Binomial)binomial;
@@ -88,10 +200,9 @@ void cnBinomialDestroy(Binomial binomial) {
 
 Count cnBinomialSample(Binomial binomial) {
   cnBinomialInfo* info = (cnBinomialInfo*)binomial;
-  // TODO They only remember state for one binomial at a time in rk_state.
-  // TODO Consider adding support on our end for retaining that state in our own
-  // TODO cnBinomialInfo, to copy it into the rk_state.
-  return cnRandomBinomial(info->random, info->count, info->prob);
+  return cnBinomialSetupSample(
+    &info->setup, cnRandomState(info->random), info->count, info->prob
+  );
 }
 
 
@@ -180,6 +291,31 @@ bool cnGaussianInit(Gaussian* gaussian, Count dims, Float* mean) {
 }
 
 
+void cnListShuffle(ListAny* list, Random random) {
+  // I'd rather just do simple copies than fancy n-byte xors.
+  void* buffer = malloc(list->itemSize);
+  // Fisher-Yates shuffling from:
+  // http://en.wikipedia.org/wiki/Fisher%E2%80%93Yates_shuffle#
+  // The_modern_algorithm
+  Index i;
+  for (i = list->count - 1; i >= 1; i--) {
+    // Find where we're going.
+    void* a;
+    void* b;
+    Index j = rk_interval(i, cnRandomState(random));
+    if (i == j) continue;
+    a = ((char*)list->items) + (i * list->itemSize);
+    b = ((char*)list->items) + (j * list->itemSize);
+    // Perform the swap.
+    memcpy(buffer, a, list->itemSize);
+    memcpy(a, b, list->itemSize);
+    memcpy(b, buffer, list->itemSize);
+  }
+  // All done.
+  free(buffer);
+}
+
+
 Float cnMahalanobisDistance(Gaussian* gaussian, Float* point) {
   Float distance = 0;
   Count dims = gaussian->dims;
@@ -202,12 +338,18 @@ Float cnMahalanobisDistance(Gaussian* gaussian, Float* point) {
 }
 
 
-int cnMultinomialCreate_compareBinomials(const void *a, const void *b) {
-  cnMultiBinomial* binA = (cnMultiBinomial*)a;
-  cnMultiBinomial* binB = (cnMultiBinomial*)b;
-  // Higher probability means earlier in sequence for this.
-  return binA->prob > binB->prob ? -1 : binA->prob != binB->prob;
-}
+struct cnMultinomialCreate_BinomialsDown {
+  bool operator()(const cnMultiBinomial& a, const cnMultiBinomial& b) {
+    // Higher probability means earlier in sequence for this. Ties keep the
+    // class order.
+    return a.prob > b.prob || (a.prob == b.prob && a.index < b.index);
+  }
+};
+
+/**
+ * Caps the number of cached binomial setups per multinomial, about 4 MB.
+ */
+const Count cnMultinomialSetupLimit = 1 << 15;
 
 Multinomial cnMultinomialCreate(
   Random random, Count sampleCount, Count classCount, Float* probs
@@ -215,6 +357,7 @@ Multinomial cnMultinomialCreate(
   Index i;
   cnMultinomialInfo* info;
   Float probLeft;
+  Count setupCount;
 
   // Allocate and init basics.
   if (!(info = cnAlloc(cnMultinomialInfo, 1))) {
@@ -224,6 +367,7 @@ Multinomial cnMultinomialCreate(
   info->classCount = classCount;
   info->sampleCount = sampleCount;
   info->random = random;
+  info->setups = NULL;
 
   // Allocate binomial info.
   if (!(info->binomials = cnAlloc(cnMultiBinomial, classCount))) {
@@ -241,9 +385,9 @@ Multinomial cnMultinomialCreate(
   if (fabs(probLeft - 1.0) > 1e-6) {
     cnErrTo(FAIL, "Probs sum to %lg, not 1.", probLeft);
   }
-  qsort(
-    info->binomials, classCount, sizeof(cnMultiBinomial),
-    cnMultinomialCreate_compareBinomials
+  cnSort(
+    info->binomials, info->binomials + classCount,
+    cnMultinomialCreate_BinomialsDown()
   );
 
   // With that done, let's now create the conditional probabilities. Could skip
@@ -259,6 +403,25 @@ Multinomial cnMultinomialCreate(
     probLeft -= multiProb;
   }
 
+  // Precompute the setups, if they fit. The first class always sees all
+  // samples, but it doesn't seem worth special casing.
+  setupCount = (classCount - 1) * (sampleCount + 1);
+  if (setupCount > 0 && setupCount <= cnMultinomialSetupLimit) {
+    rk_state* state = cnRandomState(random);
+    if (!(info->setups = cnAlloc(cnBinomialSetup, setupCount))) {
+      cnErrTo(FAIL, "No binomial setups.");
+    }
+    for (i = 0; i < classCount - 1; i++) {
+      Float prob = info->binomials[i].prob;
+      cnBinomialSetup* setups = info->setups + i * (sampleCount + 1);
+      Count n;
+      if (!prob) continue;
+      for (n = 0; n <= sampleCount; n++) {
+        cnBinomialSetupInit(setups + n, state, n, prob);
+      }
+    }
+  }
+
   // Winned!
   goto DONE;
 
@@ -275,27 +438,80 @@ void cnMultinomialDestroy(Multinomial multinomial) {
   cnMultinomialInfo* info = (cnMultinomialInfo*)multinomial;
   if (info) {
     free(info->binomials);
+    free(info->setups);
     free(info);
   }
 }
 
 
-void cnMultinomialSample(Multinomial multinomial, Count* out) {
-  Count samplesLeft;
-  Index i;
+void cnMultinomialSample(
+  Multinomial multinomial, Count* out, Random random
+) {
+  cnMultinomialSampleMany(multinomial, 1, out, random);
+}
+
+
+void cnMultinomialSampleMany(
+  Multinomial multinomial, Count count, Count* out, Random random
+) {
   cnMultinomialInfo* info = (cnMultinomialInfo*)multinomial;
+  Count classCount = info->classCount;
+  Count* outEnd = out + count * classCount;
+  rk_state* state;
+  if (!random) random = info->random;
+  state = cnRandomState(random);
+
+  for (; out < outEnd; out += classCount) {
+    Index i;
+    // Binomial sample all but the last. Speed matters more for sampling.
+    Count samplesLeft = info->sampleCount;
+    for (i = 0; i < classCount - 1; i++) {
+      Float prob = info->binomials[i].prob;
+      Count successCount = 0;
+      if (prob) {
+        successCount = info->setups ?
+          cnBinomialSetupSample(
+            info->setups + i * (info->sampleCount + 1) + samplesLeft,
+            state, samplesLeft, prob
+          ) :
+          rk_binomial(state, samplesLeft, prob);
+      }
+      out[info->binomials[i].index] = successCount;
+      samplesLeft -= successCount;
+    }
+    // The last class gets all the remaining.
+    out[info->binomials[classCount - 1].index] = samplesLeft;
+  }
+}
+
+
+void cnMultinomialWeightedMoments(
+  Count sampleCount, Count classCount, Float* probs, Float* weights,
+  Float* mean, Float* variance
+) {
+  Index c;
+  Float classMean = 0;
+  Float classVariance = 0;
 
-  // Binomial sample all but the last. Speed matters more for sampling.
-  samplesLeft = info->sampleCount;
-  for (i = 0; i < info->classCount - 1; i++) {
-    Count successCount = info->binomials[i].prob ?
-      cnRandomBinomial(info->random, samplesLeft, info->binomials[i].prob) : 0;
-    out[info->binomials[i].index] = successCount;
-    samplesLeft -= successCount;
+  // Moments for a single sample, centered in a second pass for stability.
+  for (c = 0; c < classCount; c++) {
+    if (probs[c]) classMean += probs[c] * weights[c];
+  }
+  for (c = 0; c < classCount; c++) {
+    if (probs[c]) {
+      Float diff = weights[c] - classMean;
+      classVariance += probs[c] * diff * diff;
+    }
   }
 
-  // The last class gets all the remaining.
-  out[info->binomials[info->classCount - 1].index] = samplesLeft;
+  // Samples are independent, so both scale by the count.
+  *mean = sampleCount * classMean;
+  *variance = sampleCount * classVariance;
+}
+
+
+Float cnNormalCdf(Float x) {
+  return 0.5 * erfc(-x / sqrt(2.0));
 }
 
 
@@ -364,21 +580,21 @@ bool cnPermutations(
 }
 
 
-Random cnRandomCreate(void) {
-  rk_state* state;
+Random cnRandomCreate(unsigned long seed) {
+  cnRandomInfo* info;
 
-  if (!(state = cnAlloc(rk_state, 1))) cnErrTo(DONE, "No random.");
+  if (!(info = cnAlloc(cnRandomInfo, 1))) cnErrTo(DONE, "No random.");
   // TODO Is 0 a particularly bad seed?
-  rk_seed(0, state);
+  rk_seed(seed, &info->state);
+  info->key = seed;
 
   DONE:
-  return (Random)state;
+  return (Random)info;
 }
 
 
 Count cnRandomBinomial(Random random, Count count, Float prob) {
-  rk_state* state = (rk_state*)random;
-  return rk_binomial(state, count, prob);
+  return rk_binomial(cnRandomState(random), count, prob);
 }
 
 
@@ -387,6 +603,34 @@ void cnRandomDestroy(Random random) {
 }
 
 
+/**
+ * The SplitMix64 finalizer, which scrambles even nearby inputs thoroughly.
+ */
+uint64_t cnRandomSplit_mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+Random cnRandomSplit(Random random, unsigned long key) {
+  cnRandomInfo* info;
+  unsigned long initKey[2];
+  cnRandomInfo* parent = reinterpret_cast<cnRandomInfo*>(random);
+
+  if (!(info = cnAlloc(cnRandomInfo, 1))) cnErrTo(DONE, "No random.");
+  // Mix the key into the parent's, and fill the whole Mersenne Twister state
+  // from that, so even adjacent keys give unrelated streams.
+  info->key = cnRandomSplit_mix(parent->key ^ cnRandomSplit_mix(key));
+  initKey[0] = info->key & 0xffffffffUL;
+  initKey[1] = info->key >> 32;
+  init_by_array(&info->state, initKey, 2);
+
+  DONE:
+  return (Random)info;
+}
+
+
 Float cnScalarCovariance(
   Count count,
   Count skipA, Float* inA,
@@ -415,13 +659,8 @@ Float cnScalarVariance(Count count, Count skip, Float* in) {
 }
 
 
-Float cnUnitRand() {
-  // TODO This is a horrible implementation right now. Do much improvement!
-  Count value = rand();
-  // Despite the abuse, subtract 1 instead of adding to RAND_MAX, in case
-  // RAND_MAX is already at the cap before rollover.
-  if (value == RAND_MAX) value--;
-  return value / (Float)RAND_MAX;
+Float cnUnitRand(Random random) {
+  return rk_double(cnRandomState(random));
 }
 
 
@@ -35,9 +35,8 @@ typedef void* Multinomial;
 
 
 /**
- * A random stream with hidden state.
- *
- * TODO Are these threadsafe????
+ * A random stream with hidden state. Each stream is for one thread at a time,
+ * but cnRandomSplit hands out independent streams for parallel work.
  */
 typedef void* Random;
 
@@ -46,8 +45,8 @@ typedef void* Random;
  * Often count and prob are called n and p, respectively. There are count
  * samples drawn at a time, and prob is the probability of "success" for each.
  *
- * I have built this with the idea of allowing a setup process to prepare for
- * fast repeated sampling from the same distribution.
+ * The setup for fast repeated sampling from the same distribution happens once
+ * here and is kept with the binomial rather than only in the random state.
  *
  * Note that I'm experimenting with opaque types here.
  *
@@ -114,6 +113,14 @@ void cnGaussianDispose(Gaussian* gaussian);
 bool cnGaussianInit(Gaussian* gaussian, Count dims, Float* mean);
 
 
+/**
+ * Shuffles the list using the given random stream.
+ *
+ * TODO Simple unit test of this would be nice.
+ */
+void cnListShuffle(ListAny* list, Random random);
+
+
 /**
  * Calculates the mahalanobis distance from the mean of the gaussian to the
  * given point.
@@ -132,6 +139,9 @@ Float cnMahalanobisDistance(Gaussian* gaussian, Float* point);
  *
  * You must provide classCount probs, even though the final can be inferred.
  * TODO Remove this requirement?
+ *
+ * Binomial setups for each class and count of samples left are precomputed
+ * here, when they fit, so sampling doesn't redo them on every draw.
  */
 Multinomial cnMultinomialCreate(
   Random random, Count sampleCount, Count classCount, Float* probs
@@ -146,8 +156,42 @@ void cnMultinomialDestroy(Multinomial multinomial);
  *
  * We could provide one less, since the value is implied, but this seems more
  * convenient for users.
+ *
+ * Samples from the given random, or from the one given at creation if null.
+ * Sampling doesn't change the multinomial itself, so threads can share one by
+ * each providing its own random.
+ */
+void cnMultinomialSample(
+  Multinomial multinomial, Count* out, Random random = NULL
+);
+
+
+/**
+ * Draws count samples at once into out, one row of class counts after another,
+ * so out needs count times the class count. Otherwise the same as repeated
+ * calls to cnMultinomialSample, draws and all.
+ */
+void cnMultinomialSampleMany(
+  Multinomial multinomial, Count count, Count* out, Random random = NULL
+);
+
+
+/**
+ * The mean and variance of the sum of weights[c] * counts[c] over classes, for
+ * counts drawn from the multinomial with the given sampleCount and probs. These
+ * are exact, since the sum is linear in the counts. Classes with zero prob
+ * contribute nothing, even for infinite weights.
+ */
+void cnMultinomialWeightedMoments(
+  Count sampleCount, Count classCount, Float* probs, Float* weights,
+  Float* mean, Float* variance
+);
+
+
+/**
+ * The standard normal cumulative distribution function.
  */
-void cnMultinomialSample(Multinomial multinomial, Count* out);
+Float cnNormalCdf(Float x);
 
 
 /**
@@ -164,10 +208,8 @@ bool cnPermutations(
 
 /**
  * Creates a new random stream with a fixed seed.
- *
- * TODO Expose seed option here?
  */
-Random cnRandomCreate(void);
+Random cnRandomCreate(unsigned long seed = 0);
 
 
 /**
@@ -183,6 +225,18 @@ Count cnRandomBinomial(Random random, Count count, Float prob);
 void cnRandomDestroy(Random random);
 
 
+/**
+ * Creates a new stream, independent of the given one, and determined only by
+ * the seed and splits that led to the given stream plus the key here. The
+ * current state of the given stream doesn't matter, and it isn't changed, so
+ * splitting is safe from any thread, and results don't depend on timing.
+ *
+ * Use different keys, such as worker or task indices, for different streams.
+ * Splits can be split again.
+ */
+Random cnRandomSplit(Random random, unsigned long key);
+
+
 /**
  * The 1D variance of the given data.
  *
@@ -206,10 +260,8 @@ Float cnScalarVariance(Count count, Count skip, Float* in);
 /**
  * Generates a sample from a uniform distribution between 0 inclusive and 1
  * exclusive.
- *
- * TODO Random stream state management?
  */
-Float cnUnitRand();
+Float cnUnitRand(Random random);
 
 
 void vectorCov(void);
@@ -1,9 +1,12 @@
 #include <algorithm>
 #include <iostream>
 #include <string.h>
+#include <unordered_map>
+#include <vector>
 
 #include "io.h"
 #include "mat.h"
+#include "profile.h"
 #include "tree.h"
 
 using namespace std;
@@ -12,6 +15,12 @@ using namespace std;
 namespace concuno {
 
 
+/**
+ * Progress from building points for splits.
+ */
+static Log treeLog("tree");
+
+
 void cnLeafNodeInit(LeafNode* leaf);
 
 
@@ -90,7 +99,7 @@ void cnBindingBagListDrop(BindingBagList** list) {
   direct->refCount--;
   if (direct->refCount < 1) {
     if (direct->refCount < 0) {
-      printf("Negative refCount: %ld\n", direct->refCount);
+      logError("Negative refCount: %ld\n", direct->refCount);
     }
     cnListEachBegin(&direct->bindingBags, BindingBag, bindingBag) {
       bindingBag->~BindingBag();
@@ -291,7 +300,7 @@ void cnNodeDispose(Node* node) {
     cnVarNodeDispose((VarNode*)node);
     break;
   default:
-    printf("I don't handle type %u.\n", node->type);
+    logError("I don't handle type %u.\n", node->type);
     break;
   }
   // Base node disposal.
@@ -447,7 +456,7 @@ bool cnNodePropagateBindingBag(
       (VarNode*)node, bindingBag, leafBindingBags
     );
   default:
-    printf("I don't handle type %u for prop.\n", node->type);
+    logError("I don't handle type %u for prop.\n", node->type);
     return false;
   }
 }
@@ -527,7 +536,10 @@ void cnPointBagDispose(PointBag* pointBag) {
   if (pointBag) {
     // TODO Split out point matrix init?
     free(pointBag->bindingPointIndices);
-    free(pointBag->pointMatrix.points);
+    if (!pointBag->pointMatrix.pooled) free(pointBag->pointMatrix.points);
+    free(pointBag->pointMatrix.validBits);
+    free(pointBag->pointMatrix.validIndices);
+    free(pointBag->pointMatrix.singlePoints);
     cnPointBagInit(pointBag);
   }
 }
@@ -541,6 +553,99 @@ void cnPointBagInit(PointBag* pointBag) {
   pointBag->pointMatrix.valueSize = 0;
   pointBag->pointMatrix.points = NULL;
   pointBag->pointMatrix.pointCount = 0;
+  pointBag->pointMatrix.pooled = false;
+  pointBag->pointMatrix.validBits = NULL;
+  pointBag->pointMatrix.validIndices = NULL;
+  pointBag->pointMatrix.validCount = 0;
+  pointBag->pointMatrix.singlePoints = NULL;
+  pointBag->pointMatrix.singleScale = 0;
+}
+
+
+bool cnPointMatrixFindValid(PointMatrix* matrix) {
+  Count wordBits = 8 * sizeof(unsigned long);
+  // Allocate at least one of each, so null always means unfilled.
+  Count indexCount = matrix->pointCount ? matrix->pointCount : 1;
+  Count wordCount = (indexCount + wordBits - 1) / wordBits;
+  Index p;
+  Float* point = matrix->points;
+
+  free(matrix->validBits);
+  free(matrix->validIndices);
+  matrix->validCount = 0;
+  matrix->validBits = reinterpret_cast<unsigned long*>(
+    calloc(wordCount, sizeof(unsigned long))
+  );
+  matrix->validIndices = cnAlloc(Index, indexCount);
+  if (!(matrix->validBits && matrix->validIndices)) {
+    free(matrix->validBits);
+    free(matrix->validIndices);
+    matrix->validBits = NULL;
+    matrix->validIndices = NULL;
+    cnErrTo(FAIL, "No valid point tracking.");
+  }
+
+  // Check each point for NaNs.
+  for (p = 0; p < matrix->pointCount; p++, point += matrix->valueCount) {
+    bool allGood = true;
+    Float* value;
+    Float* pointEnd = point + matrix->valueCount;
+    for (value = point; value < pointEnd; value++) {
+      if (cnIsNaN(*value)) {
+        allGood = false;
+        break;
+      }
+    }
+    if (allGood) {
+      matrix->validBits[p / wordBits] |= 1UL << (p % wordBits);
+      matrix->validIndices[matrix->validCount++] = p;
+    }
+  }
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+bool cnPointMatrixMakeSingle(PointMatrix* matrix) {
+  Count valueCount = matrix->validCount * matrix->valueCount;
+  float* single;
+
+  // Allocate at least one, so null always means unmade.
+  if (!valueCount) valueCount = 1;
+  free(matrix->singlePoints);
+  if (!(matrix->singlePoints = cnAlloc(float, valueCount))) {
+    cnErrTo(FAIL, "No single points.");
+  }
+  single = matrix->singlePoints;
+  matrix->singleScale = 0;
+  for (Index v = 0; v < matrix->validCount; v++) {
+    Float* value = matrix->validPoint(v);
+    Float* pointEnd = value + matrix->valueCount;
+    for (; value < pointEnd; value++, single++) {
+      *single = static_cast<float>(*value);
+      matrix->singleScale = max(matrix->singleScale, fabs(*value));
+    }
+  }
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+PointPool::PointPool(): slab(NULL) {}
+
+
+PointPool::~PointPool() {
+  clear();
+}
+
+
+void PointPool::clear() {
+  free(slab);
+  slab = NULL;
 }
 
 
@@ -654,11 +759,10 @@ typedef struct cnSplitNodePointBag_Binding {
 
 } cnSplitNodePointBag_Binding;
 
-int cnSplitNodePointBag_compareBindings(const void* a, const void* b) {
-  cnSplitNodePointBag_Binding* bindingA =
-    reinterpret_cast<cnSplitNodePointBag_Binding*>(const_cast<void*>(a));
-  cnSplitNodePointBag_Binding* bindingB =
-    reinterpret_cast<cnSplitNodePointBag_Binding*>(const_cast<void*>(b));
+int cnSplitNodePointBag_compareBindings(
+  const cnSplitNodePointBag_Binding* bindingA,
+  const cnSplitNodePointBag_Binding* bindingB
+) {
   Index i;
   // Compare just on those indices we care about.
   for (i = 0; i < bindingA->split->function->inCount; i++) {
@@ -670,33 +774,33 @@ int cnSplitNodePointBag_compareBindings(const void* a, const void* b) {
   return 0;
 }
 
-PointBag* cnSplitNodePointBag(
+struct cnSplitNodePointBag_Less {
+  bool operator()(
+    const cnSplitNodePointBag_Binding& a, const cnSplitNodePointBag_Binding& b
+  ) {
+    int comparison = cnSplitNodePointBag_compareBindings(&a, &b);
+    // Fall back to original order, to keep equal bindings as they came.
+    return comparison ? comparison < 0 : a.index < b.index;
+  }
+};
+
+/**
+ * Sets the point count and any binding point indices for the bag, combining
+ * duplicate points.
+ */
+bool cnSplitNodePointBag_index(
   SplitNode* split, BindingBag* bindingBag, PointBag* pointBag
 ) {
-  Entity* args = NULL;
-  bool makeOwnPointBag = !pointBag;
   List<cnSplitNodePointBag_Binding> splitBindings;
-  void* values;
-  Count varDepth;
+  Count varDepth = cnNodeVarDepth(&split->node);
+  bool result = false;
 
-  // Init first.
-  varDepth = cnNodeVarDepth(&split->node);
-  BindingBag uniqueBag(0, varDepth);
-  // Make a point bag id needed, and init either way.
-  if (makeOwnPointBag) {
-    if (!(pointBag = cnAlloc(PointBag, 1))) {
-      cnErrTo(FAIL, "No point bag.");
-    }
-  } else if (pointBag->pointMatrix.points) {
-    // Failing to DONE on purpose here, so we don't free their data!
-    cnErrTo(DONE,
-      "Point bag has %ld points already!", pointBag->pointMatrix.pointCount
-    );
-  }
-  cnPointBagInit(pointBag);
   pointBag->bag = bindingBag->bag;
   pointBag->pointMatrix.valueCount = split->function->outCount;
   pointBag->pointMatrix.valueSize = split->function->outType->size;
+  // Null (dummy bindings) will yield NaN as needed, so every binding yields a
+  // point, unless combined below.
+  pointBag->pointMatrix.pointCount = bindingBag->bindings.count;
 
   // See if we have potential duplicate points. If so, combine them for
   // efficiency. This can speed things up a lot for deep areas of trees with
@@ -715,7 +819,7 @@ PointBag* cnSplitNodePointBag(
 
     // Prepare a list of split bindings. Needed for sorting.
     if (!cnListExpandMulti(&splitBindings, bindingBag->bindings.count)) {
-      cnErrTo(FAIL, "No split bindings.");
+      cnErrTo(DONE, "No split bindings.");
     }
     b = 0;
     splitBinding =
@@ -730,20 +834,17 @@ PointBag* cnSplitNodePointBag(
     // Track binding point indices, now that we know how many uniques we have.
     if (!(
       pointBag->bindingPointIndices = cnAlloc(Index, splitBindings.count)
-    )) cnErrTo(FAIL, "No binding point indices.");
+    )) cnErrTo(DONE, "No binding point indices.");
 
     // Sort them, and keep only uniques.
     // TODO Restore original order somehow (saving index for each)?
-    // TODO Make my own sort (and for lists), allowing helper data:
-    // TODO cnListSort(&bindings, split, cnSplitNodePointBag_compareBindings);
-    qsort(
-      splitBindings.items, splitBindings.count, splitBindings.itemSize,
-      cnSplitNodePointBag_compareBindings
+    cnSort(
+      &splitBindings.first(), &splitBindings.first() + splitBindings.count,
+      cnSplitNodePointBag_Less()
     );
 
     // Keep only the uniques.
     // TODO Generic 'cnUniques' function?
-    uniqueBag.bag = bindingBag->bag;
     // Track the indices of each binding and of the most recent point.
     p = -1;
     // Remember the most recently kept split binding for easy comparison.
@@ -756,9 +857,6 @@ PointBag* cnSplitNodePointBag(
         !mostRecentlyKept ||
         cnSplitNodePointBag_compareBindings(splitBinding, mostRecentlyKept)
       ) {
-        if (!cnListPush(&uniqueBag.bindings, splitBinding->binding)) {
-          cnErrTo(FAIL, "No unique binding.");
-        }
         // Increment our point index and remember this point for comparison.
         p++;
         mostRecentlyKept = splitBinding;
@@ -766,42 +864,116 @@ PointBag* cnSplitNodePointBag(
       // Use the original binding index, not the sorted one.
       pointBag->bindingPointIndices[splitBinding->index] = p;
     } cnEnd;
-
-    // Look at the one with uniques only.
-    bindingBag = &uniqueBag;
+    pointBag->pointMatrix.pointCount = p + 1;
   }
+  result = true;
+
+  DONE:
+  return result;
+}
+
+/**
+ * Calculates the points into the matrix, which must already have space for
+ * them, then finds which are valid.
+ */
+bool cnSplitNodePointBag_fill(
+  SplitNode* split, BindingBag* bindingBag, PointBag* pointBag
+) {
+  Entity* args = NULL;
+  Index b = 0;
+  vector<bool> filled;
+  bool result = false;
+  Count valueCount = pointBag->pointMatrix.valueCount;
 
-  // Prepare space for points.
-  // Null (dummy bindings) will yield NaN as needed, so every binding yields a
-  // point.
-  // TODO What about for non-float outputs???
-  pointBag->pointMatrix.pointCount = bindingBag->bindings.count;
-  if (!(pointBag->pointMatrix.points = reinterpret_cast<Float*>(malloc(
-    pointBag->pointMatrix.pointCount *
-    pointBag->pointMatrix.valueCount * pointBag->pointMatrix.valueSize
-  )))) cnErrTo(FAIL, "No point matrix.");
   // Put args on the stack.
   if (!(args = cnStackAllocOf(void*, split->function->inCount))) {
-    cnErrTo(FAIL, "No args.");
+    cnErrTo(DONE, "No args.");
+  }
+  if (pointBag->bindingPointIndices) {
+    filled.resize(pointBag->pointMatrix.pointCount);
   }
 
-  // Calculate the points.
-  values = pointBag->pointMatrix.points;
+  // Calculate the points. Combined bindings share args, so the first binding
+  // for each point is as good as any.
+  // TODO What about for non-float outputs???
   cnListEachBegin(&bindingBag->bindings, Entity, entities) {
+    Index p = b++;
+    if (pointBag->bindingPointIndices) {
+      p = pointBag->bindingPointIndices[p];
+      if (filled[p]) continue;
+      filled[p] = true;
+    }
     // Gather the arguments.
-    Index a;
-    for (a = 0; a < split->function->inCount; a++) {
+    for (Index a = 0; a < split->function->inCount; a++) {
       args[a] = entities[split->varIndices[a]];
     }
     // Call the function.
     // TODO Check for errors once we provide such things.
-    split->function->get(args, values);
-    // Move to the next vector.
-    values =
-      ((char*)values) +
-      pointBag->pointMatrix.valueCount * pointBag->pointMatrix.valueSize;
+    split->function->get(args, pointBag->pointMatrix.points + p * valueCount);
   } cnEnd;
 
+  // Find the valid points once, so no one else has to scan for NaNs.
+  if (!cnPointMatrixFindValid(&pointBag->pointMatrix)) {
+    cnErrTo(DONE, "No valid points found.");
+  }
+  result = true;
+
+  DONE:
+  cnStackFree(args);
+  return result;
+}
+
+/**
+ * Allocates cache-line aligned space for the given number of bytes, for easy
+ * vector loads. Free with free, as usual.
+ */
+Float* cnSplitNodePointBag_alloc(Count size) {
+  void* memory;
+  // Allocate something even for nothing, so null always means failure.
+  if (posix_memalign(&memory, 64, size ? size : 64)) return NULL;
+  return reinterpret_cast<Float*>(memory);
+}
+
+/**
+ * The bytes for the bag's points, rounded up to whole cache lines.
+ */
+Count cnSplitNodePointBag_alignedSize(PointBag* pointBag) {
+  Count size =
+    pointBag->pointMatrix.pointCount *
+    pointBag->pointMatrix.valueCount * pointBag->pointMatrix.valueSize;
+  return (size + 63) & ~Count(63);
+}
+
+PointBag* cnSplitNodePointBag(
+  SplitNode* split, BindingBag* bindingBag, PointBag* pointBag
+) {
+  bool makeOwnPointBag = !pointBag;
+
+  // Make a point bag id needed, and init either way.
+  if (makeOwnPointBag) {
+    if (!(pointBag = cnAlloc(PointBag, 1))) {
+      cnErrTo(FAIL, "No point bag.");
+    }
+  } else if (pointBag->pointMatrix.points) {
+    // Failing to DONE on purpose here, so we don't free their data!
+    cnErrTo(DONE,
+      "Point bag has %ld points already!", pointBag->pointMatrix.pointCount
+    );
+  }
+  cnPointBagInit(pointBag);
+
+  // Prepare space for points, then calculate them.
+  if (!cnSplitNodePointBag_index(split, bindingBag, pointBag)) {
+    cnErrTo(FAIL, "No point indices.");
+  }
+  if (!(pointBag->pointMatrix.points = cnSplitNodePointBag_alloc(
+    pointBag->pointMatrix.pointCount *
+    pointBag->pointMatrix.valueCount * pointBag->pointMatrix.valueSize
+  ))) cnErrTo(FAIL, "No point matrix.");
+  if (!cnSplitNodePointBag_fill(split, bindingBag, pointBag)) {
+    cnErrTo(FAIL, "No points.");
+  }
+
   // We winned.
   goto DONE;
 
@@ -815,7 +987,6 @@ PointBag* cnSplitNodePointBag(
   pointBag = NULL;
 
   DONE:
-  cnStackFree(args);
   return pointBag;
 }
 
@@ -823,16 +994,24 @@ PointBag* cnSplitNodePointBag(
 bool cnSplitNodePointBags(
   SplitNode* split,
   List<BindingBag>* bindingBags,
-  List<PointBag>* pointBags
+  List<PointBag>* pointBags,
+  PointPool* pool
 ) {
+  char* matrix;
   PointBag* pointBag;
   bool result = false;
+  Count size = 0;
+  ProfileTimer timer(Profile::PointBagsBuild);
   Count validBindingsCount = 0;
 
   // Init first for safety.
   if (pointBags->count) {
     cnErrTo(FAIL, "Start with empty pointBags, not %ld.", pointBags->count);
   }
+  if (pool->slab) {
+    // Failing to DONE on purpose here, so we don't free their data!
+    cnErrTo(DONE, "Start with an empty pool.");
+  }
   if (!cnListExpandMulti(pointBags, bindingBags->count)) {
     cnErrTo(FAIL, "No point bags.");
   }
@@ -840,24 +1019,42 @@ bool cnSplitNodePointBags(
   cnListEachBegin(bindingBags, BindingBag, bindingBag) {
     // Clear out each point bag for later filling.
     cnPointBagInit(pointBag);
-    // Null (dummy bindings) will yield NaN as needed.
-    // TODO What about for non-float outputs???
     // Next bag.
     pointBag++;
   } cnEnd;
 
+  // Find how many points each bag has, and lay them out in one slab. Each bag
+  // starts on a cache line.
+  pointBag = reinterpret_cast<PointBag*>(pointBags->items);
+  cnListEachBegin(bindingBags, BindingBag, bindingBag) {
+    if (!cnSplitNodePointBag_index(split, bindingBag, pointBag)) {
+      cnErrTo(FAIL, "No point indices.");
+    }
+    size += cnSplitNodePointBag_alignedSize(pointBag);
+    validBindingsCount += pointBag->pointMatrix.pointCount;
+    pointBag++;
+  } cnEnd;
+  if (!(pool->slab = cnSplitNodePointBag_alloc(size))) {
+    cnErrTo(FAIL, "No point pool.");
+  }
+
   // Now build the values.
   // TODO Actually, make an array of all the args and eliminate the duplicates!
   // TODO Dupes can come from bindings where only the non-args are unique.
+  matrix = reinterpret_cast<char*>(pool->slab);
   pointBag = reinterpret_cast<PointBag*>(pointBags->items);
   cnListEachBegin(bindingBags, BindingBag, bindingBag) {
-    if (!cnSplitNodePointBag(split, bindingBag, pointBag)) {
-      cnErrTo(FAIL, "No point bag.");
+    pointBag->pointMatrix.points = reinterpret_cast<Float*>(matrix);
+    pointBag->pointMatrix.pooled = true;
+    if (!cnSplitNodePointBag_fill(split, bindingBag, pointBag)) {
+      cnErrTo(FAIL, "No points.");
     }
-    validBindingsCount += pointBag->pointMatrix.pointCount;
+    matrix += cnSplitNodePointBag_alignedSize(pointBag);
     pointBag++;
   } cnEnd;
-  printf("Points built: %ld\n", validBindingsCount);
+  cnLogf(treeLog, "Points built: %ld\n", validBindingsCount);
+  cnProfileCount(Profile::PointBags, pointBags->count);
+  cnProfileCount(Profile::Points, validBindingsCount);
 
   // It all worked.
   result = true;
@@ -865,9 +1062,10 @@ bool cnSplitNodePointBags(
 
   FAIL:
   cnListEachBegin(pointBags, PointBag, pointBag) {
-    free(pointBag->pointMatrix.points);
+    cnPointBagDispose(pointBag);
   } cnEnd;
   cnListClear(pointBags);
+  pool->clear();
 
   DONE:
   return result;
@@ -930,21 +1128,10 @@ bool cnSplitNodePropagateBindingBag(
   pointsEnd = point +
     pointBag->pointMatrix.pointCount * pointBag->pointMatrix.valueCount;
   for (; point < pointsEnd; point += pointBag->pointMatrix.valueCount) {
-    // Check for error.
-    bool allGood = true;
-    Float* value = point;
-    Float* pointEnd = point + split->function->outCount;
+    // Choose the bag this point goes to, with NaNs meaning error.
     // TODO Let the function tell us instead of explicitly checking bad?
-    for (value = point; value < pointEnd; value++) {
-      if (cnIsNaN(*value)) {
-        allGood = false;
-        break;
-      }
-    }
-
-    // Choose the bag this point goes to.
     SplitNode::SplitIndex splitIndex;
-    if (!allGood) {
+    if (!pointBag->pointMatrix.valid(p)) {
       splitIndex = SplitNode::Err;
     } else {
       splitIndex = split->predicate->evaluate(point) ?
@@ -1076,7 +1263,7 @@ Node* cnTreeCopy(Node* node) {
     );
   }
   if (anyFailed) {
-    printf("Failed to copy kids!\n");
+    logError("Failed to copy kids!\n");
     // Kids should be either copies or null at this point.
     cnNodeDrop(copy);
     copy = NULL;
@@ -1096,15 +1283,14 @@ Float cnTreeLogMetric(RootNode* root, List<Bag>* bags) {
 }
 
 
-int cnTreeMaxLeafCounts_compareLeafProbsDown(const void* a, const void* b) {
-  LeafNode* leafA = ((LeafBindingBagGroup*)a)->leaf;
-  LeafNode* leafB = ((LeafBindingBagGroup*)b)->leaf;
-  return
-    // Smaller is higher here for downward sort.
-    leafA->probability < leafB->probability ? 1 :
-    leafA->probability == leafB->probability ? 0 :
-    -1;
-}
+struct cnTreeMaxLeafCounts_LeafProbsDown {
+  bool operator()(const LeafBindingBagGroup* a, const LeafBindingBagGroup* b) {
+    Float probA = a->leaf->probability;
+    Float probB = b->leaf->probability;
+    // Larger first for downward sort, and otherwise keep the original order.
+    return probA > probB || (probA == probB && a < b);
+  }
+};
 
 bool cnTreeMaxLeafCounts(
   RootNode* root, List<LeafCount>& counts, List<Bag>* bags
@@ -1120,6 +1306,7 @@ bool cnTreeMaxLeafCounts(
   // TODO Could be bit-efficient, since bools, but don't stress it.
   vector<bool> bagsUsed;
   bagsUsed.resize(bags->count, false);
+  vector<LeafBindingBagGroup*> sortedGroups;
 
   // Prepare space for counts at one go for efficiency.
   cnListClear(&counts);
@@ -1128,17 +1315,22 @@ bool cnTreeMaxLeafCounts(
   }
 
   // Sort the leaves down by probability. Not too many leaves, so no worries.
-  qsort(
-    groups.items, groups.count, groups.itemSize,
-    cnTreeMaxLeafCounts_compareLeafProbsDown
-  );
+  // Sort pointers, since the groups own their lists.
+  sortedGroups.resize(groups.count);
+  for (Index g = 0; g < groups.count; g++) sortedGroups[g] = &groups[g];
+  if (groups.count) {
+    cnSort(
+      &sortedGroups.front(), &sortedGroups.front() + groups.count,
+      cnTreeMaxLeafCounts_LeafProbsDown()
+    );
+  }
 
   // Loop through leaves from max prob to min, count bags and marking them used
   // along the way.
-  cnListEachBegin(&groups, LeafBindingBagGroup, group) {
+  for (Index g = 0; g < groups.count; g++) {
+    LeafBindingBagGroup* group = sortedGroups[g];
     // Init the count.
-    // TODO Loop providing item and index?
-    LeafCount& count = counts[group - &groups.first()];
+    LeafCount& count = counts[g];
     count.leaf = group->leaf;
     count.negCount = 0;
     count.posCount = 0;
@@ -1157,7 +1349,7 @@ bool cnTreeMaxLeafCounts(
       }
       bagsUsed[bagIndex] = true;
     } cnEnd;
-  } cnEnd;
+  }
   // All done!
   result = true;
 
@@ -1285,6 +1477,8 @@ void cnTreePropagateBags(
 ) {
   // Propagate for each bag.
   List<LeafBindingBag> leafBindingBags;
+  ProfileTimer timer(Profile::Propagate);
+  cnProfileCount(Profile::PropagatedBags, bags->count);
   cnListEachBegin(bags, Bag, bag) {
     // Propagate.
     if (!cnTreePropagateBag(tree, bag, &leafBindingBags)) {
@@ -1434,24 +1628,23 @@ bool cnVarNodeInit(VarNode* var, bool addLeaf) {
 }
 
 
-bool cnVarNodePropagate_pushBinding(
-  Entity* entitiesIn, BindingBag* bindingBagIn,
-  Entity entityOut, BindingBag* bindingBagOut, Count* bindingsOutCount
+/**
+ * Copies the binding's entities into each of the new bindings, which sit one
+ * after another, so each gets only its last entity set separately.
+ */
+void cnVarNodePropagate_copyPrefix(
+  Entity* entitiesIn, Count entityCount, Entity* entitiesOut, Count newCount
 ) {
-  Entity* entitiesOut =
-    reinterpret_cast<Entity*>(cnListExpand(&bindingBagOut->bindings));
-  if (!entitiesOut) return false;
-  (*bindingsOutCount)++;
-  // For the zero length arrays, I'm not sure if memcpy from null is
-  // okay, so check that first.
-  if (entitiesIn) {
+  Count sizeOut = entityCount + 1;
+  // For the zero length arrays, entitiesIn can be null, so check that first.
+  if (!entityCount) return;
+  memcpy(entitiesOut, entitiesIn, entityCount * sizeof(Entity));
+  // Later ones copy from the first, which is already warm in cache.
+  for (Index n = 1; n < newCount; n++) {
     memcpy(
-      entitiesOut, entitiesIn, bindingBagIn->entityCount * sizeof(void*)
+      entitiesOut + n * sizeOut, entitiesOut, entityCount * sizeof(Entity)
     );
   }
-  // Put the new one on.
-  entitiesOut[bindingBagIn->entityCount] = entityOut;
-  return true;
 }
 
 bool cnVarNodePropagateBindingBag(
@@ -1460,63 +1653,90 @@ bool cnVarNodePropagateBindingBag(
 ) {
   Index b;
   BindingBag bindingBagOut(bindingBag->bag, bindingBag->entityCount + 1);
-  Count bindingsOutCount = 0;
+  Count entityCount = bindingBag->entityCount;
+  List<Entity>* entitiesOut = NULL;
+  unordered_map<Entity, Index> indexOf;
+  vector<Index> optionIndices;
   bool result = false;
+  vector<unsigned long> used;
+  Count wordBits = 8 * sizeof(unsigned long);
 
   // Do we have anything to do?
   if (!var->kid) goto DONE;
 
+  // Figure out if we have constrained options. These are the same for every
+  // binding in the bag.
+  if (entityCount < bindingBag->bag->participantOptions.count) {
+    // We have this many participant lists available. Get our list.
+    entitiesOut = &bindingBag->bag->participantOptions[entityCount];
+  }
+  if (!(entitiesOut && entitiesOut->count)) {
+    // No constraints after all.
+    entitiesOut = bindingBag->bag->entities;
+  }
+
+  // Index the entities, so that used ones can be marked in a bit set rather
+  // than searched for in each binding for each option.
+  cnListEachBegin(bindingBag->bag->entities, Entity, entity) {
+    indexOf.insert(make_pair(*entity, Index(indexOf.size())));
+  } cnEnd;
+  cnListEachBegin(entitiesOut, Entity, entityOut) {
+    optionIndices.push_back(
+      indexOf.insert(make_pair(*entityOut, Index(indexOf.size()))).first->second
+    );
+  } cnEnd;
+  used.resize((indexOf.size() + wordBits - 1) / wordBits);
+
   // Find each binding to expand.
   // Use custom looping because of our abusive 2D-ish array.
   // TODO Normal looping really won't work here???
   for (b = 0; b < bindingBag->bindings.count; b++) {
-    Entity* entitiesIn = b < bindingBag->bindings.count ?
-      &bindingBag->bindings[b] : NULL;
-    bool anyLeft = false;
-    // Figure out if we have constrained options.
-    List<Entity>* entitiesOut = NULL;
-    if (bindingBag->entityCount < bindingBag->bag->participantOptions.count) {
-      // We have this many participant lists available. Get our list.
-      entitiesOut =
-        &bindingBag->bag->participantOptions[bindingBag->entityCount];
+    Entity* entitiesIn = &bindingBag->bindings[b];
+    Entity* bindingOut;
+    Count newCount = 0;
+
+    // Mark the entities in use. Any not indexed can't match options anyway.
+    for (Index e = 0; e < entityCount; e++) {
+      unordered_map<Entity, Index>::iterator found =
+        indexOf.find(entitiesIn[e]);
+      if (found != indexOf.end()) {
+        used[found->second / wordBits] |= 1UL << (found->second % wordBits);
+      }
     }
-    if (!(entitiesOut && entitiesOut->count)) {
-      // No constraints after all.
-      entitiesOut = bindingBag->bag->entities;
+
+    // Count the options left, then make room for them all at once. No
+    // entities left means a single dummy binding, for later errors.
+    for (Index o = 0; o < Count(optionIndices.size()); o++) {
+      Index i = optionIndices[o];
+      newCount += !((used[i / wordBits] >> (i % wordBits)) & 1);
     }
-    // Find the entities to add on.
-    cnListEachBegin(entitiesOut, Entity, entityOut) {
-      bool found = false;
-      Entity* entityIn = entitiesIn;
-      Entity* entitiesInEnd = entityIn + bindingBag->entityCount;
-      // TODO Loop okay since usually few vars?
-      for (; entityIn < entitiesInEnd; entityIn++) {
-        if (*entityIn == *entityOut) {
-          // Already used.
-          found = true;
-          break;
-        }
-      }
-      if (!found) {
-        // Didn't find it. Push a new binding with the new entity.
-        anyLeft = true;
-        if (!cnVarNodePropagate_pushBinding(
-          entitiesIn, bindingBag,
-          *entityOut, &bindingBagOut, &bindingsOutCount
-        )) {
-          // TODO Fail out!
-          printf("Failed to push binding!\n");
+    if (!(bindingOut = reinterpret_cast<Entity*>(cnListExpandMulti(
+      &bindingBagOut.bindings, newCount ? newCount : 1
+    )))) cnErrTo(DONE, "No new bindings.");
+    cnVarNodePropagate_copyPrefix(
+      entitiesIn, entityCount, bindingOut, newCount ? newCount : 1
+    );
+
+    // Put the new entities on the end.
+    bindingOut += entityCount;
+    if (newCount) {
+      Index o = 0;
+      cnListEachBegin(entitiesOut, Entity, entityOut) {
+        Index i = optionIndices[o++];
+        if (!((used[i / wordBits] >> (i % wordBits)) & 1)) {
+          *bindingOut = *entityOut;
+          bindingOut += entityCount + 1;
         }
-      }
-    } cnEnd;
-    if (!anyLeft) {
-      // Push a dummy binding for later errors since no entities remained.
-      if (!cnVarNodePropagate_pushBinding(
-        entitiesIn, bindingBag, NULL, &bindingBagOut, &bindingsOutCount
-      )) {
-        // TODO Fail out!
-        printf("Failed to push dummy binding!\n");
-      }
+      } cnEnd;
+    } else {
+      *bindingOut = NULL;
+    }
+
+    // Clear the marks for the next binding.
+    for (Index e = 0; e < entityCount; e++) {
+      unordered_map<Entity, Index>::iterator found =
+        indexOf.find(entitiesIn[e]);
+      if (found != indexOf.end()) used[found->second / wordBits] = 0;
     }
   }
 
@@ -76,6 +76,12 @@ struct PointMatrix {
    */
   Count pointCount;
 
+  /**
+   * Whether the points belong to a PointPool rather than to this matrix, in
+   * which case disposing the bag leaves them alone.
+   */
+  bool pooled;
+
   /**
    * An array of pointCount points of valueCount values each.
    *
@@ -101,6 +107,75 @@ struct PointMatrix {
    */
   Count valueSize;
 
+  /**
+   * One bit per point, set when the point has no NaN values. Built once with
+   * the points, so consumers needn't rescan values to decide.
+   */
+  unsigned long* validBits;
+
+  /**
+   * The indices of the valid points, in increasing order, for loops that want
+   * only those.
+   */
+  Index* validIndices;
+
+  /**
+   * The number of valid points.
+   */
+  Count validCount;
+
+  /**
+   * An optional single-precision copy of the valid points, packed in the same
+   * order as validIndices, or null if not made. Distance scans stream half the
+   * bytes through these.
+   */
+  float* singlePoints;
+
+  /**
+   * The largest absolute value among the single points, for bounding their
+   * rounding error.
+   */
+  Float singleScale;
+
+  /**
+   * Whether the point at the given index has no NaN values.
+   */
+  bool valid(Index point) const {
+    Count wordBits = 8 * sizeof(unsigned long);
+    return (validBits[point / wordBits] >> (point % wordBits)) & 1;
+  }
+
+  /**
+   * The point with the given index among the valid points.
+   */
+  Float* validPoint(Index v) const {
+    return points + validIndices[v] * valueCount;
+  }
+
+};
+
+
+/**
+ * One slab holding the points of many point bags, such as all those for a
+ * split. Each bag starts on a 64-byte boundary, so scans across bags stream
+ * through memory, vector loads are aligned, and cleanup is a single free.
+ */
+struct PointPool {
+
+  PointPool();
+
+  ~PointPool();
+
+  /**
+   * Frees the slab. Dispose of any bags pointing into it first.
+   */
+  void clear();
+
+  /**
+   * The aligned memory for all the points, or null if none yet.
+   */
+  Float* slab;
+
 };
 
 
@@ -466,6 +541,19 @@ void cnPointBagDispose(PointBag* pointBag);
 void cnPointBagInit(PointBag* pointBag);
 
 
+/**
+ * Fills in the valid bits and indices from the points, which must already be
+ * set. Only Float values are checked for now.
+ */
+bool cnPointMatrixFindValid(PointMatrix* matrix);
+
+
+/**
+ * Fills in singlePoints from the valid points, which must already be found.
+ */
+bool cnPointMatrixMakeSingle(PointMatrix* matrix);
+
+
 /**
  * Specify whether to add a leaf. That failing is the only reason root node
  * init would fail.
@@ -499,13 +587,17 @@ PointBag* cnSplitNodePointBag(
  * Fills the list of value bags with values according to the bindings and the
  * function at this node.
  *
+ * The points all go into the given pool, which should be empty. Dispose of the
+ * point bags before clearing or destroying the pool.
+ *
  * TODO Guaranteed to be in the same order as the binding bags and bindings,
  * TODO except for the duplicates issue.
  */
 bool cnSplitNodePointBags(
   SplitNode* split,
   List<BindingBag>* bindingBags,
-  List<PointBag>* pointBags
+  List<PointBag>* pointBags,
+  PointPool* pool
 );
 
 
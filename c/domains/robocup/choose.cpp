@@ -31,24 +31,48 @@ bool cnrChooseHoldsAndPasses(
   // certain amount. Better heuristics might improve labeling, but that might
   // also be too much assistance. What's best?
   Count failureLookahead = 8;
+  Count count = game->states.count;
+  // The keeper kicking in each state, if any, with room to spare for no states.
+  Player** kickers = NULL;
+  // For each state, the index of the first state at or after it with a keeper
+  // kick or with a new session, or count if none.
+  Index* nextBreaks = NULL;
+  Index* nextKicks = NULL;
   bool result = false;
+  State* states = reinterpret_cast<State*>(game->states.items);
 
-  // Loop through states.
-  cnListEachBegin(&game->states, State, state) {
-    // Look through players in each state to find kicks.
-    Player* kicker = NULL;
+  if (!(
+    (kickers = cnAlloc(Player*, (count + 1))) &&
+    (nextBreaks = cnAlloc(Index, (count + 1))) &&
+    (nextKicks = cnAlloc(Index, (count + 1)))
+  )) cnErrTo(DONE, "No indices.");
+
+  // Look through players in each state to find kicks.
+  for (Index s = 0; s < count; s++) {
+    State* state = states + s;
+    kickers[s] = NULL;
     //    if (state->newSession) {
     //      printf("New session at %ld.\n", state->time);
     //    }
     cnListEachBegin(&state->players, Player, player) {
       if (player->team == cnrTeamKeepers && !cnIsNaN(player->kickPower)) {
-        if (kicker) {
+        if (kickers[s]) {
           cnErrTo(DONE, "Multiple kickers at %ld.", state->time);
         }
-        kicker = player;
+        kickers[s] = player;
       }
     } cnEnd;
+  }
 
+  // Then back through for the next kicks and session breaks.
+  nextBreaks[count] = nextKicks[count] = count;
+  for (Index s = count - 1; s >= 0; s--) {
+    nextBreaks[s] = states[s].newSession ? s : nextBreaks[s + 1];
+    nextKicks[s] = kickers[s] ? s : nextKicks[s + 1];
+  }
+
+  // Loop through states.
+  for (Index s = 0; s < count; s++) {
     // If we have a kick and enough future, we can label this state. However,
     // don't label for any immediate switch to a new sessions. Without looking
     // at the kick action itself, we can't infer what action was intended.
@@ -58,51 +82,38 @@ bool cnrChooseHoldsAndPasses(
     // to interpreting the kick parameters themselves instead of looking at
     // resulting ball activity.
     //
-    if (kicker && state + failureLookahead < end && !(state + 1)->newSession) {
-      // Ooh. We have a next state. Look even further to see if keepers keep.
-      bool anyLaterKick = false;
-      bool label = true;
-      State* next;
-      State* lookaheadEnd = state + failureLookahead;
-      for (next = state + 1; next < end; next++) {
-        if (!anyLaterKick) {
-          cnListEachBegin(&next->players, Player, player) {
-            if (player->team == cnrTeamKeepers && !cnIsNaN(player->kickPower)) {
-              // Found another keeper kick. Still a positive label.
-              anyLaterKick = true;
-              break;
-            }
-          } cnEnd;
-        }
-        if (next->newSession) {
-          // Nope. We failed too soon. Must have made a bad choice.
-          label = false;
-          break;
-        }
-        if (anyLaterKick && next >= lookaheadEnd) {
-          // We've seen another kick from our team, and we've still not ended
-          // the session, so call it good.
-          //
-          // TODO Better would be to track how soon we our action is before the
-          // TODO failing action, but this will do for now.
-          //
-          break;
-        }
-      }
+    if (
+      kickers[s] && s + failureLookahead < count && !states[s + 1].newSession
+    ) {
+      // Look further to see if keepers keep. We need another keeper kick and
+      // to reach the lookahead without a new session, or else we must have
+      // made a bad choice and failed too soon.
+      //
+      // TODO Better would be to track how soon we our action is before the
+      // TODO failing action, but this will do for now.
+      //
+      Index laterKick = nextKicks[s + 1];
+      Index laterBreak = nextBreaks[s + 1];
+      Index goodEnough = laterKick == count ?
+        count : max(laterKick, s + failureLookahead);
+      bool label = laterBreak == count || laterBreak > goodEnough;
       // Now that all that label determination is over, let's build the scene.
       if (!cnrExtractHoldOrPass(
-        game, state, kicker, holdBags, passBags, entityLists, label
+        game, states + s, kickers[s], holdBags, passBags, entityLists, label
       )) cnErrTo(DONE, "No bag extracted.");
     }
 
     // Also look to see if the kick was "successful" in the sense that the
     // keepers still have the ball.
-  } cnEnd;
+  }
 
   // Winned.
   result = true;
 
   DONE:
+  free(kickers);
+  free(nextBreaks);
+  free(nextKicks);
   return result;
 }
 
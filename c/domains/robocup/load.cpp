@@ -1,7 +1,16 @@
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "load.h"
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
 using namespace concuno;
 using namespace std;
 
@@ -85,6 +94,125 @@ enum cnrParseMode {
 };
 
 
+/**
+ * Record modes for binary (version 2 and 3) rcg files, as in rcssserver's
+ * types.h. Each record starts with a big-endian short giving its mode. In
+ * version 2, the rest is always a whole dispinfo_t union, sized by its largest
+ * member, whatever the mode. Version 3 writes only the member for the mode.
+ */
+enum cnrRcgMode {
+
+  cnrRcgModeNone,
+
+  /**
+   * A showinfo_t (version 2) or short_showinfo_t2 (version 3).
+   */
+  cnrRcgModeShow,
+
+  /**
+   * A msginfo_t (version 2), with a board short then fixed chars, or (version
+   * 3) a board short, a length short, then that many chars.
+   */
+  cnrRcgModeMsg,
+
+  /**
+   * A drawinfo_t. Version 2 only.
+   */
+  cnrRcgModeDraw,
+
+  cnrRcgModeBlank,
+
+  /**
+   * A single char play mode. Version 3 only.
+   */
+  cnrRcgModePlayMode,
+
+  /**
+   * Two team_t. Version 3 only.
+   */
+  cnrRcgModeTeam,
+
+  /**
+   * A player_type_t. Version 3 only.
+   */
+  cnrRcgModePlayerType,
+
+  /**
+   * A server_params_t. Version 3 only.
+   */
+  cnrRcgModeServerParams,
+
+  /**
+   * A player_params_t. Version 3 only.
+   */
+  cnrRcgModePlayerParams,
+
+};
+
+
+// Binary record sizes and offsets in bytes, including struct padding, since
+// rcssserver writes whole structs.
+#define cnrRcgPlayerParamsSize 112
+#define cnrRcgPlayerTypeSize 88
+#define cnrRcgServerParamsSize 364
+#define cnrRcgTeamSize 18
+#define cnrRcgTeamNameSize 16
+
+// Version 2 dispinfo_t body, the size of its msginfo_t, the largest member.
+#define cnrRcgDisp2Size 2050
+
+// Version 2 showinfo_t, with 23 pos_t, the ball first.
+#define cnrRcgShow2PosOffset 38
+#define cnrRcgShow2PosSize 12
+#define cnrRcgShow2TeamOffset 2
+#define cnrRcgShow2TimeOffset 314
+
+// Version 3 short_showinfo_t2, with the ball then 22 player_t.
+#define cnrRcgShow3Size 1428
+#define cnrRcgShow3PlayerOffset 16
+#define cnrRcgShow3PlayerSize 64
+#define cnrRcgShow3TimeOffset 1424
+
+// Nesting beyond this in text lines is considered an error.
+#define cnrParseDepthMax 32
+
+// Fixed point scales for versions 2 and 3.
+#define cnrRcgScale2 16.0
+#define cnrRcgScale3 65536.0
+
+
+/**
+ * A token in a line of text. Parens are tokens by themselves. Quoted strings
+ * include the quotes, with end at the closing quote. Ids and numbers run to
+ * the next whitespace, paren, or quote.
+ */
+struct Token {
+
+  char* begin;
+
+  char* end;
+
+};
+
+
+/**
+ * Bit masks for a 64-byte block of text, one bit per byte, lowest bit first.
+ */
+struct TokenMasks {
+
+  /**
+   * Whitespace, parens, and quotes.
+   */
+  uint64_t delimiters;
+
+  /**
+   * Parens and quotes, which each start their own token.
+   */
+  uint64_t singles;
+
+};
+
+
 struct Parser {
 
   Parser();
@@ -119,38 +247,73 @@ struct Parser {
    */
   State* state;
 
+  /**
+   * Tokens for the current line, reused from line to line.
+   */
+  List<Token> tokens;
+
+};
+
+
+/**
+ * The fixed part of a state in a snapshot, with players following elsewhere.
+ */
+struct StateRecord {
+  Ball ball;
+  Count newSession;
+  Count playerCount;
+  Time subtime;
+  Time time;
 };
 
 
+/**
+ * Pushes the team names and states from the loaded snapshot into the empty
+ * game, returning false without changing the game if the snapshot doesn't hold
+ * a valid game.
+ */
+bool cnrLoadSnapshot(Game* game, Snapshot* snapshot);
+
+
 /**
  * Parses the contents of a parenthesized expression (or the top level of the
- * file). The open paren should already be consumed.
+ * line), up to and including the matching close paren. The open paren should
+ * already be consumed.
  */
-bool cnrParseContents(Parser* parser, char** line);
+bool cnrParseContents(Parser* parser, Token** token, Token* end);
 
 
 /**
  * An identifier following some kind of rules.
  */
-bool cnrParseId(Parser* parser, char** line);
+bool cnrParseId(Parser* parser, Token* token);
 
 
-bool cnrParseNumber(Parser* parser, char** line);
+/**
+ * A number, or an id if it doesn't parse as one.
+ */
+bool cnrParseNumber(Parser* parser, Token* token);
 
 
 /**
- * Parses a double-quote terminated string. The open double-quote should already
- * be consumed.
- *
- * Assumes no backslash escaping of anything and can therefore return pointers
- * into the original line. The closing double-quote will be replaced with a null
- * char.
- *
- * If there is no terminating null char, a null pointer is returned.
- *
- * TODO Are escapes really not supported?
+ * Parses the records of a binary (version 2 or 3) rcg file, from just after
+ * the "ULG" and version byte to the end.
  */
-char* cnrParseQuoted(Parser* parser, char** line);
+bool cnrParseRcgBinary(
+  Parser* parser, const char* begin, const char* end, int version
+);
+
+
+/**
+ * Pushes a new state for a binary show record, filling in time and subtime.
+ */
+bool cnrParseRcgBinaryState(Parser* parser, Time time);
+
+
+/**
+ * Records team names from consecutive team_t structs, as for text team lines.
+ */
+void cnrParseRcgBinaryTeams(Parser* parser, const char* teams);
 
 
 /**
@@ -162,7 +325,7 @@ bool cnrParseRcgLine(Parser* parser, char* line);
 /**
  * Parses all lines in the file. The rcg format is a line-oriented format.
  */
-bool cnrParseRcgLines(Parser* parser, FILE* file);
+bool cnrParseRcgLines(Parser* parser, FileMap* file);
 
 
 /**
@@ -193,14 +356,14 @@ bool cnrParserTriggerNumber(Parser* parser, Float number);
  * Parse a show command. The leading paren and the show token have both already
  * been consumed from the line.
  */
-bool cnrParseShow(Parser* parser, char* line);
+bool cnrParseShow(Parser* parser, Token* token, Token* end);
 
 
 /**
  * Parse a team command. The leading paren and the show token have both already
  * been consumed from the line.
  */
-bool cnrParseTeam(Parser* parser, char* line);
+bool cnrParseTeam(Parser* parser, Token* token, Token* end);
 
 
 void cnrRcgParserItemLocation(
@@ -208,44 +371,115 @@ void cnrRcgParserItemLocation(
 );
 
 
+/**
+ * Big-endian 32-bit signed int.
+ */
+Int cnrRcgLong(const char* data);
+
+
+/**
+ * Big-endian 16-bit signed int.
+ */
+Int cnrRcgShort(const char* data);
+
+
 bool cnrRclParseLine(Parser* parser, char* line);
 
 
+/**
+ * Writes the game for the snapshot. Team names are each a length and then the
+ * chars. State records then follow with all the players together at the end.
+ */
+bool cnrSaveSnapshot(Game* game, Snapshot* snapshot);
+
+
+/**
+ * Splits the line into parser->tokens, classifying bytes a block at a time.
+ */
+bool cnrTokenize(Parser* parser, char* line);
+
+
+/**
+ * Classifies a block of 64 bytes, with SIMD where available.
+ */
+void cnrTokenizeBlock(const char* block, TokenMasks* masks);
+
+
 bool cnrLoadCommandLog(Game* game, char* name) {
-  FILE* file = NULL;
-  String line;
+  char* at;
+  FileMap file;
+  String last;
+  char* line;
   Count lineCount = 0;
   Parser parser;
-  Count readCount;
   bool result = false;
 
   // Inits.
   parser.game = game;
   parser.state = reinterpret_cast<State*>(parser.game->states.items);
 
-  // Load file, and parse lines.
-  if (!(file = fopen(name, "r"))) cnErrTo(DONE, "Couldn't open file!");
-  // TODO Load the file, eh?
-  while ((readCount = cnReadLine(file, &line)) > 0) {
+  // Load file, and parse lines in place.
+  if (!file.map(name)) cnErrTo(DONE, "Couldn't open file!");
+  at = file.data;
+  while ((line = file.line(&at, &last))) {
     lineCount++;
-    if (!cnrRclParseLine(&parser, cnStr(&line))) {
+    if (!cnrRclParseLine(&parser, line)) {
       cnErrTo(DONE, "Failed parsing line %ld.", lineCount);
     }
   }
-  if (readCount < 0) cnErrTo(DONE, "Failed reading line.");
 
   // Winned.
   result = true;
 
   DONE:
-  if (file) fclose(file);
+  return result;
+}
+
+
+bool cnrLoadGame(Game* game, char* name) {
+  string commandName;
+  Snapshot snapshot("rcss-game");
+  bool result = false;
+
+  // Assume the command log is in the same place but named rcl instead of rcg.
+  snapshot.addSource(name);
+  if (cnStrEndsWith(name, ".rcg")) {
+    commandName = name;
+    commandName[commandName.size() - 1] = 'l';
+    snapshot.addSource(commandName.c_str());
+  }
+
+  // Skip the parsing if we have a snapshot.
+  if (snapshot.load() && cnrLoadSnapshot(game, &snapshot)) {
+    printf("Loaded snapshot for %s\n", name);
+    goto WIN;
+  }
+
+  // Load all the states in the game log, then look at the command log to see
+  // what actions were taken.
+  if (!cnrLoadGameLog(game, name)) cnErrTo(DONE, "Failed to load: %s", name);
+  if (!commandName.empty() && !cnrLoadCommandLog(game, &commandName[0])) {
+    cnErrTo(DONE, "Failed to load: %s", commandName.c_str());
+  }
+
+  // Save a snapshot for next time, if wanted. Failure here isn't fatal.
+  if (
+    snapshot.enabled && !(cnrSaveSnapshot(game, &snapshot) && snapshot.save())
+  ) printf("Failed to save snapshot for %s\n", name);
+
+  // Winned.
+  WIN:
+  result = true;
+
+  DONE:
   return result;
 }
 
 
 bool cnrLoadGameLog(Game* game, char* name) {
   FILE* file = NULL;
-  String line;
+  char header[4];
+  FileMap map;
   Parser parser;
   bool result = false;
 
@@ -253,26 +487,32 @@ bool cnrLoadGameLog(Game* game, char* name) {
   parser.game = game;
   if (!(file = fopen(name, "r"))) cnErrTo(DONE, "Couldn't open file!");
 
-  // Consume version indicator.
-  if (cnReadLine(file, &line) < 0) cnErrTo(DONE, "Failed first line.");
-  // Trim any newline.
-  // TODO Some "cnEndsWith" or something! Or just cnStringTrim!
-  if (line.count > 4 && cnStr(&line)[4] == '\n') {
-    cnStr(&line)[4] = '\0';
-    line.count--;
+  // Binary forms (versions 2 and 3) use a version byte rather than a digit
+  // and have no newline after, so check the raw header first.
+  if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+    cnErrTo(DONE, "No header.");
   }
-  // Check it.
-  // TODO Binary forms (versions 2 and 3) also start with ULG, but they might
-  // TODO not have trailing newline or white space, so we should just do fgetc
-  // TODO reads instead.
-  if (strcmp(cnStr(&line), "ULG5")) {
-    cnErrTo(DONE, "Unsupported file type or version: %s", cnStr(&line));
+  if (!strncmp(header, "ULG", 3) && (header[3] == 2 || header[3] == 3)) {
+    fclose(file);
+    file = NULL;
+    // Fixed-size records, so just map it all and go.
+    if (!map.map(name)) cnErrTo(DONE, "Couldn't map file!");
+    if (!cnrParseRcgBinary(
+      &parser, map.data + sizeof(header), map.data + map.size, header[3]
+    )) {
+      cnErrTo(DONE, "Failed parsing.");
+    }
+    goto WIN;
   }
 
-  // Parse everything.
-  if (!cnrParseRcgLines(&parser, file)) cnErrTo(DONE, "Failed parsing.");
+  // Text, so map it for parsing lines in place.
+  fclose(file);
+  file = NULL;
+  if (!map.map(name)) cnErrTo(DONE, "Couldn't map file!");
+  if (!cnrParseRcgLines(&parser, &map)) cnErrTo(DONE, "Failed parsing.");
 
   // Winned!
+  WIN:
   result = true;
 
   DONE:
@@ -281,56 +521,115 @@ bool cnrLoadGameLog(Game* game, char* name) {
 }
 
 
-bool cnrParseContents(Parser* parser, char** line) {
-  Index index = -1;
+bool cnrLoadSnapshot(Game* game, Snapshot* snapshot) {
+  const Count* header;
+  const Player* players;
+  Count playerCount = 0;
+  const StateRecord* records;
+  vector<string> teamNames;
+
+  // Check it all before pushing anything.
+  if (!(header = reinterpret_cast<const Count*>(
+    snapshot->read(4 * sizeof(Count))
+  ))) return false;
+  if (!(
+    header[0] == sizeof(Player) && header[1] == sizeof(StateRecord) &&
+    header[2] >= 0 && header[3] >= 0
+  )) return false;
+  for (Index t = 0; t < header[2]; t++) {
+    const Count* size;
+    const char* chars;
+    if (!(size = reinterpret_cast<const Count*>(
+      snapshot->read(sizeof(Count))
+    ))) return false;
+    if (!(chars = reinterpret_cast<const char*>(snapshot->read(*size)))) {
+      return false;
+    }
+    teamNames.push_back(string(chars, *size));
+  }
+  if (!(records = reinterpret_cast<const StateRecord*>(
+    snapshot->read(header[3] * sizeof(StateRecord))
+  ))) return false;
+  for (Index s = 0; s < header[3]; s++) playerCount += records[s].playerCount;
+  if (!(players = reinterpret_cast<const Player*>(
+    snapshot->read(playerCount * sizeof(Player))
+  ))) return false;
+
+  // All good, so fill in the game.
+  game->teamNames.swap(teamNames);
+  for (Index s = 0; s < header[3]; s++) {
+    const StateRecord& record = records[s];
+    State* state;
+    if (!(state = reinterpret_cast<State*>(cnListExpand(&game->states)))) {
+      throw Error("Failed to expand states for snapshot.");
+    }
+    new(state) State;
+    state->ball = record.ball;
+    state->newSession = record.newSession;
+    state->subtime = record.subtime;
+    state->time = record.time;
+    if (
+      record.playerCount &&
+      !cnListPushMulti(&state->players, players, record.playerCount)
+    ) throw Error("Failed to push snapshot players.");
+    players += record.playerCount;
+  }
+  return true;
+}
+
+
+bool cnrParseContents(Parser* parser, Token** token, Token* end) {
+  // Indices for each level of nesting, with depth 0 as the starting level.
+  Index indices[cnrParseDepthMax];
+  Index depth = 0;
   bool result = false;
 
+  indices[0] = -1;
   if (!cnrParserTriggerContentsBegin(parser)) {
     cnErrTo(DONE, "Failed begin trigger.");
   }
-  while (*(*line = cnNextChar(*line)) && **line != ')') {
-    char c = **line;
-    // Set the index with each loop iteration. The C stack will help us be
-    // where we need to be otherwise.
-    parser->index = ++index;
+  while (true) {
+    if (*token >= end || *(*token)->begin == ')') {
+      if (*token >= end && parser->mode != cnrParseModeCommand) {
+        // Contents should end in ')' except for the top level of commands.
+        cnErrTo(DONE, "Premature end of line.");
+      }
+      // Good to go. Move on.
+      if (*token < end) (*token)++;
+      if (!cnrParserTriggerContentsEnd(parser)) {
+        cnErrTo(DONE, "Failed end trigger.");
+      }
+      if (!depth--) break;
+      continue;
+    }
+
+    // Set the index with each new item.
+    parser->index = ++indices[depth];
 
     // Now see what to do next.
-    switch (c) {
+    switch (*(*token)->begin) {
     case '(':
       // Nested parens.
-      (*line)++;
-      if (!cnrParseContents(parser, line)) {
-        cnErrTo(DONE, "Failed parsing contents.");
+      if (++depth >= cnrParseDepthMax) cnErrTo(DONE, "Nested too deep.");
+      indices[depth] = -1;
+      if (!cnrParserTriggerContentsBegin(parser)) {
+        cnErrTo(DONE, "Failed begin trigger.");
       }
       break;
     case '"':
-      // Double-quoted string.
-      (*line)++;
-      if (!cnrParseQuoted(parser, line)) {
-        cnErrTo(DONE, "Failed parsing string.");
-      }
+      // Double-quoted string. Nothing cares about these so far.
+      break;
+    case '-': case '.':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      if (!cnrParseNumber(parser, *token)) cnErrTo(DONE, "Failed number.");
       break;
     default:
-      // Something else.
-      if (('0' <= c && c <= '9') || c == '.' || c == '-') {
-        // Number.
-        if (!cnrParseNumber(parser, line)) cnErrTo(DONE, "Failed number.");
-      } else {
-        // Treat anything else as an identifier.
-        if (!cnrParseId(parser, line)) cnErrTo(DONE, "Failed number.");
-      }
+      // Treat anything else as an identifier.
+      if (!cnrParseId(parser, *token)) cnErrTo(DONE, "Failed id.");
       break;
     }
-  }
-  if (**line != ')' && parser->mode != cnrParseModeCommand) {
-    // Contents should end in ')' except for the top level of commands.
-    cnErrTo(DONE, "Premature end of line.");
-  }
-
-  // Good to go. Move on.
-  (*line)++;
-  if (!cnrParserTriggerContentsEnd(parser)) {
-    cnErrTo(DONE, "Failed end trigger.");
+    (*token)++;
   }
 
   // Winned.
@@ -341,45 +640,170 @@ bool cnrParseContents(Parser* parser, char** line) {
 }
 
 
-bool cnrParseId(Parser* parser, char** line) {
-  char c;
-  char* id = *line;
-  bool result = false;
-  bool triggerResult;
-
-  // Parse and handle.
-  for (; **line && !(isspace(**line) || **line == ')'); (*line)++) {}
-
+bool cnrParseId(Parser* parser, Token* token) {
   // Remember the old char for reverting, then chop to a string.
-  c = **line;
-  **line = '\0';
-  // Trigger and revert.
-  triggerResult = cnrParserTriggerId(parser, id);
-  **line = c;
-  // Only check failure after revert.
-  if (!triggerResult) cnErrTo(DONE, "Failed id trigger.");
+  char c = *token->end;
+  bool result;
 
-  // Winned.
-  result = true;
+  *token->end = '\0';
+  result = cnrParserTriggerId(parser, token->begin);
+  *token->end = c;
+  // Only check failure after revert.
+  if (!result) cnErrTo(FAIL, "Failed id trigger.");
+  return true;
 
-  DONE:
-  return result;
+  FAIL:
+  return false;
 }
 
 
-bool cnrParseNumber(Parser* parser, char** line) {
+bool cnrParseNumber(Parser* parser, Token* token) {
   char* end;
   Float number;
-  bool result = false;
 
-  // Parse the number.
-  number = strtod(*line, &end);
-  if (!end) cnErrTo(DONE, "No number.");
-  *line = end;
+  // Show item kids, such as view mode and stamina, ignore numbers, and they
+  // make up much of each show, so don't bother parsing there.
+  if (parser->mode == cnrParseModeShowItemKid) return true;
+
+  // Parse the number, or fall back to an id for things like a lone '-'.
+  number = cnParseFloat(token->begin, &end);
+  if (end == token->begin) return cnrParseId(parser, token);
+  if (end != token->end) {
+    cnErrTo(
+      FAIL, "Bad number: %.*s", (int)(token->end - token->begin), token->begin
+    );
+  }
 
   // Handle it.
   if (!cnrParserTriggerNumber(parser, number)) {
-    cnErrTo(DONE, "Failed number trigger.");
+    cnErrTo(FAIL, "Failed number trigger.");
+  }
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+bool cnrParseRcgBinary(
+  Parser* parser, const char* begin, const char* end, int version
+) {
+  const char* at = begin;
+  bool result = false;
+
+  while (at < end) {
+    Ball* ball;
+    Count size;
+    Index i;
+    if (end - at < 2) cnErrTo(DONE, "Partial record at %ld.", at - begin);
+    cnrRcgMode mode = (cnrRcgMode)cnrRcgShort(at);
+    const char* record = at + 2;
+
+    // Find the size first, so every case gets bounds checked the same.
+    if (version == 2) {
+      // Every record is a whole dispinfo_t, with no play modes or teams.
+      if (mode < cnrRcgModeNone || mode > cnrRcgModeDraw) {
+        cnErrTo(DONE, "Unknown record mode %d at %ld.", mode, at - begin);
+      }
+      size = cnrRcgDisp2Size;
+    } else switch (mode) {
+    case cnrRcgModeShow:
+      size = cnrRcgShow3Size;
+      break;
+    case cnrRcgModeMsg:
+      // Board and length shorts then the message.
+      size = 4;
+      if (end - record >= size) size += cnrRcgShort(record + 2);
+      break;
+    case cnrRcgModeBlank:
+      size = 0;
+      break;
+    case cnrRcgModePlayMode:
+      size = 1;
+      break;
+    case cnrRcgModeTeam:
+      size = 2 * cnrRcgTeamSize;
+      break;
+    case cnrRcgModePlayerType:
+      size = cnrRcgPlayerTypeSize;
+      break;
+    case cnrRcgModeServerParams:
+      size = cnrRcgServerParamsSize;
+      break;
+    case cnrRcgModePlayerParams:
+      size = cnrRcgPlayerParamsSize;
+      break;
+    default:
+      cnErrTo(DONE, "Unknown record mode %d at %ld.", mode, at - begin);
+    }
+    if (size < 0 || end - record < size) {
+      cnErrTo(DONE, "Truncated record at %ld.", at - begin);
+    }
+    at = record + size;
+
+    // Now handle what we care about.
+    switch (mode) {
+    case cnrRcgModeShow:
+      if (version == 2) {
+        // Teams come with each show, and time is at the end.
+        const char* pos = record + cnrRcgShow2PosOffset;
+        cnrParseRcgBinaryTeams(parser, record + cnrRcgShow2TeamOffset);
+        if (!cnrParseRcgBinaryState(
+          parser, cnrRcgShort(record + cnrRcgShow2TimeOffset)
+        )) cnFailTo(DONE);
+        // Ball first, with shorts enable, side, unum, angle, x, y.
+        ball = &parser->state->ball;
+        ball->location[0] = cnrRcgShort(pos + 8) / cnrRcgScale2;
+        ball->location[1] = cnrRcgShort(pos + 10) / cnrRcgScale2;
+        for (i = 1; i < 23; i++) {
+          pos += cnrRcgShow2PosSize;
+          // Skip disabled players, as for the text format.
+          if (!cnrRcgShort(pos)) continue;
+          Player* player =
+            reinterpret_cast<Player*>(cnListExpand(&parser->state->players));
+          if (!player) cnErrTo(DONE, "No player.");
+          new(player) Player();
+          // Side is 1 for left and -1 for right.
+          player->team = cnrRcgShort(pos + 2) > 0 ? cnrTeamLeft : cnrTeamRight;
+          player->index = cnrRcgShort(pos + 4);
+          player->orientation = cnrRcgShort(pos + 6);
+          player->location[0] = cnrRcgShort(pos + 8) / cnrRcgScale2;
+          player->location[1] = cnrRcgShort(pos + 10) / cnrRcgScale2;
+        }
+      } else {
+        // Ball first, with longs x, y, vx, vy.
+        const char* pos = record + cnrRcgShow3PlayerOffset;
+        if (!cnrParseRcgBinaryState(
+          parser, cnrRcgShort(record + cnrRcgShow3TimeOffset)
+        )) cnFailTo(DONE);
+        ball = &parser->state->ball;
+        ball->location[0] = cnrRcgLong(record) / cnrRcgScale3;
+        ball->location[1] = cnrRcgLong(record + 4) / cnrRcgScale3;
+        // Players have shorts mode and type, then longs x, y, vx, vy, body
+        // angle, and so on. Left are first, numbered by position.
+        for (i = 0; i < 22; i++, pos += cnrRcgShow3PlayerSize) {
+          if (!cnrRcgShort(pos)) continue;
+          Player* player =
+            reinterpret_cast<Player*>(cnListExpand(&parser->state->players));
+          if (!player) cnErrTo(DONE, "No player.");
+          new(player) Player();
+          player->team = i < 11 ? cnrTeamLeft : cnrTeamRight;
+          player->index = i % 11 + 1;
+          // Radians here but degrees in text, so convert.
+          player->orientation =
+            cnrRcgLong(pos + 20) / cnrRcgScale3 * 180 / M_PI;
+          player->location[0] = cnrRcgLong(pos + 4) / cnrRcgScale3;
+          player->location[1] = cnrRcgLong(pos + 8) / cnrRcgScale3;
+        }
+      }
+      break;
+    case cnrRcgModeTeam:
+      cnrParseRcgBinaryTeams(parser, record);
+      break;
+    default:
+      // Nothing we need here.
+      break;
+    }
   }
 
   // Winned.
@@ -390,51 +814,73 @@ bool cnrParseNumber(Parser* parser, char** line) {
 }
 
 
-char* cnrParseQuoted(Parser* parser, char** line) {
-  // Assume we got it.
-  char* result = *line;
-
-  for (; **line != '"'; (*line)++) {
-    if (!**line) {
-      // Nope. Failed.
-      result = NULL;
-      cnErrTo(DONE, "Unterminated string.");
-    }
+bool cnrParseRcgBinaryState(Parser* parser, Time time) {
+  if (!(
+    parser->state =
+      reinterpret_cast<State*>(cnListExpand(&parser->game->states))
+  )) {
+    cnErrTo(FAIL, "No new state.");
   }
+  new(parser->state) State();
+  parser->state->time = time;
+  if (parser->game->states.count > 1) {
+    // Subtime is only implicit in rcg files, as for text.
+    State* previous = parser->state - 1;
+    if (previous->time == time) parser->state->subtime = previous->subtime + 1;
+  }
+  return true;
 
-  // Found the end. Mark it and go past.
-  **line = '\0';
-  (**line)++;
+  FAIL:
+  return false;
+}
 
-  DONE:
-  return result;
+
+void cnrParseRcgBinaryTeams(Parser* parser, const char* teams) {
+  for (Team team = 0; team < 2; team++) {
+    // Names are null padded, but they might fill the whole space.
+    const char* name = teams + team * cnrRcgTeamSize;
+    size_t length = strnlen(name, cnrRcgTeamNameSize);
+    // Push in order only, as for text, and skip blanks from before connect.
+    if (!length || parser->game->teamNames.size() != team) break;
+    parser->game->teamNames.push_back(string(name, length));
+  }
 }
 
 
 bool cnrParseRcgLine(Parser* parser, char* line) {
   bool result = false;
-  char* type;
+  Token* end;
+  Token* token;
+  Count length;
+
+  if (!cnrTokenize(parser, line)) cnErrTo(DONE, "Failed to tokenize.");
+  token = reinterpret_cast<Token*>(parser->tokens.items);
+  end = token + parser->tokens.count;
 
   // Make sure we have a paren.
-  line = cnNextChar(line);
-  if (!*line) {
+  if (token >= end) {
     // Empty line. That's okay.
     goto SUCCESS;
   }
-  if (*line != '(') cnErrTo(DONE, "Expected '('.");
-  line++;
+  if (*token->begin != '(') cnErrTo(DONE, "Expected '('.");
+  token++;
 
   // Get our line type.
-  type = cnParseStr(line, &line);
-  if (!*type) cnErrTo(DONE, "No line type.");
+  if (token >= end || strchr("()\"", *token->begin)) {
+    cnErrTo(DONE, "No line type.");
+  }
+  length = token->end - token->begin;
 
-  // Dispatch by type. TODO Hash table? Anything other than show?
-  if (!strcmp(type, "show")) {
-    if (!cnrParseShow(parser, line)) cnErrTo(DONE, "Failed to parse show.");
-  } else if (!strcmp(type, "team")) {
-    if (!cnrParseTeam(parser, line)) cnErrTo(DONE, "Failed to parse show.");
+  // Dispatch by type. Anything other than show and team?
+  if (length == 4 && !memcmp(token->begin, "show", 4)) {
+    if (!cnrParseShow(parser, token + 1, end)) {
+      cnErrTo(DONE, "Failed to parse show.");
+    }
+  } else if (length == 4 && !memcmp(token->begin, "team", 4)) {
+    if (!cnrParseTeam(parser, token + 1, end)) {
+      cnErrTo(DONE, "Failed to parse team.");
+    }
   }
-  // TODO (team 1 WrightEagle HELIOS2011 0 0)
 
   // Winned.
   SUCCESS:
@@ -445,19 +891,27 @@ bool cnrParseRcgLine(Parser* parser, char* line) {
 }
 
 
-bool cnrParseRcgLines(Parser* parser, FILE* file) {
-  String line;
+bool cnrParseRcgLines(Parser* parser, FileMap* file) {
+  char* at = file->data;
+  String last;
+  char* line;
   Count lineCount = 0;
-  Count readCount;
   bool result = false;
 
-  while ((readCount = cnReadLine(file, &line)) > 0) {
+  // Check the version indicator.
+  if (!(line = file->line(&at, &last))) cnErrTo(DONE, "Failed first line.");
+  if (strcmp(line, "ULG5")) {
+    cnErrTo(DONE, "Unsupported file type or version: %s", line);
+  }
+  lineCount++;
+
+  // Parse the rest.
+  while ((line = file->line(&at, &last))) {
     lineCount++;
-    if (!cnrParseRcgLine(parser, cnStr(&line))) {
+    if (!cnrParseRcgLine(parser, line)) {
       cnErrTo(DONE, "Failed parsing line %ld.", lineCount);
     }
   }
-  if (readCount < 0) cnErrTo(DONE, "Failed reading line.");
 
   // Winned.
   result = true;
@@ -712,7 +1166,7 @@ bool cnrParserTriggerNumber(Parser* parser, Float number) {
 }
 
 
-bool cnrParseShow(Parser* parser, char* line) {
+bool cnrParseShow(Parser* parser, Token* token, Token* end) {
   bool result = false;
 
   // Prepare a new state to work with.
@@ -726,7 +1180,7 @@ bool cnrParseShow(Parser* parser, char* line) {
 
   // Parse through the rest.
   parser->mode = cnrParseModeTopShow;
-  if (!cnrParseContents(parser, &line)) {
+  if (!cnrParseContents(parser, &token, end)) {
     cnErrTo(DONE, "Failed parsing line content.");
   }
   //printf("\n");
@@ -740,12 +1194,12 @@ bool cnrParseShow(Parser* parser, char* line) {
 }
 
 
-bool cnrParseTeam(Parser* parser, char* line) {
+bool cnrParseTeam(Parser* parser, Token* token, Token* end) {
   bool result = false;
 
   // Parse through the rest.
   parser->mode = cnrParseModeTopTeam;
-  if (!cnrParseContents(parser, &line)) {
+  if (!cnrParseContents(parser, &token, end)) {
     cnErrTo(DONE, "Failed parsing line content.");
   }
   //printf("\n");
@@ -768,6 +1222,20 @@ void cnrRcgParserItemLocation(
 }
 
 
+Int cnrRcgLong(const char* data) {
+  int32_t value;
+  memcpy(&value, data, sizeof(value));
+  return (int32_t)ntohl(value);
+}
+
+
+Int cnrRcgShort(const char* data) {
+  int16_t value;
+  memcpy(&value, data, sizeof(value));
+  return (int16_t)ntohs(value);
+}
+
+
 bool cnrRclParseLine(Parser* parser, char* line) {
   Index playerIndex;
   bool result = false;
@@ -776,6 +1244,7 @@ bool cnrRclParseLine(Parser* parser, char* line) {
   Team team;
   Index time;
   char* token;
+  Token* tokens;
 
   // Format: time,subtime\t(Recv|\(...\)) TeamName_N: (command (content))
   if (!cnDelimitInt(&line, NULL, &time, ',')) cnErrTo(DONE, "No time.");
@@ -812,9 +1281,10 @@ bool cnrRclParseLine(Parser* parser, char* line) {
   // Check for non-player lines.
   if (*line == '(') {
     // Skip the paren for content parsing.
-    line++;
+    if (!cnrTokenize(parser, line + 1)) cnErrTo(DONE, "Failed to tokenize.");
+    tokens = reinterpret_cast<Token*>(parser->tokens.items);
     parser->mode = cnrParseModeTopCommandNonPlayer;
-    if (!cnrParseContents(parser, &line)) {
+    if (!cnrParseContents(parser, &tokens, tokens + parser->tokens.count)) {
       cnErrTo(DONE, "Failed parsing non-player line.");
     }
     goto WIN;
@@ -853,8 +1323,10 @@ bool cnrRclParseLine(Parser* parser, char* line) {
   if (!parser->item) cnErrTo(DONE, "No player %zu/%ld.", team, playerIndex);
 
   // Parse deeper for kicks (literally).
+  if (!cnrTokenize(parser, line)) cnErrTo(DONE, "Failed to tokenize.");
+  tokens = reinterpret_cast<Token*>(parser->tokens.items);
   parser->mode = cnrParseModeTopCommand;
-  if (!cnrParseContents(parser, &line)) {
+  if (!cnrParseContents(parser, &tokens, tokens + parser->tokens.count)) {
     cnErrTo(DONE, "Failed command contents.");
   }
 
@@ -866,5 +1338,202 @@ bool cnrRclParseLine(Parser* parser, char* line) {
 }
 
 
+bool cnrSaveSnapshot(Game* game, Snapshot* snapshot) {
+  Count count = game->states.count;
+  Count header[] = {
+    sizeof(Player), sizeof(StateRecord), (Count)game->teamNames.size(), count
+  };
+  StateRecord* records;
+  bool result = false;
+
+  if (!(records = cnAlloc(StateRecord, count)) && count) return false;
+  if (!snapshot->write(header, sizeof(header))) goto DONE;
+  for (size_t t = 0; t < game->teamNames.size(); t++) {
+    const string& name = game->teamNames[t];
+    Count size = name.size();
+    if (!(
+      snapshot->write(&size, sizeof(size)) &&
+      snapshot->write(name.data(), size)
+    )) goto DONE;
+  }
+  for (Index s = 0; s < count; s++) {
+    State& state = game->states[s];
+    new(records + s) StateRecord;
+    records[s].ball = state.ball;
+    records[s].newSession = state.newSession;
+    records[s].playerCount = state.players.count;
+    records[s].subtime = state.subtime;
+    records[s].time = state.time;
+  }
+  if (!snapshot->write(records, count * sizeof(StateRecord))) goto DONE;
+  // Players hold doubles, so there's no padding between states.
+  for (Index s = 0; s < count; s++) {
+    List<Player>& players = game->states[s].players;
+    if (!snapshot->write(players.items, players.count * sizeof(Player))) {
+      goto DONE;
+    }
+  }
+
+  // Winned.
+  result = true;
+
+  DONE:
+  free(records);
+  return result;
+}
+
+
+bool cnrTokenize(Parser* parser, char* line) {
+  // Pending id or number start, if any.
+  char* atom = NULL;
+  // Whether the byte before the current block was a delimiter.
+  uint64_t carry = 1;
+  char* end = line + strlen(line);
+  // Bytes before this are inside quotes already handled.
+  char* skip = line;
+  Token* token;
+
+  // Reserve the most tokens possible, one per byte, to push without checks.
+  cnListClear(&parser->tokens);
+  if (!cnListExpandMulti(&parser->tokens, end - line + 1)) {
+    cnErrTo(FAIL, "No tokens.");
+  }
+  token = reinterpret_cast<Token*>(parser->tokens.items);
+  for (char* block = line; block < end; block += 64) {
+    TokenMasks masks;
+    uint64_t bits;
+    uint64_t ends;
+    uint64_t starts;
+
+    // Classify, padding the tail with spaces to end any last atom.
+    if (end - block >= 64) {
+      cnrTokenizeBlock(block, &masks);
+    } else {
+      char padded[64];
+      memset(padded, ' ', sizeof(padded));
+      memcpy(padded, block, end - block);
+      cnrTokenizeBlock(padded, &masks);
+    }
+    starts = ~masks.delimiters & ((masks.delimiters << 1) | carry);
+    ends = masks.delimiters & ~((masks.delimiters << 1) | carry);
+    carry = masks.delimiters >> 63;
+
+    // Walk just the interesting bytes.
+    bits = starts | ends | masks.singles;
+    while (bits) {
+      int b = __builtin_ctzll(bits);
+      uint64_t bit = ((uint64_t)1) << b;
+      char* at = block + b;
+      bits &= bits - 1;
+      if (at < skip) continue;
+      if (ends & bit) {
+        // Ends come before any single here, to keep order.
+        token->begin = atom;
+        token->end = at;
+        token++;
+        atom = NULL;
+      }
+      if (starts & bit) atom = at;
+      if (masks.singles & bit) {
+        token->begin = at;
+        token->end = at + 1;
+        if (*at == '"') {
+          // Assume no backslash escaping of anything.
+          // TODO Are escapes really not supported?
+          char* close =
+            reinterpret_cast<char*>(memchr(at + 1, '"', end - at - 1));
+          if (!close) cnErrTo(FAIL, "Unterminated string.");
+          token->end = close;
+          skip = close + 1;
+        }
+        token++;
+      }
+    }
+  }
+  if (atom) {
+    // Ran right up to the end of a full block.
+    token->begin = atom;
+    token->end = end;
+    token++;
+  }
+  parser->tokens.count = token - reinterpret_cast<Token*>(parser->tokens.items);
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+void cnrTokenizeBlock(const char* block, TokenMasks* masks) {
+  masks->delimiters = 0;
+  masks->singles = 0;
+#if defined(__AVX2__)
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i beforeTab = _mm256_set1_epi8('\t' - 1);
+  const __m256i afterReturn = _mm256_set1_epi8('\r' + 1);
+  const __m256i open = _mm256_set1_epi8('(');
+  const __m256i close = _mm256_set1_epi8(')');
+  const __m256i quote = _mm256_set1_epi8('"');
+  for (int i = 0; i < 2; i++) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(block + 32 * i));
+    // Whitespace is space or '\t' through '\r'.
+    __m256i white = _mm256_or_si256(
+      _mm256_cmpeq_epi8(chunk, space),
+      _mm256_and_si256(
+        _mm256_cmpgt_epi8(chunk, beforeTab),
+        _mm256_cmpgt_epi8(afterReturn, chunk)
+      )
+    );
+    __m256i single = _mm256_or_si256(
+      _mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, open), _mm256_cmpeq_epi8(chunk, close)
+      ),
+      _mm256_cmpeq_epi8(chunk, quote)
+    );
+    uint64_t singleBits = (uint32_t)_mm256_movemask_epi8(single);
+    uint64_t whiteBits = (uint32_t)_mm256_movemask_epi8(white);
+    masks->singles |= singleBits << (32 * i);
+    masks->delimiters |= (singleBits | whiteBits) << (32 * i);
+  }
+#elif defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i beforeTab = _mm_set1_epi8('\t' - 1);
+  const __m128i afterReturn = _mm_set1_epi8('\r' + 1);
+  const __m128i open = _mm_set1_epi8('(');
+  const __m128i close = _mm_set1_epi8(')');
+  const __m128i quote = _mm_set1_epi8('"');
+  for (int i = 0; i < 4; i++) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+    // Whitespace is space or '\t' through '\r'.
+    __m128i white = _mm_or_si128(
+      _mm_cmpeq_epi8(chunk, space),
+      _mm_and_si128(
+        _mm_cmpgt_epi8(chunk, beforeTab), _mm_cmpgt_epi8(afterReturn, chunk)
+      )
+    );
+    __m128i single = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, open), _mm_cmpeq_epi8(chunk, close)),
+      _mm_cmpeq_epi8(chunk, quote)
+    );
+    uint64_t singleBits = (uint16_t)_mm_movemask_epi8(single);
+    uint64_t whiteBits = (uint16_t)_mm_movemask_epi8(white);
+    masks->singles |= singleBits << (16 * i);
+    masks->delimiters |= (singleBits | whiteBits) << (16 * i);
+  }
+#else
+  for (int i = 0; i < 64; i++) {
+    char c = block[i];
+    uint64_t bit = ((uint64_t)1) << i;
+    if (c == '(' || c == ')' || c == '"') {
+      masks->singles |= bit;
+      masks->delimiters |= bit;
+    } else if (c == ' ' || ('\t' <= c && c <= '\r')) {
+      masks->delimiters |= bit;
+    }
+  }
+#endif
+}
+
+
 }
 }
@@ -18,6 +18,16 @@ namespace rcss {
 bool cnrLoadCommandLog(Game* game, char* name);
 
 
+/**
+ * Loads the named game log and, for names ending in ".rcg", the command log of
+ * the same name but ending in ".rcl".
+ *
+ * With CONCUNO_CACHE set, the parsed game also goes to a snapshot, used instead
+ * of the logs on later loads until either log changes.
+ */
+bool cnrLoadGame(Game* game, char* name);
+
+
 /**
  * Loads the file indicated by the given name. Game logs usually end in
  * extension ".rcg".
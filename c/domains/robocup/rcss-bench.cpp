@@ -0,0 +1,396 @@
+#include <chrono>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "load.h"
+
+
+namespace ccndomain {namespace rcss {
+
+
+/**
+ * Writes a synthetic game log of the given rcg version (2, 3, or 5) with the
+ * given number of shows. Every version gets the same states, with locations on
+ * a 1/16 grid so that all versions represent them exactly.
+ */
+bool generateGameLog(const char* name, int version, concuno::Count showCount);
+
+
+/**
+ * Checks that the games have the same states, within a small tolerance for
+ * angles, which version 3 stores in radians.
+ */
+bool sameGame(Game* a, Game* b);
+
+
+/**
+ * Loads and times the named game log, printing the results.
+ */
+bool timeGameLog(Game* game, char* name);
+
+
+}}
+
+
+using namespace ccndomain::rcss;
+using namespace concuno;
+using namespace std;
+
+
+/**
+ * Usage: rcss-bench [showCount [prefix]]
+ *
+ * Generates the same synthetic game in text (version 5) and binary (versions 2
+ * and 3) rcg formats, then times loading and checks that each binary form
+ * loads the same as the text.
+ */
+int main(int argc, char** argv) {
+  Count showCount = argc > 1 ? atol(argv[1]) : 20000;
+  string prefix = argc > 2 ? argv[2] : "rcss-bench";
+  int versions[] = {5, 2, 3};
+  Game games[3];
+  int status = EXIT_FAILURE;
+
+  for (int v = 0; v < 3; v++) {
+    char suffix[16];
+    sprintf(suffix, "-%d.rcg", versions[v]);
+    string name = prefix + suffix;
+    printf("Generating %s ...\n", name.c_str());
+    if (!generateGameLog(name.c_str(), versions[v], showCount)) {
+      cnErrTo(DONE, "Failed to generate: %s", name.c_str());
+    }
+    if (!timeGameLog(&games[v], &name[0])) {
+      cnErrTo(DONE, "Failed to load: %s", name.c_str());
+    }
+    if (v && !sameGame(&games[0], &games[v])) {
+      cnErrTo(DONE, "Version %d differs from text.", versions[v]);
+    }
+  }
+
+  // Winned.
+  status = EXIT_SUCCESS;
+
+  DONE:
+  return status;
+}
+
+
+namespace ccndomain {namespace rcss {
+
+
+/**
+ * Mirrors of the binary structs in rcssserver's types.h, so the generated logs
+ * get the same layout and padding as real ones. Each field is big-endian in
+ * files, so set them with generateGameLog_put16 and generateGameLog_put32.
+ */
+
+struct RcgPos {
+  int16_t enable, side, unum, angle, x, y;
+};
+
+struct RcgTeam {
+  char name[16];
+  int16_t score;
+};
+
+struct RcgShowInfo {
+  char pmode;
+  RcgTeam team[2];
+  RcgPos pos[23];
+  int16_t time;
+};
+
+struct RcgMsgInfo {
+  int16_t board;
+  char message[2048];
+};
+
+struct RcgDrawInfo {
+  int16_t mode;
+  union {
+    struct {int16_t x, y; char color[64];} pinfo;
+    struct {int16_t x, y, r; char color[64];} cinfo;
+    struct {int16_t x1, y1, x2, y2; char color[64];} linfo;
+  } object;
+};
+
+struct RcgDispInfo {
+  int16_t mode;
+  union {
+    RcgShowInfo show;
+    RcgMsgInfo msg;
+    RcgDrawInfo draw;
+  } body;
+};
+
+struct RcgBall {
+  int32_t x, y, deltax, deltay;
+};
+
+struct RcgPlayer {
+  int16_t mode, type;
+  int32_t x, y, deltax, deltay, bodyAngle, headAngle, viewWidth;
+  int16_t viewQuality;
+  int32_t stamina, effort, recovery;
+  int16_t kickCount, dashCount, turnCount, sayCount, turnNeckCount;
+  int16_t catchCount, moveCount, changeViewCount;
+};
+
+struct RcgShortShowInfo2 {
+  RcgBall ball;
+  RcgPlayer pos[22];
+  int16_t time;
+};
+
+// The sizes that load.cpp expects for each record mode.
+static_assert(sizeof(RcgTeam) == 18, "team_t");
+static_assert(sizeof(RcgShowInfo) == 316, "showinfo_t");
+static_assert(sizeof(RcgMsgInfo) == 2050, "msginfo_t");
+static_assert(sizeof(RcgDrawInfo) == 74, "drawinfo_t");
+static_assert(sizeof(RcgDispInfo) == 2 + 2050, "dispinfo_t");
+static_assert(sizeof(RcgPlayer) == 64, "player_t");
+static_assert(sizeof(RcgShortShowInfo2) == 1428, "short_showinfo_t2");
+
+
+/**
+ * Stores a big-endian short into a mirrored struct.
+ */
+void generateGameLog_put16(int16_t* at, Int value);
+
+
+/**
+ * Stores a big-endian 32-bit int into a mirrored struct.
+ */
+void generateGameLog_put32(int32_t* at, Int value);
+
+
+/**
+ * Writes a big-endian short.
+ */
+void generateGameLog_short(FILE* file, Int value);
+
+
+/**
+ * Fills a team_t with the null-padded name and a zero score.
+ */
+void generateGameLog_team(RcgTeam* team, const char* name);
+
+
+/**
+ * Writes some number of zero bytes.
+ */
+void generateGameLog_zeros(FILE* file, Count count);
+
+
+bool generateGameLog(const char* name, int version, Count showCount) {
+  const char* teamNames[] = {"Keepers", "Takers"};
+  FILE* file;
+  Index time = 0;
+
+  if (!(file = fopen(name, "wb"))) cnErrTo(FAIL, "No file.");
+
+  // Header and initial records.
+  if (version == 5) {
+    fprintf(file, "ULG5\n");
+    fprintf(file, "(team 1 %s %s 0 0)\n", teamNames[0], teamNames[1]);
+  } else {
+    fprintf(file, "ULG%c", version);
+  }
+  if (version == 3) {
+    // Team, then parameters, which are just skipped on reading.
+    RcgTeam teams[2];
+    generateGameLog_team(&teams[0], teamNames[0]);
+    generateGameLog_team(&teams[1], teamNames[1]);
+    generateGameLog_short(file, 6);
+    fwrite(teams, 1, sizeof(teams), file);
+    generateGameLog_short(file, 8);
+    generateGameLog_zeros(file, 364);
+    generateGameLog_short(file, 9);
+    generateGameLog_zeros(file, 112);
+    generateGameLog_short(file, 7);
+    generateGameLog_zeros(file, 88);
+  }
+
+  // Fixed seed for the same game each time.
+  srand(0);
+  for (Index s = 0; s < showCount; s++) {
+    // Locations on the 1/16 grid, in 16ths, and angles in whole degrees.
+    Int locations[23][2];
+    Int angles[23];
+    for (Index i = 0; i < 23; i++) {
+      locations[i][0] = rand() % (16 * 80) - 16 * 40;
+      locations[i][1] = rand() % (16 * 60) - 16 * 30;
+      angles[i] = rand() % 360 - 180;
+    }
+    // Hold the time still now and then, for subtimes.
+    if (s % 100) time++;
+    // Only the first three on each side play, as in keepaway.
+    switch (version) {
+    case 2: {
+      // Every version 2 record is a whole dispinfo_t.
+      RcgDispInfo disp;
+      if (!(s % 1000)) {
+        // Some messages and drawings to skip.
+        const char message[] = "(keepaway)";
+        memset(&disp, 0, sizeof(disp));
+        generateGameLog_put16(&disp.mode, 2);
+        memcpy(disp.body.msg.message, message, sizeof(message));
+        fwrite(&disp, 1, sizeof(disp), file);
+        memset(&disp, 0, sizeof(disp));
+        generateGameLog_put16(&disp.mode, 3);
+        generateGameLog_put16(&disp.body.draw.object.cinfo.r, 16);
+        fwrite(&disp, 1, sizeof(disp), file);
+      }
+      memset(&disp, 0, sizeof(disp));
+      generateGameLog_put16(&disp.mode, 1);
+      RcgShowInfo& show = disp.body.show;
+      generateGameLog_team(&show.team[0], teamNames[0]);
+      generateGameLog_team(&show.team[1], teamNames[1]);
+      for (Index i = 0; i < 23; i++) {
+        RcgPos& pos = show.pos[i];
+        bool enabled = !i || (i - 1) % 11 < 3;
+        generateGameLog_put16(&pos.enable, enabled);
+        generateGameLog_put16(&pos.side, !i ? 0 : i <= 11 ? 1 : -1);
+        generateGameLog_put16(&pos.unum, !i ? 0 : (i - 1) % 11 + 1);
+        generateGameLog_put16(&pos.angle, angles[i]);
+        generateGameLog_put16(&pos.x, locations[i][0]);
+        generateGameLog_put16(&pos.y, locations[i][1]);
+      }
+      generateGameLog_put16(&show.time, time);
+      fwrite(&disp, 1, sizeof(disp), file);
+      break;
+    }
+    case 3: {
+      if (!(s % 1000)) {
+        // Some messages and play modes to skip.
+        const char message[] = "(keepaway)";
+        generateGameLog_short(file, 2);
+        generateGameLog_short(file, 0);
+        generateGameLog_short(file, sizeof(message));
+        fwrite(message, 1, sizeof(message), file);
+        generateGameLog_short(file, 5);
+        fputc(2, file);
+      }
+      RcgShortShowInfo2 show;
+      memset(&show, 0, sizeof(show));
+      generateGameLog_put32(&show.ball.x, locations[0][0] * 4096);
+      generateGameLog_put32(&show.ball.y, locations[0][1] * 4096);
+      for (Index i = 1; i < 23; i++) {
+        RcgPlayer& player = show.pos[i - 1];
+        bool enabled = (i - 1) % 11 < 3;
+        generateGameLog_put16(&player.mode, enabled);
+        generateGameLog_put32(&player.x, locations[i][0] * 4096);
+        generateGameLog_put32(&player.y, locations[i][1] * 4096);
+        generateGameLog_put32(
+          &player.bodyAngle, lround(angles[i] * M_PI / 180 * 65536)
+        );
+      }
+      generateGameLog_put16(&show.time, time);
+      generateGameLog_short(file, 1);
+      fwrite(&show, 1, sizeof(show), file);
+      break;
+    }
+    default:
+      fprintf(file, "(show %ld ((b) %.4f %.4f 0 0)", time,
+        locations[0][0] / 16.0, locations[0][1] / 16.0
+      );
+      for (Index i = 1; i < 23; i++) {
+        if ((i - 1) % 11 >= 3) continue;
+        fprintf(file,
+          " ((%c %ld) 0 0x1 %.4f %.4f 0 0 %ld 0 (v h 90) (s 8000 1 1))",
+          i <= 11 ? 'l' : 'r', (i - 1) % 11 + 1,
+          locations[i][0] / 16.0, locations[i][1] / 16.0, angles[i]
+        );
+      }
+      fprintf(file, ")\n");
+      break;
+    }
+  }
+  if (fclose(file)) cnErrTo(FAIL, "Failed to close.");
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+void generateGameLog_put16(int16_t* at, Int value) {
+  unsigned char* bytes = reinterpret_cast<unsigned char*>(at);
+  bytes[0] = (unsigned char)(value >> 8);
+  bytes[1] = (unsigned char)value;
+}
+
+
+void generateGameLog_put32(int32_t* at, Int value) {
+  unsigned char* bytes = reinterpret_cast<unsigned char*>(at);
+  bytes[0] = (unsigned char)(value >> 24);
+  bytes[1] = (unsigned char)(value >> 16);
+  bytes[2] = (unsigned char)(value >> 8);
+  bytes[3] = (unsigned char)value;
+}
+
+
+void generateGameLog_short(FILE* file, Int value) {
+  unsigned char bytes[] = {(unsigned char)(value >> 8), (unsigned char)value};
+  fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+
+void generateGameLog_team(RcgTeam* team, const char* name) {
+  memset(team, 0, sizeof(*team));
+  memcpy(team->name, name, strnlen(name, sizeof(team->name)));
+}
+
+
+void generateGameLog_zeros(FILE* file, Count count) {
+  for (Index i = 0; i < count; i++) fputc(0, file);
+}
+
+
+bool sameGame(Game* a, Game* b) {
+  if (a->teamNames != b->teamNames) cnErrTo(FAIL, "Team names differ.");
+  if (a->states.count != b->states.count) {
+    cnErrTo(FAIL, "%ld vs. %ld states.", a->states.count, b->states.count);
+  }
+  for (Index s = 0; s < a->states.count; s++) {
+    State& x = a->states[s];
+    State& y = b->states[s];
+    if (
+      x.time != y.time || x.subtime != y.subtime ||
+      x.ball.location[0] != y.ball.location[0] ||
+      x.ball.location[1] != y.ball.location[1] ||
+      x.players.count != y.players.count
+    ) cnErrTo(FAIL, "State %ld differs.", s);
+    for (Index p = 0; p < x.players.count; p++) {
+      Player& i = x.players[p];
+      Player& j = y.players[p];
+      if (
+        i.team != j.team || i.index != j.index ||
+        i.location[0] != j.location[0] || i.location[1] != j.location[1] ||
+        fabs(i.orientation - j.orientation) > 1e-3
+      ) cnErrTo(FAIL, "State %ld player %ld differs.", s, p);
+    }
+  }
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+bool timeGameLog(Game* game, char* name) {
+  chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+  if (!cnrLoadGameLog(game, name)) return false;
+  chrono::duration<double> seconds = chrono::steady_clock::now() - begin;
+  printf("%ld states in %.3lf s: %.0lf states/sec\n",
+    game->states.count, seconds.count(), game->states.count / seconds.count()
+  );
+  return true;
+}
+
+
+}}
@@ -1,8 +1,12 @@
-#include <fstream>
+#include <fcntl.h>
+#include <errno.h>
 #include <iostream>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <unordered_map>
 #include <yajl/api/yajl_gen.h>
 
 #include "choose.h"
@@ -15,6 +19,85 @@ using namespace std;
 namespace ccndomain {namespace rcss {
 
 
+/**
+ * Buffered output to a file descriptor, used as a yajl print callback so that
+ * documents stream out in fixed-size chunks rather than building up whole in
+ * memory.
+ */
+struct ChunkFile {
+
+  ChunkFile();
+
+  /**
+   * Closes without flushing. Call close first to keep the data.
+   */
+  ~ChunkFile();
+
+  /**
+   * Flushes and closes, returning false if anything failed along the way.
+   */
+  bool close();
+
+  /**
+   * Writes out whatever is buffered.
+   */
+  bool flush();
+
+  /**
+   * Opens the named file for writing, truncating any existing content.
+   */
+  bool open(const char* name);
+
+  /**
+   * Matches yajl_print_t, with the ChunkFile as context. Errors can't be
+   * returned here, so they are remembered for close.
+   */
+  static void print(void* file, const char* data, size_t size);
+
+  char buffer[1 << 16];
+
+  Count count;
+
+  int descriptor;
+
+  bool failed;
+
+};
+
+
+/**
+ * One game, with its command log, loaded and chosen into bags independently of
+ * all others, so that many can be handled at once.
+ */
+struct Match {
+
+  Match(const std::string& name);
+
+  /**
+   * Disposes of any bags not yet moved out. The game disposes of itself.
+   */
+  ~Match();
+
+  Game game;
+
+  List<Bag> holdBags;
+
+  /**
+   * Shared by the hold and pass bags.
+   */
+  List<List<Entity>*> entityLists;
+
+  /**
+   * The game log name. The command log name is assumed to differ only by
+   * ending in rcl rather than rcg.
+   */
+  std::string name;
+
+  List<Bag> passBags;
+
+};
+
+
 bool cnrGenColumnVector(yajl_gen gen, Count count, Float* x);
 
 
@@ -43,8 +126,27 @@ void generate(yajl_gen gen, const char* str, Value value) {
 void pickFunctions(std::vector<EntityFunction*>& functions, Type* type);
 
 
+/**
+ * Loads and chooses each match in parallel, then moves all bags and entity
+ * lists into the given lists in match order. The order of the result is
+ * therefore independent of thread scheduling. The matches keep the games that
+ * the bags point into, so keep them around until the bags are disposed.
+ */
+bool cnrLoadMatches(
+  std::vector<Match*>& matches,
+  List<Bag>* holdBags, List<Bag>* passBags,
+  List<List<Entity>*>* entityLists
+);
+
+
+/**
+ * Worker for cnrLoadMatches, for use with cnParallelEach.
+ */
+bool cnrLoadMatches_match(RefAny info, Index index);
+
+
 bool cnrProcess(
-  Game* game,
+  std::vector<Match*>& matches,
   bool (*process)(List<Bag>* holdBags, List<Bag>* passBags)
 );
 
@@ -55,49 +157,51 @@ bool cnrProcessExport(List<Bag>* holdBags, List<Bag>* passBags);
 bool cnrProcessLearn(List<Bag>* holdBags, List<Bag>* passBags);
 
 
+/**
+ * Writes the bags to a bag archive, with each entity flattened to a plain
+ * record of the float values of the given type's properties. The domain
+ * properties aren't offsets into the entities, and balls are smaller than
+ * players, so raw entities can't be archived as they are.
+ *
+ * Like tables and SMRF, records start with a Bag property, here the index of
+ * the first bag with the entity.
+ */
+bool cnrSaveArchive(const char* name, List<Bag>* bags, Type* itemType);
+
+
 bool cnrSaveBags(const char* name, List<Bag>* bags);
 
 
 }}
 
 
+/**
+ * Usage: rcss-test file-or-pattern...
+ *
+ * Each file is a game log, and patterns are expanded as by the shell, for cases
+ * of too many files for the command line. Logs are parsed in parallel, by
+ * CONCUNO_WORKERS threads if set.
+ */
 int main(int argc, char** argv) {
   using namespace ccndomain::rcss;
-  Game game;
-  char* name;
+  AutoVec<Match*> matches;
+  vector<string> names;
   int result = EXIT_FAILURE;
 
   try {
     // Check args.
     if (argc < 2) cnErrTo(DONE, "No file specified.");
-
-    // Load all the states in the game log.
-    // TODO Check if rcl or rcg to work either way.
-    name = argv[1];
-    if (!cnrLoadGameLog(&game, name)) cnErrTo(DONE, "Failed to load: %s", name);
-
-    // Show all team names.
-    for (size_t n = 0; n < game.teamNames.size(); n++) {
-      cout << "Team: " << game.teamNames[n] << endl;
+    for (int a = 1; a < argc; a++) {
+      if (!cnGlob(argv[a], &names)) cnErrTo(DONE, "Failed to find files.");
     }
-
-    // Now look at the command log to see what actions were taken.
-    // Assume the file is in the same place but named rcl instead of rcg.
-    if (cnStrEndsWith(name, ".rcg")) {
-      // Abusively just modify the arg. TODO Is this legit?
-      Index lastIndex = strlen(name) - 1;
-      name[lastIndex] = 'l';
-      printf("Trying also to read %s\n", name);
-      if (!cnrLoadCommandLog(&game, name)) {
-        cnErrTo(DONE, "Failed to load: %s", name);
-      }
+    for (size_t n = 0; n < names.size(); n++) {
+      pushOrDelete(*matches, new Match(names[n]));
     }
 
-    // Report.
-    printf("Loaded %ld states.\n", game.states.count);
-
     // Extract actions of hold or kick to player, then process them.
-    if (!cnrProcess(&game, cnrProcessLearn)) cnErrTo(DONE, "Failed extract.");
+    if (!cnrProcess(*matches, cnrProcessLearn)) {
+      cnErrTo(DONE, "Failed extract.");
+    }
 
     // Winned.
     result = EXIT_SUCCESS;
@@ -113,6 +217,72 @@ int main(int argc, char** argv) {
 namespace ccndomain {namespace rcss {
 
 
+ChunkFile::ChunkFile(): count(0), descriptor(-1), failed(false) {}
+
+
+ChunkFile::~ChunkFile() {
+  if (descriptor >= 0) ::close(descriptor);
+}
+
+
+bool ChunkFile::close() {
+  bool result = flush() && !failed;
+  if (::close(descriptor)) result = false;
+  descriptor = -1;
+  return result;
+}
+
+
+bool ChunkFile::flush() {
+  char* data = buffer;
+  while (count) {
+    ssize_t written = write(descriptor, data, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      return false;
+    }
+    count -= written;
+    data += written;
+  }
+  return true;
+}
+
+
+bool ChunkFile::open(const char* name) {
+  descriptor = ::open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  return descriptor >= 0;
+}
+
+
+void ChunkFile::print(void* $file, const char* data, size_t size) {
+  ChunkFile* file = reinterpret_cast<ChunkFile*>($file);
+  while (size && !file->failed) {
+    Count room = sizeof(file->buffer) - file->count;
+    Count part = (Count)size < room ? size : room;
+    memcpy(file->buffer + file->count, data, part);
+    file->count += part;
+    data += part;
+    size -= part;
+    if (file->count == sizeof(file->buffer)) file->flush();
+  }
+}
+
+
+Match::Match(const string& $name): name($name) {}
+
+
+Match::~Match() {
+  // The entity lists get disposed with the hold bags, so clear them out of the
+  // pass bags before disposing of those.
+  cnBagListDispose(&holdBags, &entityLists);
+  cnListEachBegin(&passBags, Bag, bag) {
+    bag->entities = NULL;
+  } cnEnd;
+  cnBagListDispose(&passBags, NULL);
+}
+
+
 bool cnrGenColumnVector(yajl_gen gen, Count count, Float* x) {
   Float* end = x + count;
   if (yajl_gen_array_open(gen)) cnFailTo(FAIL);
@@ -176,8 +346,79 @@ void pickFunctions(vector<EntityFunction*>& functions, Type* type) {
 }
 
 
+bool cnrLoadMatches(
+  vector<Match*>& matches,
+  List<Bag>* holdBags, List<Bag>* passBags,
+  List<List<Entity>*>* entityLists
+) {
+  if (!cnParallelEach(matches.size(), 0, cnrLoadMatches_match, &matches)) {
+    cnErrTo(FAIL, "Failed to load matches.");
+  }
+
+  // Report and move everything out in order. Zeroed counts mean the match no
+  // longer owns the items. Pushing nothing gives null, so check counts first.
+  for (size_t m = 0; m < matches.size(); m++) {
+    Match* match = matches[m];
+    // Show all team names.
+    for (size_t n = 0; n < match->game.teamNames.size(); n++) {
+      cout << "Team: " << match->game.teamNames[n] << endl;
+    }
+    printf(
+      "Loaded %ld states from %s\n",
+      match->game.states.count, match->name.c_str()
+    );
+    if (match->holdBags.count && !cnListPushAll(holdBags, &match->holdBags)) {
+      cnErrTo(FAIL, "Failed to gather hold bags.");
+    }
+    match->holdBags.count = 0;
+    if (match->passBags.count && !cnListPushAll(passBags, &match->passBags)) {
+      cnErrTo(FAIL, "Failed to gather pass bags.");
+    }
+    match->passBags.count = 0;
+    if (
+      match->entityLists.count &&
+      !cnListPushAll(entityLists, &match->entityLists)
+    ) {
+      cnErrTo(FAIL, "Failed to gather entity lists.");
+    }
+    match->entityLists.count = 0;
+  }
+
+  // Winned.
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+bool cnrLoadMatches_match(RefAny info, Index index) {
+  Match* match = (*reinterpret_cast<vector<Match*>*>(info))[index];
+  // Copy the name, since we might modify it.
+  string nameCopy = match->name;
+  char* name = &nameCopy[0];
+
+  // Load the game and command logs, or their snapshot.
+  // TODO Check if rcl or rcg to work either way.
+  if (!cnrLoadGame(&match->game, name)) cnFailTo(FAIL);
+
+  // Choose bags.
+  if (!cnrChooseHoldsAndPasses(
+    &match->game, &match->holdBags, &match->passBags, &match->entityLists
+  )) {
+    cnErrTo(FAIL, "Choose failed: %s", match->name.c_str());
+  }
+
+  // Winned.
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
 bool cnrProcess(
-  Game* game,
+  vector<Match*>& matches,
   bool (*process)(List<Bag>* holdBags, List<Bag>* passBags)
 ) {
   List<Bag> holdBags;
@@ -185,8 +426,8 @@ bool cnrProcess(
   List<Bag> passBags;
   bool result = false;
 
-  if (!cnrChooseHoldsAndPasses(game, &holdBags, &passBags, &entityLists)) {
-    cnErrTo(DONE, "Choose failed.");
+  if (!cnrLoadMatches(matches, &holdBags, &passBags, &entityLists)) {
+    cnErrTo(DONE, "Load failed.");
   }
 
   // Process the bags.
@@ -212,8 +453,20 @@ bool cnrProcessExport(List<Bag>* holdBags, List<Bag>* passBags) {
   // Export stuff.
   // TODO Allow specifying file names? Choose automatically by date?
   // TODO Option for learning in concuno rather than saving?
+  Type* itemType = NULL;
+  Schema schema;
+  schemaInit(schema);
+  for (size_t t = 0; t < schema.types->size(); t++) {
+    if (schema.types[t]->name == "Item") itemType = schema.types[t];
+  }
+  if (!itemType) cnErrTo(FAIL, "No item type.");
   if (!cnrSaveBags("keepaway-hold-bags.json", holdBags)) cnFailTo(FAIL);
   if (!cnrSaveBags("keepaway-pass-bags.json", passBags)) cnFailTo(FAIL);
+  // Also as bag archives, for learning without reparsing the logs.
+  if (!(
+    cnrSaveArchive("keepaway-hold.bags", holdBags, itemType) &&
+    cnrSaveArchive("keepaway-pass.bags", passBags, itemType)
+  )) cnFailTo(FAIL);
   return true;
 
   FAIL:
@@ -234,8 +487,8 @@ bool cnrProcessLearn(List<Bag>* holdBags, List<Bag>* passBags) {
 
   // Learn something.
   // TODO How to choose pass vs. hold?
-  cnListShuffle(holdBags);
-  cnListShuffle(passBags);
+  cnListShuffle(holdBags, learner.random);
+  cnListShuffle(passBags, learner.random);
   learner.bags = passBags;
   learner.entityFunctions = &*functions;
   learnedTree = learner.learnTree();
@@ -255,11 +508,113 @@ bool cnrProcessLearn(List<Bag>* holdBags, List<Bag>* passBags) {
 }
 
 
+bool cnrSaveArchive(const char* name, List<Bag>* bags, Type* itemType) {
+  // Bags of records, each owning its entity list.
+  List<Bag> archiveBags;
+  Index b = 0;
+  vector<Index> bagOf;
+  unordered_map<Entity, Index> indexOf;
+  vector<Float> records;
+  bool result = false;
+  Schema schema;
+  Count stride = 1;
+  Type* type;
+
+  // The archive type has an offset property for each item property.
+  printf("Writing %s\n", name);
+  type = new Type(schema, itemType->name.c_str(), 0);
+  pushOrDelete(*schema.types, type);
+  type->properties.push(
+    new OffsetProperty(type, schema.floatType, "Bag", 0, 1)
+  );
+  for (size_t p = 0; p < itemType->properties->size(); p++) {
+    Property* property = itemType->properties[p];
+    if (property->type != itemType->schema->floatType) {
+      cnErrTo(DONE, "Property %s isn't float.", property->name.c_str());
+    }
+    type->properties.push(new OffsetProperty(
+      type, schema.floatType, property->name.c_str(),
+      stride * sizeof(Float), property->count
+    ));
+    stride += property->count;
+  }
+  type->size = stride * sizeof(Float);
+
+  // Number the entities, and fill in their records.
+  cnListEachBegin(bags, Bag, bag) {
+    cnListEachBegin(bag->entities, Entity, entity) {
+      if (indexOf.insert(make_pair(*entity, bagOf.size())).second) {
+        bagOf.push_back(b);
+      }
+    } cnEnd;
+    cnListEachBegin(&bag->participantOptions, List<Entity>, options) {
+      cnListEachBegin(options, Entity, entity) {
+        if (indexOf.insert(make_pair(*entity, bagOf.size())).second) {
+          bagOf.push_back(b);
+        }
+      } cnEnd;
+    } cnEnd;
+    b++;
+  } cnEnd;
+  records.resize(indexOf.size() * stride);
+  for (
+    unordered_map<Entity, Index>::iterator i = indexOf.begin();
+    i != indexOf.end(); i++
+  ) {
+    Float* record = &records[i->second * stride];
+    *record++ = bagOf[i->second];
+    for (size_t p = 0; p < itemType->properties->size(); p++) {
+      Property* property = itemType->properties[p];
+      property->get(i->first, record);
+      record += property->count;
+    }
+  }
+
+  // Mirror the bags onto the records.
+  cnListEachBegin(bags, Bag, bag) {
+    Bag* archiveBag;
+    if (!(archiveBag = reinterpret_cast<Bag*>(cnListExpand(&archiveBags)))) {
+      cnErrTo(DONE, "No bag.");
+    }
+    new(archiveBag) Bag;
+    archiveBag->label = bag->label;
+    cnListEachBegin(bag->entities, Entity, entity) {
+      Entity record = &records[indexOf[*entity] * stride];
+      if (!cnListPush(archiveBag->entities, &record)) {
+        cnErrTo(DONE, "No entity.");
+      }
+    } cnEnd;
+    cnListEachBegin(&bag->participantOptions, List<Entity>, options) {
+      List<Entity>* archiveOptions;
+      if (!(archiveOptions = reinterpret_cast<List<Entity>*>(
+        cnListExpand(&archiveBag->participantOptions)
+      ))) cnErrTo(DONE, "No options.");
+      new(archiveOptions) List<Entity>;
+      cnListEachBegin(options, Entity, entity) {
+        Entity record = &records[indexOf[*entity] * stride];
+        if (!cnListPush(archiveOptions, &record)) cnErrTo(DONE, "No option.");
+      } cnEnd;
+    } cnEnd;
+  } cnEnd;
+
+  // Save.
+  if (!cnBagArchiveSave(name, &archiveBags, type)) cnFailTo(DONE);
+
+  // Winned.
+  result = true;
+
+  DONE:
+  cnBagListDispose(&archiveBags, NULL);
+  return result;
+}
+
+
 bool cnrSaveBags(const char* name, List<Bag>* bags) {
-  const unsigned char* buffer;
   Index b = 0;
-  size_t bufferSize;
-  ofstream file;
+  // Depths for pinned entities in the current bag, reused across bags.
+  unordered_map<Entity, Index> depths;
+  // The file is big for the stack, so put it on the heap.
+  unique_ptr<ChunkFile> file(new ChunkFile);
   yajl_gen gen = NULL;
   const char* itemsKey = "items";
   const char* locationKey = "location";
@@ -267,22 +622,37 @@ bool cnrSaveBags(const char* name, List<Bag>* bags) {
 
   printf("Writing %s\n", name);
   if (!(gen = yajl_gen_alloc(NULL))) cnErrTo(DONE, "No json formatter.");
-  // TODO How to get custom info (like file names) on error message?
-  file.open(name); if (!file) throw Error("Failed to open output file.");
+  if (!file->open(name)) cnErrTo(DONE, "Failed to open %s.", name);
 
+  // Print straight to the file as we go.
   if (!(
     yajl_gen_config(gen, yajl_gen_beautify, true) &&
-    yajl_gen_config(gen, yajl_gen_indent_string, "  ")
+    yajl_gen_config(gen, yajl_gen_indent_string, "  ") &&
+    yajl_gen_config(
+      gen, yajl_gen_print_callback, ChunkFile::print, file.get()
+    )
   )) cnFailTo(DONE);
   if (yajl_gen_array_open(gen) || yajl_gen_array_open(gen)) cnFailTo(DONE);
   cnListEachBegin(bags, Bag, bag) {
+    // Find pinning depths (for passer/receiver), keeping the first found, so
+    // unpinned items end up past the last depth.
+    Index depth = 0;
+    depths.clear();
+    cnListEachBegin(&bag->participantOptions, List<Entity>, options) {
+      cnListEachBegin(options, Entity, entity) {
+        depths.insert(make_pair(*entity, depth));
+      } cnEnd;
+      depth++;
+    } cnEnd;
     if (yajl_gen_map_open(gen)) cnFailTo(DONE);
     generate(gen, itemsKey);
     if (yajl_gen_array_open(gen)) cnFailTo(DONE);
     // Write each item (ball or player).
     cnListEachBegin(bag->entities, Entity, entity) {
-      Index depth = 0;
       Item* item = reinterpret_cast<Item*>(*entity);
+      unordered_map<Entity, Index>::iterator found = depths.find(item);
+      Index depth =
+        found == depths.end() ? bag->participantOptions.count : found->second;
       if (yajl_gen_map_open(gen)) cnFailTo(DONE);
       // Type as ball, left (team), or right (team).
       generate(gen, "type");
@@ -296,18 +666,6 @@ bool cnrSaveBags(const char* name, List<Bag>* bags) {
       generate(gen, locationKey);
       if (!cnrGenColumnVector(gen, 2, item->location)) cnFailTo(DONE);
       // Pinning (and passer/receiver).
-      cnListEachBegin(&bag->participantOptions, List<Entity>, options) {
-        bool found = false;
-        cnListEachBegin(options, Entity, entity) {
-          if (item == *entity) {
-            found = true;
-            break;
-          }
-        } cnEnd;
-        // Skip out if we found the player pinned.
-        if (found) break;
-        depth++;
-      } cnEnd;
       generate(gen, "__instantiable_depth__");
       if (yajl_gen_integer(gen, depth)) cnFailTo(DONE);
       // Passer and receiver.
@@ -327,6 +685,9 @@ bool cnrSaveBags(const char* name, List<Bag>* bags) {
     if (yajl_gen_integer(gen, b)) cnFailTo(DONE);
     // Bag label.
     generate(gen, "label", bag->label);
+    // How many depths are pinned, so loaders needn't guess.
+    generate(gen, "__participant_depths__");
+    if (yajl_gen_integer(gen, bag->participantOptions.count)) cnFailTo(DONE);
     // SMRF Python class.
     generate(gen, "__json_class__", "Graph");
     // End bag.
@@ -339,17 +700,8 @@ bool cnrSaveBags(const char* name, List<Bag>* bags) {
   generate(gen, "receiver");
   if (yajl_gen_array_close(gen) || yajl_gen_array_close(gen)) cnFailTo(DONE);
 
-  // Output.
-  // TODO Alternatively set the gen print function to print directly!
-  if (yajl_gen_get_buf(gen, &buffer, &bufferSize)) cnFailTo(DONE);
-  if (!file.write(
-    reinterpret_cast<const char*>(buffer),
-    static_cast<streamsize>(bufferSize)
-  )) throw Error("Failed to write to file.");
-
   // Only bother with manual close if we didn't have other errors.
-  file.close();
-  if (!file) throw Error("Failed to close file.");
+  if (!file->close()) cnErrTo(DONE, "Failed to write %s.", name);
 
   // Winned.
   result = true;
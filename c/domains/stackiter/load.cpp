@@ -38,9 +38,29 @@ bool handleType(Parser* parser, char* args);
 
 
 /**
- * Parses a single line, returning true for no error.
+ * Handler for a single command.
  */
-bool parseLine(Parser* parser, String* line);
+typedef bool (*Handler)(Parser* parser, char* args);
+
+
+/**
+ * Finds the handler for the given command, or null if none.
+ */
+Handler findHandler(const char* command);
+
+
+/**
+ * Pushes the states from the loaded snapshot, returning false without pushing
+ * anything if the snapshot doesn't hold valid states.
+ */
+bool loadSnapshot(Snapshot* snapshot, List<State>* states);
+
+
+/**
+ * Parses a single line, returning true for no error. The line is chopped in
+ * place during parsing.
+ */
+bool parseLine(Parser* parser, char* line);
 
 
 Item* parserItem(Parser* parser, char* begin, char** end);
@@ -49,17 +69,42 @@ Item* parserItem(Parser* parser, char* begin, char** end);
 void pushState(Parser* parser);
 
 
+/**
+ * Writes the states for the snapshot. Each state is a record with its items
+ * counted, and all the items follow together.
+ */
+bool saveSnapshot(Snapshot* snapshot, State* states, Count count);
+
+
+/**
+ * The fixed part of a state in a snapshot.
+ */
+struct StateRecord {
+  Count cleared;
+  Count itemCount;
+  double time;
+};
+
+
 bool load(char* name, List<State>* states) {
   bool result = true;
-  int closeError;
-  FILE* file;
-  String line;
-  Count lineCount, readCount;
+  char* at;
+  FileMap file;
+  String lastLine;
+  char* line;
+  Count lineCount;
   Parser parser;
+  Snapshot snapshot("stackiter-states");
+  Count stateBegin = states->count;
   parser.states = states;
-  // Open file.
-  file = fopen(name, "r");
-  if (!file) {
+  // Skip the parsing if we have a snapshot.
+  snapshot.addSource(name);
+  if (snapshot.load() && loadSnapshot(&snapshot, states)) {
+    printf("Loaded snapshot for %s\n", name);
+    return true;
+  }
+  // Map the file, so we can parse lines in place.
+  if (!file.map(name)) {
     printf("Failed to open: %s\n", name);
     return false;
   }
@@ -67,13 +112,14 @@ bool load(char* name, List<State>* states) {
   // TODO Init state.
   // Read lines.
   lineCount = 0;
-  while ((readCount = cnReadLine(file, &line)) > 0) {
-    //printf("Line: %s", cnStr(&line));
+  at = file.data;
+  while ((line = file.line(&at, &lastLine))) {
+    //printf("Line: %s\n", line);
     lineCount++;
-    if (!parseLine(&parser, &line)) {
+    if (!parseLine(&parser, line)) {
       // TODO Distinguish parse errors from memory allocation fails.
       printf(
-          "Error parsing line %ld of %s: %s\n", lineCount, name, cnStr(&line)
+          "Error parsing line %ld of %s: %s\n", lineCount, name, line
       );
       result = false;
       break;
@@ -81,16 +127,58 @@ bool load(char* name, List<State>* states) {
   }
   // Grab the last state.
   pushState(&parser);
-  // Clean up.
-  closeError = fclose(file);
-  if (readCount < 0 || closeError) {
-    printf("Error reading or closing: %s\n", name);
-    result = false;
+  // Save a snapshot for next time, if wanted. Failure here isn't fatal.
+  if (result && snapshot.enabled) {
+    if (!(
+      saveSnapshot(
+        &snapshot, reinterpret_cast<State*>(states->items) + stateBegin,
+        states->count - stateBegin
+      ) && snapshot.save()
+    )) printf("Failed to save snapshot for %s\n", name);
   }
   return result;
 }
 
 
+bool loadSnapshot(Snapshot* snapshot, List<State>* states) {
+  const Count* header;
+  const Item* items;
+  const StateRecord* records;
+  Count itemCount = 0;
+
+  // Check it all before pushing anything.
+  if (!(header = reinterpret_cast<const Count*>(
+    snapshot->read(2 * sizeof(Count))
+  ))) return false;
+  if (header[0] != sizeof(Item) || header[1] < 0) return false;
+  if (!(records = reinterpret_cast<const StateRecord*>(
+    snapshot->read(header[1] * sizeof(StateRecord))
+  ))) return false;
+  for (Index s = 0; s < header[1]; s++) itemCount += records[s].itemCount;
+  if (!(items = reinterpret_cast<const Item*>(
+    snapshot->read(itemCount * sizeof(Item))
+  ))) return false;
+
+  // All good, so push the states.
+  for (Index s = 0; s < header[1]; s++) {
+    const StateRecord& record = records[s];
+    State* state;
+    if (!(state = reinterpret_cast<State*>(cnListExpand(states)))) {
+      throw Error("Failed to expand states for snapshot.");
+    }
+    new(state) State;
+    state->cleared = record.cleared;
+    state->time = record.time;
+    if (
+      record.itemCount &&
+      !cnListPushMulti(&state->items, items, record.itemCount)
+    ) throw Error("Failed to push snapshot items.");
+    items += record.itemCount;
+  }
+  return true;
+}
+
+
 bool handleAlive(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
   char* status = cnParseStr(args, &args);
@@ -112,16 +200,16 @@ bool handleColor(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
   // TODO Use HSV colorspace to begin with?
   // TODO Verify we haven't run out of args?
-  item->color[0] = strtod(args, &args);
-  item->color[1] = strtod(args, &args);
-  item->color[2] = strtod(args, &args);
+  item->color[0] = cnParseFloat(args, &args);
+  item->color[1] = cnParseFloat(args, &args);
+  item->color[2] = cnParseFloat(args, &args);
   // Ignore opacity, the 4th value. It's bogus for now.
   return true;
 }
 
 
 bool handleDestroy(Parser* parser, char* args) {
-  Id id = strtol(args, &args, 10);
+  Id id = cnParseInt(args, &args);
   Index& index = parser->indices[id];
   if (!index) {
     printf("Already destroyed: %ld\n", id);
@@ -148,8 +236,8 @@ bool handleDestroy(Parser* parser, char* args) {
 
 bool handleExtent(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
-  item->extent[0] = strtod(args, &args);
-  item->extent[1] = strtod(args, &args);
+  item->extent[0] = cnParseFloat(args, &args);
+  item->extent[1] = cnParseFloat(args, &args);
   return true;
 }
 
@@ -166,20 +254,27 @@ bool handleGrasp(Parser* parser, char* args) {
 
 bool handleItem(Parser* parser, char* args) {
   Item item;
-  Id badId = 0;
-  Index i, index = parser->state.items.count;
+  Index index = parser->state.items.count;
   stItemInit(&item);
-  item.id = strtol(args, &args, 10);
+  item.id = cnParseInt(args, &args);
+  if (item.id < 0) {
+    printf("Bad item id: %ld\n", item.id);
+    return false;
+  }
   // TODO Verify against duplicate ID?
   // TODO Extra data copy here. Do I care?
   if (!cnListPush(&parser->state.items, &item)) {
     return false;
   }
-  // TODO Bulk expand?
-  for (i = parser->indices.count; i <= item.id; i++) {
-    if (!cnListPush(&parser->indices, &badId)) {
+  if (item.id >= parser->indices.count) {
+    // Grow all at once, with zeros marking ids not yet seen.
+    Count added = item.id + 1 - parser->indices.count;
+    Index* indices =
+      reinterpret_cast<Index*>(cnListExpandMulti(&parser->indices, added));
+    if (!indices) {
       return false;
     }
+    memset(indices, 0, added * sizeof(Index));
   }
   // Guaranteed good array spot here.
   ((Index*)parser->indices.items)[item.id] = index;
@@ -190,16 +285,16 @@ bool handleItem(Parser* parser, char* args) {
 bool handlePos(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
   // TODO Verify we haven't run out of args or have other errors?
-  item->location[0] = strtod(args, &args);
-  item->location[1] = strtod(args, &args);
+  item->location[0] = cnParseFloat(args, &args);
+  item->location[1] = cnParseFloat(args, &args);
   return true;
 }
 
 
 bool handlePosVel(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
-  item->velocity[0] = strtod(args, &args);
-  item->velocity[1] = strtod(args, &args);
+  item->velocity[0] = cnParseFloat(args, &args);
+  item->velocity[1] = cnParseFloat(args, &args);
   return true;
 }
 
@@ -216,7 +311,7 @@ bool handleRelease(Parser* parser, char* args) {
 bool handleRot(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
   // TODO Angle is in rats. Convert to radians or not?
-  item->orientation = strtod(args, &args);
+  item->orientation = cnParseFloat(args, &args);
   return true;
 }
 
@@ -224,7 +319,7 @@ bool handleRot(Parser* parser, char* args) {
 bool handleRotVel(Parser* parser, char* args) {
   Item* item = parserItem(parser, args, &args);
   // TODO Angular velocity is in rats. Convert to radians or not?
-  item->orientationVelocity = strtod(args, &args);
+  item->orientationVelocity = cnParseFloat(args, &args);
   return true;
 }
 
@@ -238,9 +333,9 @@ bool handleTime(Parser* parser, char* args) {
     parser->state.cleared = false;
     // Just eat the number of steps for now. Maybe I'll care more about it
     // later.
-    steps = strtol(args, &args, 10);
+    steps = cnParseInt(args, &args);
     // I pretend the sim time (in seconds) is what matters here.
-    parser->state.time = strtod(args, &args);
+    parser->state.time = cnParseFloat(args, &args);
   }
   return true;
 }
@@ -260,41 +355,69 @@ bool handleType(Parser* parser, char* args) {
 }
 
 
-bool parseLine(Parser* parser, String* line) {
+Handler findHandler(const char* command) {
+  // Switch on length and then on a char or two, so each command needs at most
+  // one full compare to confirm. The command set is small and fixed, so this
+  // amounts to a perfect hash without the table.
+  const char* expected = NULL;
+  Handler handler = NULL;
+  switch (strlen(command)) {
+  case 3:
+    switch (*command) {
+    case 'p': expected = "pos"; handler = handlePos; break;
+    case 'r': expected = "rot"; handler = handleRot; break;
+    }
+    break;
+  case 4:
+    switch (*command) {
+    case 'i': expected = "item"; handler = handleItem; break;
+    case 't':
+      if (command[1] == 'i') {
+        expected = "time"; handler = handleTime;
+      } else {
+        expected = "type"; handler = handleType;
+      }
+      break;
+    }
+    break;
+  case 5:
+    switch (*command) {
+    case 'a': expected = "alive"; handler = handleAlive; break;
+    case 'c':
+      if (command[1] == 'l') {
+        expected = "clear"; handler = handleClear;
+      } else {
+        expected = "color"; handler = handleColor;
+      }
+      break;
+    case 'g': expected = "grasp"; handler = handleGrasp; break;
+    }
+    break;
+  case 6:
+    switch (*command) {
+    case 'e': expected = "extent"; handler = handleExtent; break;
+    case 'p': expected = "posvel"; handler = handlePosVel; break;
+    case 'r': expected = "rotvel"; handler = handleRotVel; break;
+    }
+    break;
+  case 7:
+    switch (*command) {
+    case 'd': expected = "destroy"; handler = handleDestroy; break;
+    case 'r': expected = "release"; handler = handleRelease; break;
+    }
+    break;
+  }
+  // Confirm the candidate, if any.
+  return expected && !strcmp(command, expected) ? handler : NULL;
+}
+
+
+bool parseLine(Parser* parser, char* line) {
   // TODO Extract command then scanf it?
   char *args, *command;
-  bool (*parse)(Parser* parser, char* args) = NULL;
-  command = cnParseStr(cnStr(line), &args);
-  // TODO Hashtable? This is still quite fast.
-  if (!strcmp(command, "alive")) {
-    parse = handleAlive;
-  } else if (!strcmp(command, "clear")) {
-    parse = handleClear;
-  } else if (!strcmp(command, "color")) {
-    parse = handleColor;
-  } else if (!strcmp(command, "destroy")) {
-    parse = handleDestroy;
-  } else if (!strcmp(command, "extent")) {
-    parse = handleExtent;
-  } else if (!strcmp(command, "grasp")) {
-    parse = handleGrasp;
-  } else if (!strcmp(command, "item")) {
-    parse = handleItem;
-  } else if (!strcmp(command, "pos")) {
-    parse = handlePos;
-  } else if (!strcmp(command, "posvel")) {
-    parse = handlePosVel;
-  } else if (!strcmp(command, "release")) {
-    parse = handleRelease;
-  } else if (!strcmp(command, "rot")) {
-    parse = handleRot;
-  } else if (!strcmp(command, "rotvel")) {
-    parse = handleRotVel;
-  } else if (!strcmp(command, "time")) {
-    parse = handleTime;
-  } else if (!strcmp(command, "type")) {
-    parse = handleType;
-  }
+  Handler parse;
+  command = cnParseStr(line, &args);
+  parse = findHandler(command);
   if (parse) {
     return parse(parser, args);
   } else {
@@ -307,7 +430,7 @@ bool parseLine(Parser* parser, String* line) {
 
 Item* parserItem(Parser* parser, char* begin, char** end) {
   // TODO Better validation?
-  Id id = strtol(begin, end, 10);
+  Id id = cnParseInt(begin, end);
   Index index = parser->indices[id];
   return &parser->state.items[index];
 }
@@ -325,4 +448,35 @@ void pushState(Parser* parser) {
 }
 
 
+bool saveSnapshot(Snapshot* snapshot, State* states, Count count) {
+  Count header[] = {sizeof(Item), count};
+  StateRecord* records;
+  bool result = false;
+
+  if (!(records = cnAlloc(StateRecord, count)) && count) return false;
+  for (Index s = 0; s < count; s++) {
+    State& state = states[s];
+    records[s].cleared = state.cleared;
+    records[s].itemCount = state.items.count;
+    records[s].time = state.time;
+  }
+  if (!(
+    snapshot->write(header, sizeof(header)) &&
+    snapshot->write(records, count * sizeof(StateRecord))
+  )) goto DONE;
+  // Items hold doubles, so there's no padding between states.
+  for (Index s = 0; s < count; s++) {
+    List<Item>& items = states[s].items;
+    if (!snapshot->write(items.items, items.count * sizeof(Item))) goto DONE;
+  }
+
+  // Winned.
+  result = true;
+
+  DONE:
+  free(records);
+  return result;
+}
+
+
 }}
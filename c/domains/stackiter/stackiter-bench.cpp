@@ -0,0 +1,151 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stackiter-learn.h"
+
+
+namespace ccndomain {namespace stackiter {
+
+
+/**
+ * Writes a synthetic log of roughly lineCount lines to the named file, using
+ * the same commands as real stackiter logs. Returns the actual line count, or
+ * a negative number on failure.
+ */
+concuno::Count generateLog(const char* name, concuno::Count lineCount);
+
+
+}}
+
+
+using namespace ccndomain::stackiter;
+using namespace concuno;
+using namespace std;
+
+
+/**
+ * Usage: stackiter-bench [lineCount [file]]
+ *
+ * Generates a synthetic log, then times loading it.
+ */
+int main(int argc, char** argv) {
+  Count lineCount = argc > 1 ? atol(argv[1]) : 1000000;
+  char defaultName[] = "stackiter-bench.log";
+  char* name = argc > 2 ? argv[2] : defaultName;
+  List<State> states;
+  int status = EXIT_FAILURE;
+
+  // Generate.
+  printf("Generating %s ...\n", name);
+  if ((lineCount = generateLog(name, lineCount)) < 0) {
+    printf("Failed to generate: %s\n", name);
+    goto DONE;
+  }
+
+  // Load and time.
+  {
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    if (!load(name, &states)) {
+      printf("Failed to load: %s\n", name);
+      goto DONE;
+    }
+    chrono::duration<double> seconds = chrono::steady_clock::now() - begin;
+    printf("%ld lines, %ld states in %.3lf s\n",
+      lineCount, states.count, seconds.count()
+    );
+    printf("%.0lf lines/sec\n", lineCount / seconds.count());
+  }
+
+  // Winned.
+  status = EXIT_SUCCESS;
+
+  DONE:
+  cnListEachBegin(&states, State, state) {
+    state->~State();
+  } cnEnd;
+  return status;
+}
+
+
+namespace ccndomain {namespace stackiter {
+
+
+Count generateLog(const char* name, Count lineCount) {
+  // A handful of items always around, with one recycled every so often to
+  // exercise destroy and item id growth.
+  Count itemCount = 12;
+  Count lines = 0;
+  Id nextId = 1;
+  Count step = 0;
+  Id* ids = cnAlloc(Id, itemCount);
+  FILE* file = NULL;
+  Index i;
+
+  if (!ids) cnErrTo(FAIL, "No ids.");
+  if (!(file = fopen(name, "w"))) cnErrTo(FAIL, "No file.");
+
+  // Fixed seed for repeatable logs.
+  srand(0);
+  for (i = 0; i < itemCount; i++) ids[i] = 0;
+  while (lines < lineCount) {
+    // Fill any empty slots with fresh items.
+    for (i = 0; i < itemCount; i++) {
+      if (ids[i]) continue;
+      Id id = ids[i] = nextId++;
+      fprintf(file, "item %ld\n", id);
+      fprintf(file, "type %ld %s\n", id, i ? "block" : "tool");
+      fprintf(file, "alive %ld true\n", id);
+      fprintf(file,
+        "color %ld %.4f %.4f %.4f 1\n",
+        id, rand() / (double)RAND_MAX, rand() / (double)RAND_MAX,
+        rand() / (double)RAND_MAX
+      );
+      fprintf(file, "extent %ld %.3f %.3f\n", id, 0.5 + i * 0.1, 0.5);
+      lines += 5;
+    }
+    // Advance time, and move everything.
+    step++;
+    fprintf(file, "time sim %ld %.4f\n", step, step / 60.0);
+    lines++;
+    for (i = 0; i < itemCount; i++) {
+      fprintf(file,
+        "pos %ld %.6f %.6f\n",
+        ids[i], -20 + 40 * rand() / (double)RAND_MAX, rand() / 1e8
+      );
+      fprintf(file,
+        "posvel %ld %.6f %.6f\n",
+        ids[i], rand() / 1e9 - 1, rand() / 1e9 - 1
+      );
+      fprintf(file, "rot %ld %.6f\n", ids[i], rand() / (double)RAND_MAX);
+      fprintf(file, "rotvel %ld %.6f\n", ids[i], rand() / 1e9 - 1);
+      lines += 4;
+    }
+    // Occasional tool action and block recycling.
+    if (!(step % 10)) {
+      fprintf(file, "grasp %ld %ld 0 0\n", ids[0], ids[1 + step % 11]);
+      fprintf(file, "release %ld %ld\n", ids[0], ids[1 + step % 11]);
+      lines += 2;
+    }
+    if (!(step % 25)) {
+      i = 1 + (step / 25) % (itemCount - 1);
+      fprintf(file, "destroy %ld\n", ids[i]);
+      ids[i] = 0;
+      lines++;
+    }
+  }
+  if (fclose(file)) {
+    file = NULL;
+    cnErrTo(FAIL, "Failed to close.");
+  }
+  free(ids);
+  return lines;
+
+  FAIL:
+  if (file) fclose(file);
+  free(ids);
+  return -1;
+}
+
+
+}}
@@ -6,8 +6,40 @@
 namespace ccndomain {namespace stackiter {
 
 
+typedef bool (*Choose)(
+  concuno::List<State>* states, concuno::List<concuno::Bag>* bags,
+  concuno::List<concuno::List<concuno::Entity>*>* entityLists
+);
+
+
+/**
+ * One log loaded and chosen into bags independently of all others, so that
+ * many can be handled at once.
+ */
+struct Session {
+
+  Session(const std::string& name, Choose choose);
+
+  /**
+   * Disposes of any bags not yet moved out, then the states.
+   */
+  ~Session();
+
+  concuno::List<concuno::Bag> bags;
+
+  Choose choose;
+
+  concuno::List<concuno::List<concuno::Entity>*> entityLists;
+
+  std::string name;
+
+  concuno::List<State> states;
+
+};
+
+
 void clusterStuff(
-  concuno::List<State>& states,
+  concuno::List<concuno::Bag>* bags,
   std::vector<concuno::EntityFunction*>& functions
 );
 
@@ -18,15 +50,30 @@ void initSchemaAndEntityFunctions(
 
 
 bool learnConcept(
-  concuno::List<State>* states,
-  std::vector<concuno::EntityFunction*>* functions,
-  bool (*choose)(
-    concuno::List<State>* states, concuno::List<concuno::Bag>* bags,
-    concuno::List<concuno::List<concuno::Entity>*>* entityLists
-  )
+  concuno::List<concuno::Bag>* bags,
+  std::vector<concuno::EntityFunction*>* functions
 );
 
 
+/**
+ * Loads and chooses each session in parallel, then moves all bags and entity
+ * lists into the given lists in session order. The order of the result is
+ * therefore independent of thread scheduling. The sessions keep the states
+ * that the bags point into, so keep them around until the bags are disposed.
+ */
+bool loadSessions(
+  std::vector<Session*>& sessions,
+  concuno::List<concuno::Bag>* bags,
+  concuno::List<concuno::List<concuno::Entity>*>* entityLists
+);
+
+
+/**
+ * Worker for loadSessions, for use with cnParallelEach.
+ */
+bool loadSessions_session(concuno::RefAny info, concuno::Index index);
+
+
 }}
 
 
@@ -35,10 +82,23 @@ using namespace concuno;
 using namespace std;
 
 
+/**
+ * Usage: stackiter-learn file-or-pattern...
+ *
+ * Each file is a separate log, and patterns are expanded as by the shell, for
+ * cases of too many files for the command line. Logs are parsed in parallel,
+ * by CONCUNO_WORKERS threads if set.
+ */
 int main(int argc, char** argv) {
+  List<Bag> bags;
+  Choose choose;
+  List<List<Entity>*> entityLists;
   AutoVec<EntityFunction*> entityFunctions;
+  int mode = 1;
+  vector<string> names;
   Schema schema;
-  List<State> states;
+  AutoVec<Session*> sessions;
+  Count stateCount = 0;
   int status = EXIT_FAILURE;
 
   // Validate args.
@@ -46,29 +106,41 @@ int main(int argc, char** argv) {
     printf("No data file specified.\n");
     goto DONE;
   }
+  for (int a = 1; a < argc; a++) {
+    if (!cnGlob(argv[a], &names)) throw Error("Failed to find files.");
+  }
 
-  // Load file and show stats.
-  if (!load(argv[1], &states)) {
-    throw Error("Failed to load file.");
+  // Mode 1 attempts learning the "falls on" predictive concept.
+  choose = mode == 2 ? allBagsFalse : chooseDropWhereLandOnOther;
+
+  // Load files and show stats.
+  for (size_t n = 0; n < names.size(); n++) {
+    pushOrDelete(*sessions, new Session(names[n], choose));
+  }
+  if (!loadSessions(*sessions, &bags, &entityLists)) {
+    throw Error("Failed to load files.");
+  }
+  for (size_t s = 0; s < sessions->size(); s++) {
+    stateCount += sessions[s]->states.count;
   }
   printf("At end:\n");
-  printf("%ld items\n", states[states.count - 1].items.count);
-  printf("%ld states\n", states.count);
+  if (sessions[sessions->size() - 1]->states.count) {
+    List<State>& states = sessions[sessions->size() - 1]->states;
+    printf("%ld items\n", states[states.count - 1].items.count);
+  }
+  printf("%ld states in %ld files\n", stateCount, (Count)sessions->size());
 
   // Set up schema.
   initSchemaAndEntityFunctions(schema, *entityFunctions);
 
-  switch (1) {
+  switch (mode) {
   case 1:
-    // Attempt learning the "falls on" predictive concept.
-    if (!learnConcept(
-      &states, &*entityFunctions, chooseDropWhereLandOnOther
-    )) {
+    if (!learnConcept(&bags, &*entityFunctions)) {
       throw Error("No learned tree.");
     }
     break;
   case 2:
-    clusterStuff(states, *entityFunctions);
+    clusterStuff(&bags, *entityFunctions);
     break;
   default:
     printf("Didn't do anything!\n");
@@ -78,9 +150,8 @@ int main(int argc, char** argv) {
   status = EXIT_SUCCESS;
 
   DONE:
-  cnListEachBegin(&states, State, state) {
-    state->~State();
-  } cnEnd;
+  // Bags and entities, before the states they point into.
+  cnBagListDispose(&bags, entityLists.count ? &entityLists : NULL);
   return status;
 }
 
@@ -88,27 +159,27 @@ int main(int argc, char** argv) {
 namespace ccndomain {namespace stackiter {
 
 
-void clusterStuff(
-  List<State>& states, vector<EntityFunction*>& functions
-) {
-  List<Bag> bags;
+Session::Session(const string& $name, Choose $choose):
+  choose($choose), name($name) {}
 
-  // Choose out the states we want to focus on.
-  if (!allBagsFalse(&states, &bags, NULL)) {
-    throw Error("Failed to choose bags.");
-  }
 
+Session::~Session() {
+  cnBagListDispose(&bags, entityLists.count ? &entityLists : NULL);
+  cnListEachBegin(&states, State, state) {
+    state->~State();
+  } cnEnd;
+}
+
+
+void clusterStuff(
+  List<Bag>* bags, vector<EntityFunction*>& functions
+) {
   // The last function right now should be velocity. TODO Watch out for changes!
   // TODO Be more thorough about clustering. Try it all as for tree learning.
   EntityFunction* function = functions[functions.size() - 1];
-  if (!cnClusterOnFunction(&bags, function)) {
+  if (!cnClusterOnFunction(bags, function)) {
     throw Error("Clustering failed.");
   }
-
-  // TODO Auto!
-  cnListEachBegin(&bags, Bag, bag) {
-    bag->~Bag();
-  } cnEnd;
 }
 
 
@@ -162,36 +233,25 @@ void initSchemaAndEntityFunctions(
 
 
 bool learnConcept(
-  List<State>* states,
-  vector<EntityFunction*>* functions,
-  bool (*choose)(
-    List<State>* states, List<Bag>* bags,
-    List<List<Entity>*>* entityLists
-  )
+  List<Bag>* bags, vector<EntityFunction*>* functions
 ) {
-  List<Bag> bags;
-  List<List<Entity>*> entityLists;
   RootNode* learnedTree = NULL;
   Learner learner;
   bool result = false;
   Count trueCount;
 
-  // Choose out the states we want to focus on.
-  if (!choose(states, &bags, &entityLists)) {
-    cnErrTo(DONE, "Failed to choose bags.");
-  }
   trueCount = 0;
-  cnListEachBegin(&bags, Bag, bag) {
+  cnListEachBegin(bags, Bag, bag) {
     trueCount += bag->label;
   } cnEnd;
   // TODO Also print mean number of items in chosen states?
-  printf("%ld true of %ld bags\n", trueCount, bags.count);
+  printf("%ld true of %ld bags\n", trueCount, bags->count);
   // Shuffle bags, with controlled seed (and my own generator?).
   // TODO Shuffle here copies more than just single pointers.
-  cnListShuffle(&bags);
+  cnListShuffle(bags, learner.random);
 
   // Learn a tree.
-  learner.bags = &bags;
+  learner.bags = bags;
   learner.entityFunctions = &*functions;
   learnedTree = learner.learnTree();
   if (!learnedTree) cnErrTo(DONE, "No learned tree.");
@@ -209,11 +269,60 @@ bool learnConcept(
   cnNodeDrop(&learnedTree->node);
 
   DONE:
-  // Bags and entities.
-  cnBagListDispose(&bags, entityLists.count ? &entityLists : NULL);
-  // Result.
   return result;
 }
 
 
+bool loadSessions(
+  vector<Session*>& sessions,
+  List<Bag>* bags, List<List<Entity>*>* entityLists
+) {
+  if (!cnParallelEach(sessions.size(), 0, loadSessions_session, &sessions)) {
+    cnErrTo(FAIL, "Failed to load sessions.");
+  }
+
+  // Move everything out in order. Zeroed counts mean the session no longer
+  // owns the items. Pushing nothing gives null, so check counts first.
+  for (size_t s = 0; s < sessions.size(); s++) {
+    Session* session = sessions[s];
+    if (session->bags.count && !cnListPushAll(bags, &session->bags)) {
+      cnErrTo(FAIL, "Failed to gather bags.");
+    }
+    session->bags.count = 0;
+    if (
+      session->entityLists.count &&
+      !cnListPushAll(entityLists, &session->entityLists)
+    ) {
+      cnErrTo(FAIL, "Failed to gather entity lists.");
+    }
+    session->entityLists.count = 0;
+  }
+
+  // Winned.
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
+bool loadSessions_session(RefAny info, Index index) {
+  Session* session = (*reinterpret_cast<vector<Session*>*>(info))[index];
+  char* name = &session->name[0];
+
+  if (!load(name, &session->states)) cnErrTo(FAIL, "Failed to load: %s", name);
+  if (!session->choose(
+    &session->states, &session->bags, &session->entityLists
+  )) {
+    cnErrTo(FAIL, "Failed to choose bags: %s", name);
+  }
+
+  // Winned.
+  return true;
+
+  FAIL:
+  return false;
+}
+
+
 }}
@@ -10,15 +10,28 @@ Args::Args(int argc, char** argv) {
 
 
 void Args::parse(int argc, char** argv) {
-  if (argc < 4) {
+  if (argc == 2 || argc == 3) {
+    // Just one SMRF or bag archive file.
+    if (cnStrEndsWith(argv[1], ".bags")) {
+      bagsFile = argv[1];
+    } else {
+      smrfFile = argv[1];
+    }
+    if (argc == 3) saveBagsFile = argv[2];
+    return;
+  }
+  if (argc < 4 || argc > 5) {
     throw Error(
       Buf() << "Usage: " << argv[0] <<
-        " <features-file> <labels-file> <label-id>"
+        " <features-file> <labels-file> <label-id> [save-bags-file]\n" <<
+        "   or: " << argv[0] <<
+        " <smrf-json-file or .bags-file> [save-bags-file]"
     );
   }
   featuresFile = argv[1];
   labelsFile = argv[2];
   label = argv[3];
+  if (argc == 5) saveBagsFile = argv[4];
 }
 
 
@@ -21,6 +21,11 @@ struct Args {
 
   void parse(int argc, char** argv);
 
+  /**
+   * A bag archive to load bags from, used instead of the tables if given.
+   */
+  std::string bagsFile;
+
   /**
    * The file to use for loading bags and entity feature vectors.
    */
@@ -36,6 +41,18 @@ struct Args {
    */
   std::string labelsFile;
 
+  /**
+   * If given, the loaded bags are also saved here as a bag archive, for
+   * quicker loading next time.
+   */
+  std::string saveBagsFile;
+
+  /**
+   * An SMRF JSON file with both bags and labels, used instead of the tables
+   * if given.
+   */
+  std::string smrfFile;
+
 };
 
 
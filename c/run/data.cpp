@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include "data.h"
 
@@ -116,13 +117,20 @@ Type* loadTable(
 }
 
 
-void pickFunctions(std::vector<EntityFunction*>& functions, Type* type) {
+void pickFunctions(
+  std::vector<EntityFunction*>& functions, Type* type,
+  const std::vector<std::string>* names
+) {
   // For now, just put in valid and common functions for each property.
   (new ValidityEntityFunction(*type->schema, 1))->pushOrDelete(functions);
   (new ValidityEntityFunction(*type->schema, 2))->pushOrDelete(functions);
   // Loop on all but the first (the bag id).
   for (size_t p = 1; p < type->properties->size(); p++) {
     Property& property = *type->properties[p];
+    if (
+      names &&
+      find(names->begin(), names->end(), property.name) == names->end()
+    ) continue;
     EntityFunction* function = new PropertyEntityFunction(property);
     function->pushOrDelete(functions);
     // TODO Distance (and difference?) angle, too?
@@ -46,7 +46,14 @@ Type* loadTable(
 );
 
 
-void pickFunctions(std::vector<EntityFunction*>& functions, Type* type);
+/**
+ * Picks functions on the properties of the type, except for the first (the bag
+ * id). If names are given, only properties with those names are used.
+ */
+void pickFunctions(
+  std::vector<EntityFunction*>& functions, Type* type,
+  const std::vector<std::string>* names = NULL
+);
 
 
 void printType(Type* type);
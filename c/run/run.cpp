@@ -7,30 +7,53 @@ using namespace std;
 
 int main(int argc, char** argv) {
   Args args(argc, argv);
-  List<Bag> bags;
+  BagArchive archive;
+  List<Bag> loadedBags;
+  List<Bag>* bags = &loadedBags;
   ListAny features;
+  Type* featureType;
+  vector<string> fieldNames;
   AutoVec<EntityFunction*> functions;
   ListAny labels;
   RootNode* learnedTree = NULL;
   Learner learner;
   Schema schema;
 
-  // Load all the data. Calling labels a "type" is abusive but works enough.
-  Type* featureType =
-    loadTable(args.featuresFile, "Feature", schema, &features);
-  Type* labelType = loadTable(args.labelsFile, "Label", schema, &labels);
-
-  // Build labeled bags.
+  if (!args.bagsFile.empty()) {
+    // Bags and entities straight from the archive.
+    if (!archive.load(args.bagsFile.c_str(), schema)) throw Error("No bags.");
+    bags = &archive.bags;
+    featureType = archive.type;
+    printf("Loaded %ld bags.\n", bags->count);
+  } else if (args.smrfFile.empty()) {
+    // Load all the data. Calling labels a "type" is abusive but works enough.
+    featureType = loadTable(args.featuresFile, "Feature", schema, &features);
+    Type* labelType = loadTable(args.labelsFile, "Label", schema, &labels);
+    // Build labeled bags.
+    if (
+      !buildBags(
+        bags, args.label, labelType, &labels, featureType, &features
+      )
+    ) throw Error("No bags.");
+  } else {
+    // Bags come straight from SMRF, with the fields to use.
+    featureType =
+      loadSmrf(args.smrfFile, schema, &features, bags, &fieldNames);
+    printf("Loaded %ld bags.\n", bags->count);
+  }
   if (
-    !buildBags(&bags, args.label, labelType, &labels, featureType, &features)
-  ) throw Error("No bags.");
+    !args.saveBagsFile.empty() &&
+    !cnBagArchiveSave(args.saveBagsFile.c_str(), bags, featureType)
+  ) throw Error("Failed to save bags.");
   // Choose some functions. TODO How to specify which??
-  pickFunctions(*functions, featureType);
+  pickFunctions(
+    *functions, featureType, fieldNames.empty() ? NULL : &fieldNames
+  );
   printf("\n");
 
   // Learn something.
-  cnListShuffle(&bags);
-  learner.bags = &bags;
+  cnListShuffle(bags, learner.random);
+  learner.bags = bags;
   learner.entityFunctions = &*functions;
   learnedTree = learner.learnTree();
   if (!learnedTree) throw Error("No learned tree.");
@@ -42,6 +65,6 @@ int main(int argc, char** argv) {
 
   // All done. TODO RAII.
   cnNodeDrop(&learnedTree->node);
-  cnBagListDispose(&bags, NULL);
+  cnBagListDispose(&loadedBags, NULL);
   return EXIT_SUCCESS;
 }
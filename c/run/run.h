@@ -3,5 +3,6 @@
 
 #include "args.h"
 #include "data.h"
+#include "smrf.h"
 
 #endif
@@ -0,0 +1,621 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <yajl/api/yajl_parse.h>
+#include "data.h"
+#include "smrf.h"
+
+using namespace std;
+
+
+namespace concuno {namespace run {
+
+
+/**
+ * Nesting levels within an SMRF document, counted by open arrays and maps.
+ */
+enum SmrfLevel {
+
+  /**
+   * Directly inside the outer array.
+   */
+  SmrfLevelTop = 1,
+
+  /**
+   * Inside the bag array or the field name array.
+   */
+  SmrfLevelList,
+
+  /**
+   * Inside a bag map.
+   */
+  SmrfLevelBag,
+
+  /**
+   * Inside a bag's item array.
+   */
+  SmrfLevelItems,
+
+  /**
+   * Inside an item map, or deeper in its values.
+   */
+  SmrfLevelItem,
+
+};
+
+
+/**
+ * Keys of interest inside bag maps.
+ */
+enum SmrfBagKey {
+  SmrfBagKeyId,
+  SmrfBagKeyItems,
+  SmrfBagKeyLabel,
+  SmrfBagKeyOther,
+  SmrfBagKeyParticipantDepths,
+};
+
+
+/**
+ * Special field indices for item keys that aren't properties.
+ */
+enum {
+  SmrfFieldDepth = -2,
+  SmrfFieldNone = -1,
+};
+
+
+/**
+ * An item field and where its values go.
+ */
+struct SmrfField {
+
+  /**
+   * The key as given in the file.
+   */
+  string key;
+
+  /**
+   * Where in the item the first value goes, in bytes.
+   */
+  Count offset;
+
+  /**
+   * The number of values.
+   */
+  Count count;
+
+};
+
+
+/**
+ * Parsing state, as the context for yajl callbacks.
+ */
+struct SmrfParser {
+
+  SmrfParser(Schema& schema, ListAny* items, List<Bag>* bags);
+
+  /**
+   * The bag being parsed, always the last in bags.
+   */
+  Bag* bag;
+
+  /**
+   * The id of the current bag, from __label__ if given.
+   */
+  Index bagId;
+
+  SmrfBagKey bagKey;
+
+  List<Bag>* bags;
+
+  /**
+   * The index in items of each bag's first item, for building entity lists
+   * once items stop moving.
+   */
+  List<Index> bagFirsts;
+
+  /**
+   * The __instantiable_depth__ of each item, or -1 if none.
+   */
+  List<Index> depths;
+
+  /**
+   * The __participant_depths__ of each bag, or -1 if not given.
+   */
+  List<Index> participantDepths;
+
+  /**
+   * Set with a message when a callback fails.
+   */
+  const char* error;
+
+  /**
+   * The field for the current item key.
+   */
+  Index field;
+
+  vector<string>* fieldNames;
+
+  /**
+   * Fields for item properties, after the first item defines them.
+   */
+  vector<SmrfField> fields;
+
+  /**
+   * Values of the first item, in field order, until the type exists.
+   */
+  vector<Float> firstValues;
+
+  /**
+   * The current item, valid only until the next is expanded.
+   */
+  char* item;
+
+  ListAny* items;
+
+  /**
+   * How many arrays and maps are open.
+   */
+  Count level;
+
+  Schema* schema;
+
+  /**
+   * The number of values so far for the current field.
+   */
+  Count slot;
+
+  /**
+   * Which element of the outer array is open, where 0 is the bag array and 1
+   * is the field name array.
+   */
+  Index top;
+
+  /**
+   * The item type, created at the end of the first item.
+   */
+  Type* type;
+
+};
+
+
+/**
+ * Handles the end of a bag map.
+ */
+bool cnSmrfBagEnd(SmrfParser* parser);
+
+
+/**
+ * Handles the start of a bag map.
+ */
+bool cnSmrfBagStart(SmrfParser* parser);
+
+
+int cnSmrfBoolean(void* parser, int value);
+
+
+int cnSmrfDouble(void* parser, double value);
+
+
+int cnSmrfEndArray(void* parser);
+
+
+int cnSmrfEndMap(void* parser);
+
+
+/**
+ * Builds entity lists and participant options for all bags once the items
+ * are all in place.
+ */
+void cnSmrfFinish(SmrfParser* parser);
+
+
+int cnSmrfInteger(void* parser, long long value);
+
+
+/**
+ * Handles the end of an item map. The first item defines the type.
+ */
+bool cnSmrfItemEnd(SmrfParser* parser);
+
+
+/**
+ * Handles the start of an item map.
+ */
+bool cnSmrfItemStart(SmrfParser* parser);
+
+
+/**
+ * Expands the items by one, filled with NaNs, and returns it, or null on
+ * failure.
+ */
+char* cnSmrfItemExpand(SmrfParser* parser);
+
+
+int cnSmrfMapKey(void* parser, const unsigned char* key, size_t size);
+
+
+int cnSmrfNull(void* parser);
+
+
+int cnSmrfStartArray(void* parser);
+
+
+int cnSmrfStartMap(void* parser);
+
+
+int cnSmrfString(void* parser, const unsigned char* value, size_t size);
+
+
+/**
+ * Handles any scalar, with NaN for null and 0 or 1 for booleans.
+ */
+int cnSmrfValue(SmrfParser* parser, Float value);
+
+
+Type* loadSmrf(
+  const string& fileName, Schema& schema, ListAny* items, List<Bag>* bags,
+  vector<string>* fieldNames
+) {
+  yajl_callbacks callbacks = {
+    cnSmrfNull, cnSmrfBoolean, cnSmrfInteger, cnSmrfDouble, NULL,
+    cnSmrfString, cnSmrfStartMap, cnSmrfMapKey, cnSmrfEndMap,
+    cnSmrfStartArray, cnSmrfEndArray
+  };
+  // Chunks for streaming, rather than reading the whole file.
+  unsigned char buffer[1 << 16];
+  FILE* file = NULL;
+  yajl_handle handle = NULL;
+  SmrfParser parser(schema, items, bags);
+  Count size = 0;
+  yajl_status status = yajl_status_ok;
+
+  parser.fieldNames = fieldNames;
+  if (!(file = fopen(fileName.c_str(), "rb"))) {
+    throw Error(Buf() << "Couldn't open: " << fileName);
+  }
+  if (!(handle = yajl_alloc(&callbacks, NULL, &parser))) {
+    fclose(file);
+    throw Error("No json parser.");
+  }
+
+  // Parse as we read.
+  while (status == yajl_status_ok) {
+    if (!(size = fread(buffer, 1, sizeof(buffer), file))) break;
+    status = yajl_parse(handle, buffer, size);
+  }
+  if (status == yajl_status_ok && ferror(file)) {
+    parser.error = "Error reading file.";
+  } else if (status == yajl_status_ok) {
+    status = yajl_complete_parse(handle);
+  }
+  fclose(file);
+
+  // Report any trouble.
+  if (!parser.error && status == yajl_status_error) {
+    unsigned char* message = yajl_get_error(handle, 1, buffer, size);
+    string text(reinterpret_cast<char*>(message));
+    yajl_free_error(handle, message);
+    yajl_free(handle);
+    throw Error(Buf() << "Bad json in " << fileName << ": " << text);
+  }
+  yajl_free(handle);
+  if (!parser.error && !parser.type) parser.error = "No items.";
+  if (parser.error) {
+    throw Error(Buf() << parser.error << " (" << fileName << ")");
+  }
+
+  // Point the bags at their entities.
+  cnSmrfFinish(&parser);
+
+  // We winned!
+  return parser.type;
+}
+
+
+SmrfParser::SmrfParser(
+  Schema& $schema, ListAny* $items, List<Bag>* $bags
+):
+  bag(NULL), bagId(0), bagKey(SmrfBagKeyOther), bags($bags), error(NULL),
+  field(SmrfFieldNone), fieldNames(NULL), item(NULL), items($items), level(0),
+  schema(&$schema), slot(0), top(-1), type(NULL)
+{}
+
+
+bool cnSmrfBagEnd(SmrfParser* parser) {
+  // Now we know the bag id for each item.
+  if (parser->type) {
+    char* item = reinterpret_cast<char*>(parser->items->items) +
+      parser->bagFirsts[parser->bagFirsts.count - 1] *
+      parser->items->itemSize;
+    char* end = reinterpret_cast<char*>(cnListEnd(parser->items));
+    for (; item < end; item += parser->items->itemSize) {
+      *reinterpret_cast<Float*>(item) = parser->bagId;
+    }
+  }
+  parser->bag = NULL;
+  return true;
+}
+
+
+bool cnSmrfBagStart(SmrfParser* parser) {
+  Bag* bag;
+  Index none = -1;
+  if (!(bag = reinterpret_cast<Bag*>(cnListExpand(parser->bags)))) {
+    parser->error = "No bag.";
+    return false;
+  }
+  new(bag) Bag;
+  parser->bag = bag;
+  // Default to the bag index for an id.
+  parser->bagId = parser->bags->count - 1;
+  parser->bagKey = SmrfBagKeyOther;
+  if (!(
+    cnListPush(&parser->bagFirsts, &parser->items->count) &&
+    cnListPush(&parser->participantDepths, &none)
+  )) {
+    parser->error = "No bag start.";
+    return false;
+  }
+  return true;
+}
+
+
+int cnSmrfBoolean(void* parser, int value) {
+  return cnSmrfValue(reinterpret_cast<SmrfParser*>(parser), value ? 1 : 0);
+}
+
+
+int cnSmrfDouble(void* parser, double value) {
+  return cnSmrfValue(reinterpret_cast<SmrfParser*>(parser), value);
+}
+
+
+int cnSmrfEndArray(void* $parser) {
+  SmrfParser* parser = reinterpret_cast<SmrfParser*>($parser);
+  parser->level--;
+  return true;
+}
+
+
+int cnSmrfEndMap(void* $parser) {
+  SmrfParser* parser = reinterpret_cast<SmrfParser*>($parser);
+  parser->level--;
+  if (parser->top || !parser->bag) return true;
+  if (parser->level == SmrfLevelList) return cnSmrfBagEnd(parser);
+  if (
+    parser->level == SmrfLevelItems && parser->bagKey == SmrfBagKeyItems
+  ) return cnSmrfItemEnd(parser);
+  return true;
+}
+
+
+void cnSmrfFinish(SmrfParser* parser) {
+  char* items = reinterpret_cast<char*>(parser->items->items);
+  Count itemSize = parser->items->itemSize;
+  Index* depths = reinterpret_cast<Index*>(parser->depths.items);
+
+  for (Index b = 0; b < parser->bags->count; b++) {
+    Bag* bag = &(*parser->bags)[b];
+    Index begin = parser->bagFirsts[b];
+    Index end = b + 1 < parser->bagFirsts.count ?
+      parser->bagFirsts[b + 1] : parser->items->count;
+    // Depths from here on aren't pinned.
+    Index unpinned = parser->participantDepths[b];
+    if (unpinned < 0) {
+      // Older files don't say, so guess the deepest marks the unpinned.
+      for (Index i = begin; i < end; i++) {
+        if (depths[i] > unpinned) unpinned = depths[i];
+      }
+    }
+    for (Index i = begin; i < end; i++) {
+      Entity entity = items + i * itemSize;
+      if (!cnListPush(bag->entities, &entity)) throw Error("No entity.");
+      if (depths[i] >= 0 && depths[i] < unpinned) {
+        bag->pushParticipant(depths[i], entity);
+      }
+    }
+  }
+}
+
+
+int cnSmrfInteger(void* parser, long long value) {
+  return cnSmrfValue(reinterpret_cast<SmrfParser*>(parser), value);
+}
+
+
+bool cnSmrfItemEnd(SmrfParser* parser) {
+  if (!parser->type) {
+    // First item, so build the type, with the bag id first.
+    vector<SmrfField> fields;
+    Float* value = parser->firstValues.empty() ? NULL : &parser->firstValues[0];
+    Type* type = new Type(*parser->schema, "Feature", 0);
+    pushOrDelete(*parser->schema->types, type);
+    pushOrExpandProperty(type, "Bag", NULL);
+    for (size_t f = 0; f < parser->fields.size(); f++) {
+      SmrfField& field = parser->fields[f];
+      // Capitalized like smrf2concuno, for the same names as from tables.
+      string name(field.key);
+      TypedOffset offset;
+      if (!field.count) continue;
+      for (size_t c = 0; c < name.size(); c++) {
+        name[c] = c ? tolower(name[c]) : toupper(name[c]);
+      }
+      for (Index c = 0; c < field.count; c++) {
+        pushOrExpandProperty(type, name, c ? NULL : &offset);
+      }
+      field.offset = offset.offset;
+      fields.push_back(field);
+    }
+    parser->fields.swap(fields);
+    parser->items->itemSize = type->size;
+    parser->type = type;
+    printType(type);
+    // Now store the first item.
+    if (!(parser->item = cnSmrfItemExpand(parser))) return false;
+    for (size_t f = 0; f < parser->fields.size(); f++) {
+      SmrfField& field = parser->fields[f];
+      Float* slots = reinterpret_cast<Float*>(parser->item + field.offset);
+      for (Index c = 0; c < field.count; c++) slots[c] = *value++;
+    }
+  }
+  parser->item = NULL;
+  return true;
+}
+
+
+char* cnSmrfItemExpand(SmrfParser* parser) {
+  Float* item;
+  Float* end;
+  if (!(item = reinterpret_cast<Float*>(cnListExpand(parser->items)))) {
+    parser->error = "No item.";
+    return NULL;
+  }
+  end = item + parser->items->itemSize / sizeof(Float);
+  for (Float* slot = item; slot < end; slot++) *slot = cnNaN();
+  return reinterpret_cast<char*>(item);
+}
+
+
+bool cnSmrfItemStart(SmrfParser* parser) {
+  Index none = -1;
+  // Items can't be expanded until the first defines the type.
+  if (parser->type && !(parser->item = cnSmrfItemExpand(parser))) {
+    return false;
+  }
+  if (!cnListPush(&parser->depths, &none)) {
+    parser->error = "No depth.";
+    return false;
+  }
+  parser->field = SmrfFieldNone;
+  return true;
+}
+
+
+int cnSmrfMapKey(void* $parser, const unsigned char* $key, size_t size) {
+  SmrfParser* parser = reinterpret_cast<SmrfParser*>($parser);
+  const char* key = reinterpret_cast<const char*>($key);
+  if (parser->top || !parser->bag) return true;
+  if (parser->level == SmrfLevelBag) {
+    // Bag key.
+    string name(key, size);
+    parser->bagKey =
+      name == "items" ? SmrfBagKeyItems :
+      name == "label" ? SmrfBagKeyLabel :
+      name == "__label__" ? SmrfBagKeyId :
+      name == "__participant_depths__" ? SmrfBagKeyParticipantDepths :
+      SmrfBagKeyOther;
+  } else if (
+    parser->level == SmrfLevelItem && parser->bagKey == SmrfBagKeyItems
+  ) {
+    // Item key.
+    parser->slot = 0;
+    if (size == 22 && !strncmp(key, "__instantiable_depth__", size)) {
+      parser->field = SmrfFieldDepth;
+    } else if (size >= 2 && !strncmp(key, "__", 2)) {
+      // Other metadata.
+      parser->field = SmrfFieldNone;
+    } else if (!parser->type) {
+      // First item, so any key might be a field.
+      SmrfField field;
+      field.key.assign(key, size);
+      field.offset = 0;
+      field.count = 0;
+      parser->fields.push_back(field);
+      parser->field = parser->fields.size() - 1;
+    } else {
+      // Later items usually keep the same order, so check the next first.
+      Count fieldCount = parser->fields.size();
+      Index next = parser->field < 0 ? 0 : parser->field + 1;
+      parser->field = SmrfFieldNone;
+      for (Index f = 0; f < fieldCount; f++) {
+        SmrfField& field = parser->fields[(next + f) % fieldCount];
+        if (
+          field.key.size() == size && !strncmp(field.key.data(), key, size)
+        ) {
+          parser->field = (next + f) % fieldCount;
+          break;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+int cnSmrfNull(void* parser) {
+  return cnSmrfValue(reinterpret_cast<SmrfParser*>(parser), cnNaN());
+}
+
+
+int cnSmrfStartArray(void* $parser) {
+  SmrfParser* parser = reinterpret_cast<SmrfParser*>($parser);
+  if (parser->level == SmrfLevelTop) parser->top++;
+  parser->level++;
+  return true;
+}
+
+
+int cnSmrfStartMap(void* $parser) {
+  SmrfParser* parser = reinterpret_cast<SmrfParser*>($parser);
+  parser->level++;
+  if (parser->top) return true;
+  if (parser->level == SmrfLevelBag) return cnSmrfBagStart(parser);
+  if (
+    parser->level == SmrfLevelItem && parser->bagKey == SmrfBagKeyItems
+  ) return cnSmrfItemStart(parser);
+  return true;
+}
+
+
+int cnSmrfString(void* $parser, const unsigned char* value, size_t size) {
+  SmrfParser* parser = reinterpret_cast<SmrfParser*>($parser);
+  if (parser->top == 1 && parser->level == SmrfLevelList) {
+    string name(reinterpret_cast<const char*>(value), size);
+    // Fields that are bogus for us, as in smrf2concuno.
+    if (name == "combo" || name == "distractor_matlab") return true;
+    for (size_t c = 0; c < name.size(); c++) {
+      name[c] = c ? tolower(name[c]) : toupper(name[c]);
+    }
+    parser->fieldNames->push_back(name);
+  }
+  return true;
+}
+
+
+int cnSmrfValue(SmrfParser* parser, Float value) {
+  if (parser->top || !parser->bag) return true;
+  if (parser->level == SmrfLevelBag) {
+    // Bag id, label, or participant depths.
+    if (parser->bagKey == SmrfBagKeyId) parser->bagId = value;
+    if (parser->bagKey == SmrfBagKeyLabel) parser->bag->label = value != 0;
+    if (parser->bagKey == SmrfBagKeyParticipantDepths) {
+      parser->participantDepths[parser->participantDepths.count - 1] = value;
+    }
+  } else if (
+    parser->level >= SmrfLevelItem && parser->bagKey == SmrfBagKeyItems
+  ) {
+    // Item value, whether directly or nested, as in column vectors.
+    if (parser->field == SmrfFieldDepth) {
+      parser->depths[parser->depths.count - 1] = value;
+    } else if (parser->field == SmrfFieldNone) {
+      // Nothing to keep.
+    } else if (!parser->type) {
+      parser->firstValues.push_back(value);
+      parser->fields[parser->field].count++;
+    } else {
+      SmrfField& field = parser->fields[parser->field];
+      if (parser->slot >= field.count) {
+        parser->error = "More item values than in the first item.";
+        return false;
+      }
+      reinterpret_cast<Float*>(parser->item + field.offset)[parser->slot++] =
+        value;
+    }
+  }
+  return true;
+}
+
+
+}}
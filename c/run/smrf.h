@@ -0,0 +1,42 @@
+#ifndef concuno_run_smrf_h
+#define concuno_run_smrf_h
+
+
+#include <concuno.h>
+
+
+namespace concuno {namespace run {
+
+
+/**
+ * Streams bags from an SMRF JSON file, such as those written for keepaway by
+ * the robocup domain, straight into concuno bags, without building the whole
+ * document in memory.
+ *
+ * The file holds an array of bags (maps with "items", "__label__" for the bag
+ * id, "label", and optionally "__participant_depths__") followed by an array
+ * of the item field names to use. The numeric fields of the first item define
+ * the item type, named and laid out as by py/smrf2concuno.py with loadTable: a
+ * "Bag" id followed by each field, capitalized, with one Float for each number
+ * in its (possibly nested) value.
+ *
+ * Item "__instantiable_depth__" values give participant options. Items at
+ * depths below the bag's "__participant_depths__" are pushed as participants at
+ * their depths, and the rest are unpinned. For older files without that count,
+ * items at the deepest depth in each bag are taken as unpinned.
+ *
+ * Entities point into items, which should live as long as the bags. The field
+ * names from the file, capitalized to match the properties, go in fieldNames.
+ *
+ * Returns the created item type, or throws on failure.
+ */
+Type* loadSmrf(
+  const std::string& fileName, Schema& schema, ListAny* items, List<Bag>* bags,
+  std::vector<std::string>* fieldNames
+);
+
+
+}}
+
+
+#endif
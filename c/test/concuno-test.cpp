@@ -24,6 +24,9 @@ void testLog();
 void testMultinomial();
 
 
+void testNormalPValue();
+
+
 void testPermutations();
 
 
@@ -36,6 +39,9 @@ void testRadians();
 void testReframe();
 
 
+void testSearch();
+
+
 void testUnitRand();
 
 
@@ -59,9 +65,15 @@ int main() {
   case 'm':
     testMultinomial();
     break;
+  case 'n':
+    testNormalPValue();
+    break;
   case 'p':
     testPermutations();
     break;
+  case 'q':
+    testSearch();
+    break;
   case 'r':
     testPropagate();
     break;
@@ -118,63 +130,58 @@ void testBinomial() {
 }
 
 
-void testHeap_destroyItem(RefAny unused, RefAny item) {
-  free(item);
-}
-
-bool testHeap_greater(RefAny unused, RefAny a, RefAny b) {
-  Float indexA = *(Float*)a;
-  Float indexB = *(Float*)b;
-  // Make it a max heap for kicks.
-  return indexA > indexB;
-}
-
 #define testHeap_COUNT 10
 
 void testHeap() {
-  Heap<Index>* heap =
-    reinterpret_cast<Heap<Index>*>(cnHeapCreate(testHeap_greater));
+  // Make it a max heap for kicks.
+  Heap<Float, std::greater<Float> > heap;
+  Heap<Float, std::greater<Float> >::Handle handle = 0;
+  List<Float> numbers;
   Index i;
-  if (!heap) cnErrTo(DONE, "No heap.");
+  Random random = NULL;
 
   // Load the heap.
-  heap->destroyItem = testHeap_destroyItem;
+  if (!(random = cnRandomCreate())) cnErrTo(DONE, "No random.");
   for (i = 0; i < testHeap_COUNT; i++) {
-    Float* number = cnAlloc(Float, 1);
-    if (!number) cnErrTo(DONE, "No float %ld.", i);
-    *number = cnUnitRand();
-    if (!cnHeapPush(heap, number)) cnErrTo(DONE, "No push %ld.", i);
+    heap.push(cnUnitRand(random));
   }
 
   // Drain the heap partially.
   printf("Pulling half: ");
-  while (heap->items.count > testHeap_COUNT / 2) {
-    Float* number = reinterpret_cast<Float*>(cnHeapPull(heap));
-    printf(" %lf", *number);
-    free(number);
+  while (heap.count() > testHeap_COUNT / 2) {
+    printf(" %lf", heap.pull());
   }
   printf("\n");
 
-  // Load the heap again.
-  heap->destroyItem = testHeap_destroyItem;
+  // Load the heap again, keeping a handle.
   for (i = 0; i < testHeap_COUNT / 2; i++) {
-    Float* number = reinterpret_cast<Float*>(malloc(sizeof(Float)));
-    if (!number) cnErrTo(DONE, "No 2nd float %ld.", i);
-    *number = cnUnitRand();
-    if (!cnHeapPush(heap, number)) cnErrTo(DONE, "No 2nd push %ld.", i);
+    handle = heap.push(cnUnitRand(random));
   }
 
-  // Drain the heap completely.
-  printf("Pulling all: ");
-  while (heap->items.count) {
-    Float* number = reinterpret_cast<Float*>(cnHeapPull(heap));
-    printf(" %lf", *number);
-    free(number);
+  // Move the last pushed to the top, and drain the heap completely.
+  printf("Pulling all after raising %lf to 2: ", heap.get(handle));
+  heap.update(handle, 2);
+  while (heap.count()) {
+    printf(" %lf", heap.pull());
+  }
+  printf("\n");
+
+  // Heapify from a list, and drain again.
+  for (i = 0; i < testHeap_COUNT; i++) {
+    Float number = cnUnitRand(random);
+    if (!cnListPush(&numbers, &number)) cnErrTo(DONE, "No push %ld.", i);
+  }
+  heap.heapify(numbers);
+  // Handles match list indices, so take out one from the middle.
+  printf("Removed %lf. ", heap.remove(testHeap_COUNT / 2));
+  printf("Pulling all after heapify: ");
+  while (heap.count()) {
+    printf(" %lf", heap.pull());
   }
   printf("\n");
 
   DONE:
-  cnHeapDestroy(heap);
+  cnRandomDestroy(random);
 }
 
 
@@ -262,6 +269,98 @@ void testMultinomial() {
 }
 
 
+#define testNormalPValue_CLASS_COUNT 4
+
+/**
+ * Compares the normal approximation for the chance that one weighted
+ * multinomial sum fails to beat another against the bootstrap, as for tree
+ * scores in cnVerifyImprovement. Neg then pos for two leaves each.
+ */
+void testNormalPValue() {
+  Count bootCount = 10000;
+  Count* bootCounts[2] = {NULL, NULL};
+  Float deviation;
+  Index i;
+  Index j;
+  Index k;
+  Float means[2];
+  Multinomial multinomials[2] = {NULL, NULL};
+  Float probs[][testNormalPValue_CLASS_COUNT] = {
+    {0.35, 0.05, 0.1, 0.5}, {0.3, 0.1, 0.1, 0.5}
+  };
+  Random random = NULL;
+  Count sampleCount = 200;
+  Float variances[2];
+  Float weights[2][testNormalPValue_CLASS_COUNT];
+  Count wins = 0;
+
+  // Init, with weights from leaf probabilities as for the log metric.
+  if (!(random = cnRandomCreate())) cnErrTo(DONE, "No random.");
+  for (k = 0; k < 2; k++) {
+    for (j = 0; j < testNormalPValue_CLASS_COUNT; j += 2) {
+      Float leafProb = probs[k][j + 1] / (probs[k][j] + probs[k][j + 1]);
+      weights[k][j] = log(1 - leafProb);
+      weights[k][j + 1] = log(leafProb);
+    }
+    cnMultinomialWeightedMoments(
+      sampleCount, testNormalPValue_CLASS_COUNT, probs[k], weights[k],
+      &means[k], &variances[k]
+    );
+    if (!(
+      multinomials[k] = cnMultinomialCreate(
+        random, sampleCount, testNormalPValue_CLASS_COUNT, probs[k]
+      )
+    )) cnErrTo(DONE, "No multinomial.");
+    if (!(bootCounts[k] = cnAlloc(Count, bootCount * 4))) {
+      cnErrTo(DONE, "No boot counts.");
+    }
+    cnMultinomialSampleMany(multinomials[k], bootCount, bootCounts[k]);
+  }
+
+  // Bootstrap moments and wins for the first.
+  printf("testNormalPValue (%ld*%ld):\n", sampleCount, bootCount);
+  for (k = 0; k < 2; k++) {
+    Float sum = 0;
+    Float sumSquares = 0;
+    for (i = 0; i < bootCount; i++) {
+      Float score = 0;
+      for (j = 0; j < testNormalPValue_CLASS_COUNT; j++) {
+        score += weights[k][j] * bootCounts[k][4 * i + j];
+      }
+      sum += score;
+      sumSquares += score * score;
+    }
+    printf(
+      "Mean %lg vs %lg, variance %lg vs %lg\n",
+      means[k], sum / bootCount,
+      variances[k], (sumSquares - sum * sum / bootCount) / (bootCount - 1)
+    );
+  }
+  for (i = 0; i < bootCount; i++) {
+    Float scores[] = {0, 0};
+    for (k = 0; k < 2; k++) {
+      for (j = 0; j < testNormalPValue_CLASS_COUNT; j++) {
+        scores[k] += weights[k][j] * bootCounts[k][4 * i + j];
+      }
+    }
+    wins += scores[0] > scores[1];
+  }
+  deviation = sqrt(variances[0] + variances[1]);
+  printf(
+    "P-value %lg vs %lg\n",
+    cnNormalCdf((means[1] - means[0]) / deviation),
+    1 - wins / (Float)bootCount
+  );
+
+  DONE:
+  for (k = 0; k < 2; k++) {
+    free(bootCounts[k]);
+    cnMultinomialDestroy(multinomials[k]);
+  }
+  cnRandomDestroy(random);
+}
+
+
 bool testPermutations_handle(
   void *data, Count count, Index *permutation
 ) {
@@ -487,14 +586,130 @@ void testRadians() {
 }
 
 
+#define testSearch_COUNT 20
+
+/**
+ * Options point to values, where bigger is better.
+ */
+struct testSearch_Info {
+
+  List<Index> destroyed;
+
+  List<Index> stepped;
+
+  Index values[testSearch_COUNT];
+
+};
+
+bool testSearch_better(
+  cnSearcher* searcher, cnSearchOption a, cnSearchOption b
+) {
+  return *reinterpret_cast<Index*>(a) > *reinterpret_cast<Index*>(b);
+}
+
+void testSearch_destroy(cnSearcher* searcher, cnSearchOption option) {
+  testSearch_Info* info = reinterpret_cast<testSearch_Info*>(searcher->info);
+  if (!option) return;
+  cnListPush(&info->destroyed, reinterpret_cast<Index*>(option));
+}
+
+bool testSearch_hopeful(cnSearcher* searcher, cnSearchOption option) {
+  // Say nothing much worse than the best can lead anywhere.
+  return
+    *reinterpret_cast<Index*>(option) >=
+    *reinterpret_cast<Index*>(searcher->bestOption) - 2;
+}
+
+bool testSearch_step(
+  cnSearcher* searcher, cnSearchOption option, List<cnSearchOption>* nexts
+) {
+  testSearch_Info* info = reinterpret_cast<testSearch_Info*>(searcher->info);
+  return !!cnListPush(&info->stepped, reinterpret_cast<Index*>(option));
+}
+
+void testSearch() {
+  Count capacity = 5;
+  Count evictedCount = testSearch_COUNT - capacity;
+  Index expected[] = {19, 18, 17};
+  Index i;
+  testSearch_Info info;
+  bool okay = true;
+  cnSearcher* searcher = NULL;
+  bool seen[testSearch_COUNT] = {false};
+
+  // Set up a search that keeps only the best few options.
+  if (!(searcher = cnSearcherCreate())) cnErrTo(DONE, "No searcher.");
+  searcher->better = testSearch_better;
+  searcher->capacity = capacity;
+  searcher->destroyOption = testSearch_destroy;
+  searcher->hopeful = testSearch_hopeful;
+  searcher->info = &info;
+  searcher->step = testSearch_step;
+  for (i = 0; i < testSearch_COUNT; i++) {
+    // Scatter the values, so the heaps have some work to do.
+    cnSearchOption option = &info.values[i];
+    info.values[i] = (7 * i) % testSearch_COUNT;
+    if (!cnListPush(&searcher->initialOptions, &option)) {
+      cnErrTo(DONE, "No push.");
+    }
+  }
+  if (!cnSearch(searcher)) cnErrTo(DONE, "Search failed.");
+  cnSearcherDestroy(searcher);
+  searcher = NULL;
+
+  // Pushing past capacity should destroy the worst.
+  printf("Destroyed:");
+  cnListEachBegin(&info.destroyed, Index, value) {
+    printf(" %ld", *value);
+    if (value - (Index*)info.destroyed.items < evictedCount) {
+      okay &= *value < evictedCount;
+    }
+    okay &= !seen[*value];
+    seen[*value] = true;
+  } cnEnd;
+  printf("\n");
+  okay &= info.destroyed.count == testSearch_COUNT;
+
+  // And only the best and those near enough to it should get stepped, in
+  // order.
+  printf("Stepped:");
+  cnListEachBegin(&info.stepped, Index, value) {
+    printf(" %ld", *value);
+  } cnEnd;
+  printf("\n");
+  okay &= info.stepped.count == sizeof(expected) / sizeof(*expected);
+  for (i = 0; okay && i < info.stepped.count; i++) {
+    okay &= info.stepped[i] == expected[i];
+  }
+  printf("testSearch: %s\n", okay ? "passed" : "FAILED");
+
+  DONE:
+  cnSearcherDestroy(searcher);
+}
+
+
 void testUnitRand() {
   Index i;
+  Random random = NULL;
+  Random split = NULL;
+
   // TODO Assert stuff, calculate statistics, and so on, instead of printing.
+  if (!(random = cnRandomCreate())) cnErrTo(DONE, "No random.");
+  if (!(split = cnRandomSplit(random, 1))) cnErrTo(DONE, "No split.");
   printf("testUnitRand:\n");
   for (i = 0; i < 10; i++) {
-    printf("%lg ", cnUnitRand());
+    printf("%lg ", cnUnitRand(random));
+  }
+  printf("\n");
+  printf("testUnitRand split 1:\n");
+  for (i = 0; i < 10; i++) {
+    printf("%lg ", cnUnitRand(split));
   }
   printf("\n");
+
+  DONE:
+  cnRandomDestroy(split);
+  cnRandomDestroy(random);
 }
 
 